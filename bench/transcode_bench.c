@@ -0,0 +1,118 @@
+// Compares transcode.c with the CEF routines it replaces on ASCII, Latin-1
+// and CJK text of a few sizes. Run with `make bench`.
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "include/internal/cef_string_types.h"
+#include "src/transcode.h"
+
+// Each measurement converts about this many bytes of UTF-8.
+#define BENCH_VOLUME (256 << 20)
+
+typedef struct {
+	const char *name;
+	// Repeated to fill the input.
+	const char *text;
+} Sample;
+
+static const Sample samples[] = {
+	{ "ASCII", "<p class=\"greeting\">Hello, world!</p>\n" },
+	{ "Latin-1", "Größe, façade, señor, crème brûlée. " },
+	{ "CJK", "日本語のテキストと中文文本。" },
+};
+
+static const size_t sizes[] = { 64, 4096, 1 << 20 };
+
+static
+double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static
+char *
+fill(const char *text, size_t size)
+{
+	size_t text_length = strlen(text);
+	char *buffer = malloc(size + 1);
+	if (buffer == NULL)
+		return NULL;
+	size_t length = 0;
+	// Stop before a character would be cut in two.
+	while (length + text_length <= size) {
+		memcpy(buffer + length, text, text_length);
+		length += text_length;
+	}
+	buffer[length] = 0;
+	return buffer;
+}
+
+///
+// Prints the throughput, in MB of UTF-8 per second, of converting |utf8|
+// to UTF-16 and back with the CEF routines and with transcode.c.
+///
+static
+void
+measure(const char *name, const char *utf8, size_t utf8_length)
+{
+	cef_string_utf16_t utf16 = {};
+	cef_string_utf8_t back = {};
+	int rounds = BENCH_VOLUME / utf8_length + 1;
+	double start, cef_widen, ours_widen, cef_narrow, ours_narrow;
+
+	start = now();
+	for (int i = 0; i < rounds; i++)
+		cef_string_utf8_to_utf16(utf8, utf8_length, &utf16);
+	cef_widen = now() - start;
+
+	start = now();
+	for (int i = 0; i < rounds; i++)
+		transcode_utf8_to_utf16(utf8, utf8_length, &utf16);
+	ours_widen = now() - start;
+
+	start = now();
+	for (int i = 0; i < rounds; i++)
+		cef_string_utf16_to_utf8(utf16.str, utf16.length, &back);
+	cef_narrow = now() - start;
+
+	start = now();
+	for (int i = 0; i < rounds; i++)
+		transcode_utf16_to_utf8(utf16.str, utf16.length, &back);
+	ours_narrow = now() - start;
+
+	double megabytes = (double)utf8_length * rounds / 1e6;
+	printf("%-8s %8zu  %9.0f %9.0f  %9.0f %9.0f\n", name, utf8_length,
+	    megabytes / cef_widen, megabytes / ours_widen,
+	    megabytes / cef_narrow, megabytes / ours_narrow);
+
+	cef_string_utf16_clear(&utf16);
+	cef_string_utf8_clear(&back);
+}
+
+int
+main(void)
+{
+	printf("%-8s %8s  %9s %9s  %9s %9s\n", "", "bytes", "cef 8>16",
+	    "ours 8>16", "cef 16>8", "ours 16>8");
+
+	for (size_t s = 0; s < sizeof(samples) / sizeof(samples[0]); s++) {
+		for (size_t z = 0; z < sizeof(sizes) / sizeof(sizes[0]); z++) {
+			char *utf8 = fill(samples[s].text, sizes[z]);
+			if (utf8 == NULL) {
+				fprintf(stderr, "Out of memory\n");
+				return 1;
+			}
+			measure(samples[s].name, utf8, strlen(utf8));
+			free(utf8);
+		}
+	}
+	return 0;
+}
@@ -1,10 +1,12 @@
 require "json"
+require "stringio"
 require "capybara/webkit/errors"
 
 module Capybara::Webkit
   class Browser
     def initialize(connection)
       @connection = connection
+      @sequence = 0
     end
 
     def authenticate(username, password)
@@ -15,8 +17,26 @@ module Capybara::Webkit
       command "EnableLogging"
     end
 
-    def visit(url)
-      command "Visit", url
+    # With +network_idle+ (in seconds), also waits for the page's requests
+    # to settle for that long.
+    def visit(url, network_idle = nil)
+      if network_idle
+        command "Visit", url, (network_idle * 1000).to_i
+      else
+        command "Visit", url
+      end
+    end
+
+    # Waits until the page's requests have settled for +idle+ seconds and
+    # returns whether they did within +timeout+ seconds. With +renderer+,
+    # waits on the XMLHttpRequests, fetches and short timeouts the page
+    # itself has pending, which are tracked from the first such wait on
+    # each page.
+    def wait_for_network_idle(idle, timeout = nil, renderer = false)
+      arguments = [(idle * 1000).to_i]
+      arguments << (timeout ? (timeout * 1000).to_i : 0) if timeout || renderer
+      arguments << "renderer" if renderer
+      command("WaitForNetworkIdle", *arguments) == "true"
     end
 
     def header(key, value)
@@ -28,19 +48,42 @@ module Capybara::Webkit
     end
 
     def find_xpath(query)
-      command("FindXpath", query).split(",")
+      Browser.node_ids(command("FindXpath", query))
     end
 
     def find_css(query)
-      command("FindCss", query).split(",")
+      Browser.node_ids(command("FindCss", query))
+    end
+
+    # Node lookups answer with a list of node indexes, which arrives typed
+    # with binary framing and joined by commas otherwise.
+    def self.node_ids(response)
+      response.is_a?(Array) ? response.map(&:to_s) : response.split(",")
+    end
+
+    # Waits up to +timeout+ seconds in the browser for the nodes matching a
+    # "css" or "xpath" +query+ to be "present", "absent" or, with "count",
+    # exactly +count+ of them, and returns the nodes matching at that point.
+    def wait_for(kind, query, condition, timeout, count = nil)
+      arguments = [kind, query, condition, (timeout * 1000).to_i]
+      arguments << count if count
+      Browser.node_ids(command("WaitFor", *arguments))
     end
 
-    def reset!
-      command("Reset")
+    def reset!(hard = false)
+      if hard
+        command("Reset", "hard")
+      else
+        command("Reset")
+      end
     end
 
+    # Returns the page's HTML, reusing the copy from the previous call when
+    # the document has not mutated since.
     def body
-      command("Body")
+      response = command("BodyIfChanged", @body_epoch || "")
+      @body_epoch, @body = response.split("\n", 2) unless response == "unchanged"
+      @body
     end
 
     def status_code
@@ -202,25 +245,63 @@ module Capybara::Webkit
     end
 
     def command(name, *args)
-      @connection.puts name
-      @connection.puts args.size
-      args.each do |arg|
-        @connection.puts arg.to_s.bytesize
-        @connection.print arg.to_s
+      restart_on_crash do
+        if binary_framing?
+          read_frame(write_frame(name, args))
+        else
+          write_command(name, args)
+          check
+          read_response
+        end
       end
-      check
-      read_response
-    rescue SystemCallError => exception
-      @connection.restart
-      raise(Capybara::Webkit::CrashError, <<-MESSAGE.strip)
-The webkit_server process crashed!
-
-  #{exception.message}
+    end
 
-This is a bug in capybara-webkit. For help with this crash, please visit:
+    # Sends every command before reading any response, so that the server can
+    # work on them back to back. Returns the responses in order, or raises the
+    # first error once all responses have been read.
+    def pipeline(commands)
+      return commands.map { |name, *args| command(name, *args) } unless binary_framing?
+
+      restart_on_crash do
+        sequences = commands.map { |name, *args| write_frame(name, args) }
+        error = nil
+        responses = sequences.map do |sequence|
+          begin
+            read_frame(sequence)
+          rescue JsonError => exception
+            error ||= exception
+            nil
+          end
+        end
+        raise error if error
+        responses
+      end
+    end
 
-https://github.com/thoughtbot/capybara-webkit/wiki/Reporting-Crashes
-      MESSAGE
+    # Runs several node invocations, each an array of the function name, the
+    # allowUnattached flag, the node and the function arguments, in a single
+    # renderer round trip. Returns the results in order, or raises the first
+    # error.
+    def multi(invocations)
+      args = invocations.flat_map do |function, allow_unattached, *function_args|
+        [function, allow_unattached, function_args.size, *function_args]
+      end
+      response = StringIO.new(command("Multi", *args))
+
+      error = nil
+      results = invocations.map do
+        status = response.gets.to_s.strip
+        body = response.read(response.gets.to_i).to_s
+        body.force_encoding("UTF-8")
+        if status == "ok"
+          body
+        else
+          error ||= JsonError.new(body)
+          nil
+        end
+      end
+      raise error if error
+      results
     end
 
     def evaluate_script(script)
@@ -295,6 +376,129 @@ https://github.com/thoughtbot/capybara-webkit/wiki/Reporting-Crashes
 
     private
 
+    def restart_on_crash
+      yield
+    rescue SystemCallError => exception
+      @connection.restart
+      raise(Capybara::Webkit::CrashError, <<-MESSAGE.strip)
+The webkit_server process crashed!
+
+  #{exception.message}
+
+This is a bug in capybara-webkit. For help with this crash, please visit:
+
+https://github.com/thoughtbot/capybara-webkit/wiki/Reporting-Crashes
+      MESSAGE
+    end
+
+    def write_command(name, args)
+      @connection.puts name
+      @connection.puts args.size
+      args.each do |arg|
+        @connection.puts arg.to_s.bytesize
+        @connection.print arg.to_s
+      end
+    end
+
+    def binary_framing?
+      @connection.respond_to?(:opcodes) && @connection.opcodes
+    end
+
+    def write_frame(name, args)
+      @sequence += 1
+      opcode = @connection.opcodes[name]
+      frame =
+        if opcode
+          [opcode, @sequence].pack("Cw")
+        else
+          [0, @sequence, name.bytesize].pack("Cww") << name.b
+        end
+      frame << [args.size].pack("w")
+      args.each do |arg|
+        arg = arg.to_s
+        frame << [arg.bytesize].pack("w") << arg.b
+      end
+      @connection.write(frame)
+      @sequence
+    end
+
+    def read_frame(expected_sequence)
+      status = @connection.read(1)
+      if status.nil?
+        raise NoResponseError, "No response received from the server."
+      end
+
+      sequence = read_varint
+      if sequence != expected_sequence
+        raise InvalidResponseError,
+          "Expected response #{expected_sequence} but received #{sequence}"
+      end
+
+      length = read_varint
+
+      response = length > 0 ? @connection.read(length) : ""
+
+      case status.ord
+      when 0
+        response.force_encoding("UTF-8")
+      when 2
+        read_typed_value(StringIO.new(response.b))
+      else
+        raise JsonError.new(response.force_encoding("UTF-8"))
+      end
+    end
+
+    # Decodes a value answered with its type, laid out as described in
+    # src/framing.h.
+    def read_typed_value(io)
+      case io.readbyte
+      when 0 then nil
+      when 1 then false
+      when 2 then true
+      when 3 then unzigzag(read_typed_varint(io))
+      when 4 then io.read(8).unpack("G").first
+      when 5 then read_typed_string(io)
+      when 6 then Array.new(read_typed_varint(io)) { read_typed_value(io) }
+      when 7
+        Array.new(read_typed_varint(io)) do
+          [read_typed_string(io), read_typed_value(io)]
+        end.to_h
+      when 8
+        count = read_typed_varint(io)
+        *values, rest = io.string.unpack("@#{io.pos}w#{count}a*")
+        io.pos = io.string.bytesize - rest.bytesize
+        values.map { |value| unzigzag(value) }
+      else
+        raise InvalidResponseError, "Unknown value type in response"
+      end
+    end
+
+    def read_typed_varint(io)
+      value = 0
+      begin
+        byte = io.readbyte
+        value = (value << 7) | (byte & 0x7f)
+      end while byte & 0x80 != 0
+      value
+    end
+
+    def read_typed_string(io)
+      io.read(read_typed_varint(io)).to_s.force_encoding("UTF-8")
+    end
+
+    def unzigzag(value)
+      (value >> 1) ^ -(value & 1)
+    end
+
+    def read_varint
+      value = 0
+      begin
+        byte = @connection.read(1).ord
+        value = (value << 7) | (byte & 0x7f)
+      end while byte & 0x80 != 0
+      value
+    end
+
     def check
       result = @connection.gets
       result.strip! if result
@@ -1,13 +1,14 @@
 require 'timeout'
 require 'thread'
 require 'open3'
+require 'socket'
 
 module Capybara::Webkit
   class Connection
     SERVER_PATH = File.expand_path("../../../../Release/capybara_server", __FILE__)
     WEBKIT_SERVER_START_TIMEOUT = 15
 
-    attr_reader :port, :pid
+    attr_reader :port, :pid, :opcodes
 
     def initialize(options = {})
       if options.has_key?(:stderr)
@@ -19,6 +20,10 @@ module Capybara::Webkit
       else
         @output_target = $stderr
       end
+      @framing = options.fetch(:framing, :binary)
+      @socket_path = options[:socket]
+      @browser_pool = options[:browser_pool]
+      @shared_ring = options.fetch(:shared_ring, true)
       start_server
     end
 
@@ -30,6 +35,10 @@ module Capybara::Webkit
       @pipe_stdin.print string
     end
 
+    def write(string)
+      @pipe_stdin.write string
+    end
+
     def gets
       @pipe_stdout.gets
     end
@@ -47,23 +56,72 @@ module Capybara::Webkit
     private
 
     def start_server
-      open_pipe
-      discover_port
-      discover_pid
-      forward_output_in_background_thread
+      if @socket_path
+        open_socket
+        discover_port
+      else
+        open_pipe
+        discover_port
+        discover_pid
+        forward_output_in_background_thread
+      end
+      negotiate_framing
+    end
+
+    # Connects to a server started with --socket=PATH, which drives the
+    # browsers of every connected client from one process. The server's
+    # output goes to its own stderr.
+    def open_socket
+      @pipe_stdin = @pipe_stdout = UNIXSocket.new(@socket_path)
+      @pipe_stdin.binmode
+    rescue SystemCallError => exception
+      raise ConnectionError, "Could not connect to #{@socket_path}: #{exception.message}"
     end
 
     def open_pipe
-      @pipe_stdin, @pipe_stdout, @pipe_stderr, @wait_thr = Open3.popen3(SERVER_PATH)
+      @pipe_stdin, @pipe_stdout, @pipe_stderr, @wait_thr = Open3.popen3(SERVER_PATH, *server_arguments)
+      @pipe_stdin.binmode
+      @pipe_stdout.binmode
+    end
+
+    def server_arguments
+      arguments = []
+      arguments << "--browser-pool=#{Integer(@browser_pool)}" if @browser_pool
+      arguments << "--no-shared-ring" unless @shared_ring
+      arguments
     end
 
     def parse_port(line)
-      if line == "Ready\n"
+      if line =~ /\AReady(?: (.*))?\n\z/
+        @features = $1.to_s.split
       else
         raise ConnectionError, "#{SERVER_PATH} failed to start."
       end
     end
 
+    def negotiate_framing
+      @opcodes = nil
+      return unless @framing == :binary && @features.include?("binary")
+
+      puts "Framing"
+      puts 1
+      puts "binary".bytesize
+      print "binary"
+
+      status = gets
+      raise ConnectionError, "#{SERVER_PATH} closed the connection." if status.nil?
+
+      # A refusal carries its reason like any failure. It is read either
+      # way, so that it is not taken for the next response, and the
+      # connection stays on text framing.
+      body = read(gets.to_i)
+      if status == "ok\n"
+        names = body.split("\n")
+        @opcodes = {}
+        names.each_with_index { |name, index| @opcodes[name] = index + 1 }
+      end
+    end
+
     def discover_port #check_ready
       if IO.select([@pipe_stdout], nil, nil, WEBKIT_SERVER_START_TIMEOUT)
         parse_port(@pipe_stdout.first)
@@ -80,7 +80,7 @@ module Capybara::Webkit
     end
 
     def evaluate_script(script)
-      @browser.evaluate_script script
+      nodes_in(@browser.evaluate_script(script))
     end
 
     def console_messages
@@ -327,6 +327,22 @@ module Capybara::Webkit
 
     private
 
+    # Evaluated DOM nodes arrive as {"capybara-node" => id}.
+    def nodes_in(value)
+      case value
+      when Array
+        value.map { |item| nodes_in(item) }
+      when Hash
+        if value.keys == ["capybara-node"]
+          Node.new(self, value["capybara-node"].to_s, @browser)
+        else
+          Hash[value.map { |key, item| [key, nodes_in(item)] }]
+        end
+      else
+        value
+      end
+    end
+
     def modal_action_options_for_browser(options)
       if options[:text].is_a?(Regexp)
         options.merge(text: options[:text].source)
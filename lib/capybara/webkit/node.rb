@@ -15,15 +15,11 @@ module Capybara::Webkit
     end
 
     def [](name)
-      value = invoke("attribute", name)
       if name == 'checked' || name == 'disabled' || name == 'multiple'
-        value == 'true'
+        invoke("attribute", name) == 'true'
       else
-        if invoke("hasAttribute", name) == 'true'
-          value
-        else
-          nil
-        end
+        value, present = multi(["attribute", name], ["hasAttribute", name])
+        present == 'true' ? value : nil
       end
     end
 
@@ -43,8 +39,15 @@ module Capybara::Webkit
       invoke 'setInnerHTML', value
     end
 
-    def set(value)
-      invoke "set", *[value].flatten
+    # With +insert_text+, text fields are filled at once with a single input
+    # and change event instead of being typed, for fields that do not
+    # listen to keys.
+    def set(value, options = {})
+      if options[:insert_text]
+        invoke "insertText", value
+      else
+        invoke "set", *[value].flatten
+      end
     end
 
     def select_option
@@ -97,11 +100,7 @@ module Capybara::Webkit
     end
 
     def disabled?
-      if %w(option optgroup).include? tag_name
-        self['disabled'] || find_xpath("parent::*")[0].disabled?
-      else
-        self['disabled']
-      end
+      invoke("disabled") == "true"
     end
 
     def path
@@ -117,7 +116,7 @@ module Capybara::Webkit
     end
 
     def find_xpath(xpath)
-      invoke("findXpathWithin", xpath).split(',').map do |native|
+      Browser.node_ids(invoke("findXpathWithin", xpath)).map do |native|
         self.class.new(driver, native, @browser)
       end
     end
@@ -125,7 +124,7 @@ module Capybara::Webkit
     alias_method :find, :find_xpath
 
     def find_css(selector)
-      invoke("findCssWithin", selector).split(',').map do |native|
+      Browser.node_ids(invoke("findCssWithin", selector)).map do |native|
         self.class.new(driver, native, @browser)
       end
     end
@@ -134,6 +133,12 @@ module Capybara::Webkit
       @browser.command "Node", name, allow_unattached_nodes?, native, *args
     end
 
+    def multi(*invocations)
+      @browser.multi(invocations.map do |name, *args|
+        [name, allow_unattached_nodes?, native, *args]
+      end)
+    end
+
     def allow_unattached_nodes?
       !automatic_reload?
     end
@@ -147,7 +152,8 @@ module Capybara::Webkit
     end
 
     def multiple_select?
-      self.tag_name == "select" && self["multiple"]
+      tag_name, multiple = multi(["tagName"], ["attribute", "multiple"])
+      tag_name == "select" && multiple == "true"
     end
 
     def ==(other)
@@ -31,6 +31,73 @@ describe Capybara::Webkit::Browser do
     expect { browser.visit("/") }.not_to raise_error
   end
 
+  describe '#reset!' do
+    it 'cleans up the browser in place by default' do
+      browser.should_receive(:command).with("Reset")
+      browser.reset!
+    end
+
+    it 'replaces the browser when asked for a hard reset' do
+      browser.should_receive(:command).with("Reset", "hard")
+      browser.reset!(true)
+    end
+  end
+
+  describe '#wait_for' do
+    it 'waits in the browser with a timeout in milliseconds' do
+      browser.should_receive(:command).with("WaitFor", "css", "p", "present", 1500).and_return("3,4")
+      expect(browser.wait_for("css", "p", "present", 1.5)).to eq ["3", "4"]
+    end
+
+    it 'passes the expected count' do
+      browser.should_receive(:command).with("WaitFor", "xpath", "//p", "count", 2000, 2).and_return("")
+      expect(browser.wait_for("xpath", "//p", "count", 2, 2)).to eq []
+    end
+  end
+
+  describe '#wait_for_network_idle' do
+    it 'waits for the browser to see no requests' do
+      browser.should_receive(:command).with("WaitForNetworkIdle", 500).and_return("true")
+      expect(browser.wait_for_network_idle(0.5)).to eq true
+    end
+
+    it 'waits on the page when asked to' do
+      browser.should_receive(:command).with("WaitForNetworkIdle", 100, 0, "renderer").and_return("false")
+      expect(browser.wait_for_network_idle(0.1, nil, true)).to eq false
+    end
+  end
+
+  describe '#find_css' do
+    it 'accepts typed and comma-separated node indexes' do
+      browser.stub(:command).and_return([3, 4], "5,6")
+      expect(browser.find_css("p")).to eq ["3", "4"]
+      expect(browser.find_css("p")).to eq ["5", "6"]
+    end
+  end
+
+  describe '#body' do
+    it 'reuses the previous HTML while the document is unchanged' do
+      browser.should_receive(:command).with("BodyIfChanged", "").ordered.and_return("a.1\n<html></html>")
+      browser.should_receive(:command).with("BodyIfChanged", "a.1").ordered.and_return("unchanged")
+      expect(browser.body).to eq "<html></html>"
+      expect(browser.body).to eq "<html></html>"
+    end
+
+    it 'keeps the epoch of the latest HTML' do
+      browser.should_receive(:command).with("BodyIfChanged", "").ordered.and_return("a.1\n<p>1</p>")
+      browser.should_receive(:command).with("BodyIfChanged", "a.1").ordered.and_return("a.2\n<p>2</p>")
+      browser.body
+      expect(browser.body).to eq "<p>2</p>"
+    end
+  end
+
+  describe '#visit' do
+    it 'passes the network idle time in milliseconds' do
+      browser.should_receive(:command).with("Visit", "/", 250)
+      browser.visit("/", 0.25)
+    end
+  end
+
   describe '#command' do
     context 'non-ok response' do
       it 'raises an error of given class' do
@@ -43,5 +110,85 @@ describe Capybara::Webkit::Browser do
         expect { browser.command 'blah', 'meh' }.to raise_error(Capybara::Webkit::ClickFailed)
       end
     end
+
+    context 'multi' do
+      let(:connection) { double("connection", opcodes: { "Multi" => 1 }) }
+
+      it 'sends every invocation in one command and splits the results' do
+        connection.should_receive(:write).with("\x01\x01\x09\x07tagName\x04true\x011\x013\x09attribute\x04true\x012\x013\x04name".b)
+        response = "ok\n5\ninputok\n1\nq"
+        connection.stub(:read).and_return("\x00", "\x01", [response.bytesize].pack("w"), response)
+
+        expect(browser.multi([["tagName", true, 3], ["attribute", true, 3, "name"]])).to eq ["input", "q"]
+      end
+
+      it 'raises the first failed invocation' do
+        error_json = '{"class": "NodeNotAttachedError"}'
+        connection.stub(:write)
+        response = "ok\n5\ninputfailure\n#{error_json.bytesize}\n#{error_json}"
+        connection.stub(:read).and_return("\x00", "\x01", [response.bytesize].pack("w"), response)
+
+        expect { browser.multi([["tagName", true, 3], ["attribute", true, 3, "name"]]) }.
+          to raise_error(Capybara::Webkit::NodeNotAttachedError)
+      end
+    end
+
+    context 'binary framing' do
+      let(:connection) { double("connection", opcodes: { "Visit" => 1 }) }
+
+      it 'sends known commands by opcode and reads the framed response' do
+        connection.should_receive(:write).with("\x01\x01\x01\x03abc".b)
+        connection.stub(:read).and_return("\x00", "\x01", "\x02", "ok")
+
+        expect(browser.command("Visit", "abc")).to eq "ok"
+      end
+
+      it 'sends unknown commands by name' do
+        connection.should_receive(:write).with("\x00\x01\x04Blah\x00".b)
+        connection.stub(:read).and_return("\x00", "\x01", "\x00")
+
+        expect(browser.command("Blah")).to eq ""
+      end
+
+      it 'raises the error of a failure frame' do
+        error_json = '{"class": "ClickFailed"}'
+        connection.stub(:write)
+        connection.stub(:read).and_return("\x01", "\x01", [error_json.bytesize].pack("w"), error_json)
+
+        expect { browser.command "Visit", "abc" }.to raise_error(Capybara::Webkit::ClickFailed)
+      end
+
+      it 'raises on a response for another command' do
+        connection.stub(:write)
+        connection.stub(:read).and_return("\x00", "\x02", "\x00")
+
+        expect { browser.command "Visit", "abc" }.to raise_error(Capybara::Webkit::InvalidResponseError)
+      end
+
+      it 'decodes a typed list of node indexes' do
+        body = [8, 3].pack("CC") + [2, 4, 300].pack("w*")
+        connection.stub(:write)
+        connection.stub(:read).and_return("\x02", "\x01", [body.bytesize].pack("w"), body)
+
+        expect(browser.command("Visit", "abc")).to eq [1, 2, 150]
+      end
+
+      it 'decodes typed maps, numbers and null' do
+        body = [7, 2, 1].pack("CCC") + "a" + [3, 3].pack("CC") +
+          [1].pack("C") + "b" + [6, 2, 4].pack("CCC") + [1.5].pack("G") + [0].pack("C")
+        connection.stub(:write)
+        connection.stub(:read).and_return("\x02", "\x01", [body.bytesize].pack("w"), body)
+
+        expect(browser.command("Visit", "abc")).to eq("a" => -2, "b" => [1.5, nil])
+      end
+
+      it 'writes pipelined commands before reading their responses' do
+        connection.should_receive(:write).with("\x01\x01\x01\x01a".b).ordered
+        connection.should_receive(:write).with("\x01\x02\x01\x01b".b).ordered
+        connection.stub(:read).and_return("\x00", "\x01", "\x01", "x", "\x00", "\x02", "\x01", "y")
+
+        expect(browser.pipeline([["Visit", "a"], ["Visit", "b"]])).to eq ["x", "y"]
+      end
+    end
   end
 end
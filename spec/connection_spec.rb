@@ -1,5 +1,6 @@
 require 'spec_helper'
 require 'capybara/webkit/connection'
+require 'tmpdir'
 
 describe Capybara::Webkit::Connection do
   it "kills the process when the parent process dies", skip_on_windows: true, skip_on_jruby: true do
@@ -63,6 +64,56 @@ describe Capybara::Webkit::Connection do
       to raise_error(Capybara::Webkit::ConnectionError, error_string)
   end
 
+  it "connects to a server listening on a socket", skip_on_windows: true do
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, "capybara.sock")
+      server = UNIXServer.new(path)
+      thread = Thread.new do
+        client = server.accept
+        client.write "Ready\n"
+        client.gets.should eq "Version\n"
+        client.close
+      end
+
+      socket_connection = Capybara::Webkit::Connection.new(socket: path, framing: :text)
+      socket_connection.pid.should be_nil
+      socket_connection.puts "Version"
+      thread.join
+    end
+  end
+
+  it "stays on text framing when the server refuses binary framing", skip_on_windows: true do
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, "capybara.sock")
+      server = UNIXServer.new(path)
+      thread = Thread.new do
+        client = server.accept
+        client.write "Ready binary\n"
+        client.gets.should eq "Framing\n"
+        client.gets.should eq "1\n"
+        client.read(client.gets.to_i).should eq "binary"
+        reason = '{"class":"ArgumentError","message":"Unsupported framing"}'
+        client.write "failure\n#{reason.bytesize}\n#{reason}"
+        client.gets.should eq "Version\n"
+        client.gets.should eq "0\n"
+        client.write "ok\n3\n1.0"
+        client.close
+      end
+
+      socket_connection = Capybara::Webkit::Connection.new(socket: path)
+      socket_connection.puts "Version"
+      socket_connection.puts 0
+      socket_connection.gets.should eq "ok\n"
+      socket_connection.read(socket_connection.gets.to_i).should eq "1.0"
+      thread.join
+    end
+  end
+
+  it "raises an error if nothing listens on the socket", skip_on_windows: true do
+    expect { Capybara::Webkit::Connection.new(socket: "/nonexistent/capybara.sock") }.
+      to raise_error(Capybara::Webkit::ConnectionError, /nonexistent/)
+  end
+
   it "boots a server to talk to" do
     url = "http://#{@rack_server.host}:#{@rack_server.port}/"
     connection.puts "Visit"
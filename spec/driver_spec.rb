@@ -304,6 +304,27 @@ describe Capybara::Webkit::Driver do
     it "does not strip HTML tags" do
       driver.html.should =~ /<html>/
     end
+
+    it "returns the same HTML when the document has not changed" do
+      first = driver.html
+      driver.html.should eq first
+    end
+
+    it "returns new HTML when the body changes between calls" do
+      driver.html.should include("This Is HTML!")
+      driver.execute_script(
+        "document.querySelector('h1').textContent = 'Changed HTML'")
+      html = driver.html
+      html.should include("Changed HTML")
+      html.should_not include("This Is HTML!")
+    end
+
+    it "returns new HTML when an attribute changes between calls" do
+      driver.html.should_not include("data-changed")
+      driver.execute_script(
+        "document.querySelector('h1').setAttribute('data-changed', 'yes')")
+      driver.html.should include('data-changed="yes"')
+    end
   end
 
   context "binary content app" do
@@ -504,6 +525,37 @@ describe Capybara::Webkit::Driver do
       result.should eq [1, 2]
     end
 
+    it "evaluates Javascript and returns a date" do
+      result = driver.evaluate_script(%<new Date(Date.UTC(2015, 0, 2, 3, 4, 5, 6))>)
+      result.should eq "2015-01-02T03:04:05.006Z"
+    end
+
+    it "evaluates Javascript and returns a node" do
+      result = driver.evaluate_script(%<document.getElementById('greeting')>)
+      result.should be_a Capybara::Webkit::Node
+      result.text.should eq "hello"
+    end
+
+    it "evaluates Javascript and returns nodes within an object" do
+      result = driver.evaluate_script(%<({ greeting: [document.getElementById('greeting')] })>)
+      result["greeting"].first.text.should eq "hello"
+    end
+
+    it "leaves functions and undefined out of evaluated objects" do
+      result = driver.evaluate_script(%<({ a: 1, b: undefined, c: function () {} })>)
+      result.should eq 'a' => 1
+    end
+
+    it "raises an error for a circular evaluated structure" do
+      expect { driver.evaluate_script(%<(function () { var a = []; a.push(a); return a; })()>) }.
+        to raise_error(Capybara::Webkit::InvalidResponseError, /circular/)
+    end
+
+    it "raises an error for failing evaluated Javascript" do
+      expect { driver.evaluate_script(%<invalid "salad">) }.
+        to raise_error(Capybara::Webkit::InvalidResponseError)
+    end
+
     it "executes Javascript" do
       driver.execute_script(%<document.getElementById('greeting').innerHTML = 'yo'>)
       driver.find_xpath("//p[contains(., 'yo')]").should_not be_empty
@@ -537,6 +589,14 @@ describe Capybara::Webkit::Driver do
       driver.find_xpath("//*[@id='invisible_with_visibility']").first.should_not be_visible
     end
 
+    it "notices elements hidden after they were found visible" do
+      paragraph = driver.find_xpath("//p").first
+      paragraph.should be_visible
+      driver.execute_script(%<document.getElementsByTagName('p')[0].parentNode.style.display = 'none'>)
+      paragraph.should_not be_visible
+      paragraph.visible_text.should eq ""
+    end
+
     it "returns the document title" do
       driver.title.should eq "Title"
     end
@@ -584,6 +644,63 @@ describe Capybara::Webkit::Driver do
     end
   end
 
+  context "stylesheet visibility app" do
+    let(:driver) do
+      driver_for_html(<<-HTML)
+        <html>
+          <head><style id="rules"></style></head>
+          <body>
+            <input type="checkbox" id="box">
+            <p id="target">Target</p>
+          </body>
+        </html>
+      HTML
+    end
+
+    before { visit("/") }
+
+    def target_visible?
+      driver.find_css("#target").first.visible?
+    end
+
+    it "notices a stylesheet rule toggling visibility" do
+      expect(target_visible?).to be true
+      driver.execute_script('document.getElementById("rules").sheet.insertRule("#target { display: none }", 0)')
+      expect(target_visible?).to be false
+      driver.execute_script('document.getElementById("rules").sheet.deleteRule(0)')
+      expect(target_visible?).to be true
+    end
+
+    it "notices a rule's style being edited" do
+      driver.execute_script('document.getElementById("rules").sheet.insertRule("#target { color: red }", 0)')
+      expect(target_visible?).to be true
+      driver.execute_script('document.getElementById("rules").sheet.cssRules[0].style.setProperty("visibility", "hidden")')
+      expect(target_visible?).to be false
+    end
+
+    it "notices a checkbox checked from script" do
+      driver.execute_script('document.getElementById("rules").sheet.insertRule("#box:checked + p { display: none }", 0)')
+      expect(target_visible?).to be true
+      driver.execute_script('document.getElementById("box").checked = true')
+      expect(target_visible?).to be false
+    end
+
+    it "notices a stylesheet that loads after it was inserted" do
+      expect(target_visible?).to be true
+      driver.execute_script(<<-JS)
+        var link = document.createElement("link");
+        link.rel = "stylesheet";
+        link.href = "data:text/css,%23target%20%7B%20display%3A%20none%20%7D";
+        document.head.appendChild(link);
+      JS
+      target_visible?
+      Timeout.timeout(5) do
+        sleep 0.05 until driver.evaluate_script("document.styleSheets.length") == 2
+      end
+      expect(target_visible?).to be false
+    end
+  end
+
   context "console messages app" do
     let(:driver) do
       driver_for_html(<<-HTML)
@@ -1244,6 +1361,18 @@ describe Capybara::Webkit::Driver do
       textarea.value.should eq "newvalue"
     end
 
+    it "sets an input's value with accented and CJK characters" do
+      input = driver.find_xpath("//input").first
+      input.set("Crème brûlée 日本語")
+      input.value.should eq "Crème brûlée 日本語"
+    end
+
+    it "sets a textarea's value with accented and CJK characters" do
+      textarea = driver.find_xpath("//textarea").first
+      textarea.set("Ñandú 中文")
+      textarea.value.should eq "Ñandú 中文"
+    end
+
     let(:monkey_option)   { driver.find_xpath("//option[@id='select-option-monkey']").first }
     let(:capybara_option) { driver.find_xpath("//option[@id='select-option-capybara']").first }
     let(:animal_select)   { driver.find_xpath("//select[@name='animal']").first }
@@ -1379,6 +1508,11 @@ describe Capybara::Webkit::Driver do
     it "should see enabled options in disabled select as disabled" do
       driver.find_css("#select-option-disabled").first.should be_disabled
     end
+
+    it "should see options in an enabled select and group as enabled" do
+      driver.find_css("#topping-apple").first.should_not be_disabled
+      driver.find_css("#select-option-monkey").first.should_not be_disabled
+    end
   end
 
   context "dom events" do
@@ -1495,6 +1629,12 @@ describe Capybara::Webkit::Driver do
       end
     end
 
+    it "inserts text with a single input and change when asked to" do
+      driver.find_xpath("//input[@type='text']").first.set(newtext, insert_text: true)
+      driver.find_xpath("//li").map(&:visible_text).should eq %w(focus input change)
+      driver.find_xpath("//input[@type='text']").first.value.should eq newtext
+    end
+
     it "triggers events for cleared inputs" do
       driver.find_xpath("//input[@type='text']").first.set('')
       driver.find_xpath("//body").first.click
@@ -1620,6 +1760,78 @@ describe Capybara::Webkit::Driver do
     end
   end
 
+  context "click dispatch app" do
+    let(:driver) do
+      driver_for_html(<<-HTML)
+        <html><body>
+          <button id="seen">Seen</button>
+          <button id="swallowed">Swallowed</button>
+          <button id="slow">Slow</button>
+          <p id="clicks"></p>
+          <script type="text/javascript">
+            function record(name) {
+              return function () {
+                document.getElementById("clicks").innerText += name;
+              };
+            }
+            var seen = document.getElementById("seen");
+            seen.addEventListener("click", record("seen"));
+            seen.addEventListener("dblclick", record("double"));
+            seen.addEventListener("contextmenu", record("context"));
+            var slow = document.getElementById("slow");
+            slow.addEventListener("mousedown", function () {
+              var until = Date.now() + 3000;
+              while (Date.now() < until);
+            });
+            slow.addEventListener("click", record("slow"));
+            window.addEventListener("click", function (event) {
+              if (event.target.id === "swallowed")
+                event.stopImmediatePropagation();
+            }, true);
+            window.addEventListener("dblclick", function (event) {
+              if (event.target.id === "swallowed")
+                event.stopImmediatePropagation();
+            }, true);
+          </script>
+        </body></html>
+      HTML
+    end
+
+    before { visit("/") }
+
+    it "answers a click once the page has dispatched it" do
+      driver.find_css("#seen").first.click
+      expect(driver.find_css("#clicks").first.visible_text).to eq "seen"
+    end
+
+    it "fails a click the page never sees and stays in sync" do
+      expect { driver.find_css("#swallowed").first.click }.
+        to raise_error(Capybara::Webkit::ClickFailed, /did not receive the click/)
+      expect(driver.evaluate_script("1 + 1")).to eq 2
+    end
+
+    it "answers a click the page is slow to dispatch" do
+      driver.find_css("#slow").first.click
+      expect(driver.find_css("#clicks").first.visible_text).to eq "slow"
+    end
+
+    it "answers a double click once the page has dispatched dblclick" do
+      driver.find_css("#seen").first.double_click
+      expect(driver.find_css("#clicks").first.visible_text).to eq "seenseendouble"
+    end
+
+    it "fails a double click whose dblclick the page never sees" do
+      expect { driver.find_css("#swallowed").first.double_click }.
+        to raise_error(Capybara::Webkit::ClickFailed, /did not receive the click/)
+      expect(driver.evaluate_script("1 + 1")).to eq 2
+    end
+
+    it "answers a right click without waiting for a click" do
+      driver.find_css("#seen").first.right_click
+      expect(driver.find_css("#clicks").first.visible_text).to eq "context"
+    end
+  end
+
   context "nesting app" do
     let(:driver) do
       driver_for_html(<<-HTML)
@@ -1665,6 +1877,158 @@ describe Capybara::Webkit::Driver do
     end
   end
 
+  context "network idle app" do
+    let(:driver) do
+      driver_for_html(<<-HTML)
+        <html><body>
+          <p id="ticks">0</p>
+          <script>
+            var ticks = 0;
+            function tick() {
+              document.getElementById("ticks").innerText = ++ticks;
+              setTimeout(tick, 50);
+            }
+            setTimeout(tick, 50);
+          </script>
+        </body></html>
+      HTML
+    end
+
+    before { visit("/") }
+
+    it "goes idle on a page with a recurring short timer" do
+      expect(driver.browser.wait_for_network_idle(0.2, 2, true)).to eq true
+      expect(driver.evaluate_script("ticks")).to be > 0
+    end
+
+    it "leaves the page's timers alone until asked to track them" do
+      expect(driver.evaluate_script("window.setTimeout.toString()")).to include "[native code]"
+      driver.browser.wait_for_network_idle(0.1, 1, true)
+      expect(driver.evaluate_script("window.setTimeout.toString()")).not_to include "[native code]"
+    end
+
+    it "waits for a short timer started after tracking began" do
+      driver.browser.wait_for_network_idle(0.1, 1, true)
+      driver.execute_script("window.fired = false; setTimeout(function () { window.fired = true; }, 500)")
+      expect(driver.browser.wait_for_network_idle(0.1, 2, true)).to eq true
+      expect(driver.evaluate_script("window.fired")).to eq true
+    end
+  end
+
+  context "wait for app" do
+    let(:driver) do
+      driver_for_html(<<-HTML)
+        <html><body>
+          <ul id="list"><li id="first">First</li></ul>
+          <script>
+            function later(delay, change) {
+              setTimeout(change, delay);
+            }
+            function addItem(id) {
+              var item = document.createElement("li");
+              item.id = id;
+              document.getElementById("list").appendChild(item);
+            }
+          </script>
+        </body></html>
+      HTML
+    end
+
+    before { visit("/") }
+
+    def timed
+      started = Time.now
+      result = yield
+      [result, Time.now - started]
+    end
+
+    it "answers once an element appears" do
+      driver.execute_script('later(300, function () { addItem("late"); })')
+      ids, elapsed = timed { driver.browser.wait_for("css", "#late", "present", 5) }
+      expect(ids).to eq [driver.find_css("#late").first.native]
+      expect(elapsed).to be < 4
+    end
+
+    it "answers once an element is gone" do
+      driver.execute_script('later(300, function () { document.getElementById("first").remove(); })')
+      ids, elapsed = timed { driver.browser.wait_for("xpath", "//li[@id='first']", "absent", 5) }
+      expect(ids).to eq []
+      expect(driver.find_css("#first")).to be_empty
+      expect(elapsed).to be < 4
+    end
+
+    it "answers once the count is reached" do
+      driver.execute_script(<<-JS)
+        later(100, function () { addItem("second"); });
+        later(200, function () { addItem("third"); });
+      JS
+      ids = driver.browser.wait_for("css", "li", "count", 5, 3)
+      expect(ids.size).to eq 3
+      expect(driver.find_css("li").map(&:native)).to eq ids
+    end
+
+    it "answers with the current matches once the timeout passes" do
+      ids, elapsed = timed { driver.browser.wait_for("css", "#never", "present", 0.3) }
+      expect(ids).to eq []
+      expect(elapsed).to be >= 0.3
+      expect(elapsed).to be < 1.3
+
+      ids = driver.browser.wait_for("css", "li", "absent", 0.3)
+      expect(ids).to eq [driver.find_css("#first").first.native]
+
+      ids = driver.browser.wait_for("css", "li", "count", 0.3, 2)
+      expect(ids.size).to eq 1
+    end
+
+    it "answers empty a second after the timeout when the page goes away" do
+      driver.execute_script('later(100, function () { location.href = "/gone"; })')
+      ids, elapsed = timed { driver.browser.wait_for("css", "#never", "present", 0.5) }
+      expect(ids).to eq []
+      expect(elapsed).to be >= 1.4
+      expect(driver.current_url).to end_with "/gone"
+      expect(driver.evaluate_script("1 + 1")).to eq 2
+    end
+  end
+
+  context "pooled browser app" do
+    let(:connection) { Capybara::Webkit::Connection.new(browser_pool: 1) }
+    let(:browser) { Capybara::Webkit::Browser.new(connection) }
+    let(:driver) do
+      driver_for_app(browser: browser) do
+        get "/slow.png" do
+          sleep(0.5)
+          ""
+        end
+
+        get "/" do
+          <<-HTML
+            <html><body>
+              <img src="/slow.png">
+              <script type="text/javascript">
+                window.addEventListener("load", function () {
+                  var p = document.createElement("p");
+                  p.id = "loaded";
+                  p.innerText = "Loaded";
+                  document.body.appendChild(p);
+                });
+              </script>
+            </body></html>
+          HTML
+        end
+      end
+    end
+
+    it "waits for loads in a window taken from the pool by a hard reset" do
+      visit("/")
+      # Gives the pool time to load its blank browser.
+      sleep(1)
+      driver.browser.reset!(true)
+      visit("/")
+      expect(driver.find_css("#loaded").first.visible_text).to eq "Loaded"
+      expect(driver.html).to include "slow.png"
+    end
+  end
+
   context "error app" do
     let(:driver) do
       driver_for_app do
@@ -1888,6 +2252,118 @@ describe Capybara::Webkit::Driver do
     end
   end
 
+  context "reset storage app" do
+    let(:driver) do
+      driver_for_app do
+        get "/" do
+          <<-HTML
+            <html><body>
+              <p id="cookie">#{request.cookies["cookie"] || ""}</p>
+              <p id="stored"></p>
+              <script type="text/javascript">
+                document.getElementById("stored").innerHTML =
+                  localStorage.getItem("stored") || "";
+              </script>
+            </body></html>
+          HTML
+        end
+      end
+    end
+
+    def store_cookie_and_item(host_url = url("/"))
+      driver.visit(host_url)
+      driver.set_cookie "cookie=abc; domain=#{URI(host_url).host}; path=/"
+      driver.execute_script 'localStorage.setItem("stored", "xyz")'
+      driver.visit(host_url)
+      echoed("cookie").should eq "abc"
+      echoed("stored").should eq "xyz"
+    end
+
+    def echoed(id)
+      driver.find_xpath("id('#{id}')").first.visible_text
+    end
+
+    it "clears cookies and local storage on reset" do
+      store_cookie_and_item
+      driver.reset!
+      visit "/"
+      echoed("cookie").should eq ""
+      echoed("stored").should eq ""
+    end
+
+    it "clears the storage of every origin visited before a reset" do
+      other_url = url("/").sub("127.0.0.1", "localhost")
+      store_cookie_and_item(other_url)
+      store_cookie_and_item
+      driver.reset!
+      driver.visit(other_url)
+      echoed("cookie").should eq ""
+      echoed("stored").should eq ""
+      visit "/"
+      echoed("cookie").should eq ""
+      echoed("stored").should eq ""
+    end
+  end
+
+  context "node registry app" do
+    let(:driver) do
+      driver_for_html(<<-HTML)
+        <html><body>
+          <p id="kept">Kept</p>
+          <p id="removed">Removed</p>
+          <p id="moved">Moved</p>
+        </body></html>
+      HTML
+    end
+
+    before { visit("/") }
+
+    def sweep
+      driver.execute_script("Capybara.sweepNodes()")
+    end
+
+    it "keeps handles to attached nodes across sweeps" do
+      kept = driver.find_css("#kept").first
+      2.times { sweep }
+      expect(kept.text).to eq "Kept"
+      expect(driver.find_css("#kept").first).to eq kept
+    end
+
+    it "expires handles to nodes detached for two sweeps" do
+      removed = driver.find_css("#removed").first
+      driver.execute_script("document.body.removeChild(document.getElementById('removed'))")
+      2.times { sweep }
+      driver.execute_script("document.body.appendChild(document.createElement('p')).id = 'removed'")
+      expect { removed.text }.to raise_error(Capybara::Webkit::NodeNotAttachedError)
+      replacement = driver.find_css("#removed").first
+      expect { removed.text }.to raise_error(Capybara::Webkit::NodeNotAttachedError)
+      expect(replacement.native).not_to eq removed.native
+    end
+
+    it "keeps handles to nodes reattached before the second sweep" do
+      moved = driver.find_css("#moved").first
+      driver.execute_script("window.moved = document.body.removeChild(document.getElementById('moved'))")
+      sweep
+      driver.execute_script("document.body.appendChild(window.moved)")
+      sweep
+      expect(moved.text).to eq "Moved"
+    end
+
+    it "sweeps while registering many nodes" do
+      kept = driver.find_css("#kept").first
+      removed = driver.find_css("#removed").first
+      driver.execute_script(<<-JS)
+        document.body.removeChild(document.getElementById('removed'));
+        for (var i = 0; i < 3000; i++)
+          document.body.appendChild(document.createElement('span'));
+      JS
+      expect(driver.find_css("span").size).to eq 3000
+      expect { removed.text }.to raise_error(Capybara::Webkit::NodeNotAttachedError)
+      expect(driver.evaluate_script("Capybara.nodeCount")).to eq 3001
+      expect(kept.text).to eq "Kept"
+    end
+  end
+
   context "remove node app" do
     let(:driver) do
       driver_for_html(<<-HTML)
@@ -2462,6 +2938,51 @@ CACHE MANIFEST
       driver.switch_to_window(driver.window_handles.last)
       driver.html.should be_empty
     end
+
+    it "opens, switches to and closes a window" do
+      visit("/new_window")
+      original_handle = driver.current_window_handle
+      driver.open_new_window
+      opened_handle = driver.window_handles.last
+      driver.switch_to_window(opened_handle)
+      driver.current_window_handle.should eq opened_handle
+      driver.close_window(opened_handle)
+
+      driver.window_handles.should_not include(opened_handle)
+      driver.switch_to_window(original_handle)
+      driver.find_xpath("//p").first.visible_text.should eq "bananas"
+    end
+
+    it "runs renderer commands pipelined behind a window switch in the new window" do
+      visit("/new_window")
+      original_handle = driver.current_window_handle
+      handle = driver.window_handles.last
+      responses = driver.browser.pipeline([
+        ["WindowFocus", handle],
+        ["Evaluate", "document.querySelector('p').innerText"],
+        ["WindowFocus", original_handle],
+        ["Evaluate", "document.querySelector('p').innerText"]
+      ])
+      texts = [responses[1], responses[3]].map { |json| JSON.parse("[#{json}]").first }
+      texts.should eq ["finished", "bananas"]
+    end
+
+    it "survives commands pipelined behind a window close" do
+      visit("/new_window")
+      handle = driver.window_handles.last
+      begin
+        driver.browser.pipeline([
+          ["WindowClose", handle],
+          ["WindowClose", handle],
+          ["WindowFocus", handle],
+          ["WindowSize", handle]
+        ])
+      rescue Capybara::Webkit::NoSuchWindowError
+      end
+
+      driver.window_handles.should_not include(handle)
+      driver.find_xpath("//p").first.visible_text.should eq "bananas"
+    end
   end
 
   it "preserves cookies across windows" do
@@ -2824,6 +3345,17 @@ CACHE MANIFEST
       lambda { driver.status_code }.should raise_error(Timeout::Error)
     end
 
+    it "should raise a timeout for a streamed body and stay in sync" do
+      configure { |config| config.timeout = 3 }
+      visit("/")
+      driver.timeout = 1
+      driver.find_xpath("//input").first.click
+      lambda { driver.html }.should raise_error(Timeout::Error)
+      driver.timeout = 10
+      driver.find_xpath("//input").size.should eq 1
+      driver.html.should include "Submit"
+    end
+
     it "get timeout" do
       configure { |config| config.timeout = 10 }
       driver.browser.timeout.should eq 10
@@ -2945,6 +3477,84 @@ CACHE MANIFEST
     end
   end
 
+  context "large body app" do
+    let(:driver) do
+      driver_for_html(<<-HTML)
+        <html><body>
+          <script type="text/javascript">
+            var faces = new Array(40001).join("\\uD83D\\uDE00");
+            // The text between the two runs of faces has an odd length, so
+            // a 64K chunk boundary lands between the halves of a surrogate
+            // pair in one of them.
+            document.body.innerHTML = "<p id='first'>\\u00e9" + faces +
+              "</p><p>ab" + faces + "</p>";
+          </script>
+        </body></html>
+      HTML
+    end
+
+    before { visit("/") }
+
+    it "streams a body larger than one chunk intact" do
+      html = driver.html
+      expect(html.encoding).to eq Encoding::UTF_8
+      expect(html).to be_valid_encoding
+      expect(html.count("\u{1F600}")).to eq 80_000
+      expect(html).to include "<p id=\"first\">\u00e9\u{1F600}"
+      expect(html).to include "</p><p>ab\u{1F600}"
+    end
+
+    it "stays in sync after a large body" do
+      driver.browser.command("Body")
+      expect(driver.evaluate_script("1 + 1")).to eq 2
+      expect(driver.find_css("#first").size).to eq 1
+    end
+  end
+
+  context "large result app" do
+    let(:driver) do
+      driver_for_html(<<-HTML)
+        <html><body><p id="end">End</p></body></html>
+      HTML
+    end
+
+    before { visit("/") }
+
+    it "returns a result above the shared ring threshold" do
+      result = driver.evaluate_script("new Array(300001).join('\u00e9')")
+      expect(result.length).to eq 300_000
+      expect(result).to eq "\u00e9" * 300_000
+    end
+
+    it "returns results that wrap around the shared ring" do
+      5.times do |round|
+        result = driver.evaluate_script("'#{round}' + new Array(20 * 1024 * 1024).join('x')")
+        expect(result.length).to eq 20 * 1024 * 1024
+        expect(result[0]).to eq round.to_s
+        expect(result[-1]).to eq "x"
+      end
+      expect(driver.find_css("#end").first.visible_text).to eq "End"
+    end
+
+    context "when the browser process cannot open the ring" do
+      let(:connection) { Capybara::Webkit::Connection.new(shared_ring: false) }
+      let(:browser) { Capybara::Webkit::Browser.new(connection) }
+      let(:driver) do
+        driver_for_html(<<-HTML, browser: browser)
+          <html><body><p id="end">End</p></body></html>
+        HTML
+      end
+
+      it "sends large results in the message instead" do
+        2.times do
+          result = driver.evaluate_script("new Array(300001).join('y')")
+          expect(result).to eq "y" * 300_000
+        end
+        expect(driver.find_css("#end").first.visible_text).to eq "End"
+      end
+    end
+  end
+
   context "version" do
     let(:driver) do
       driver_for_html(<<-HTML)
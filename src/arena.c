@@ -0,0 +1,114 @@
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_BLOCK_SIZE 4096
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static Arena *free_arenas = NULL;
+
+static atomic_size_t live_bytes;
+static atomic_size_t reserved_bytes;
+
+static
+ArenaBlock *
+allocate_block(size_t size)
+{
+	ArenaBlock *block = malloc(sizeof(ArenaBlock) + size);
+	block->next = NULL;
+	block->size = size;
+	block->used = 0;
+	atomic_fetch_add(&reserved_bytes, size);
+	return block;
+}
+
+Arena *
+arena_acquire(void)
+{
+	pthread_mutex_lock(&pool_lock);
+	Arena *arena = free_arenas;
+	if (arena != NULL)
+		free_arenas = arena->next_free;
+	pthread_mutex_unlock(&pool_lock);
+
+	if (arena == NULL) {
+		arena = calloc(1, sizeof(Arena));
+		arena->blocks = allocate_block(ARENA_BLOCK_SIZE);
+	}
+
+	arena->next_free = NULL;
+	return arena;
+}
+
+///
+// Keeps the first default-sized block for the next command and frees the
+// rest, so a command with a large footprint does not pin that memory.
+///
+static
+void
+arena_reset(Arena *arena)
+{
+	ArenaBlock *kept = NULL;
+	ArenaBlock *block = arena->blocks;
+	while (block != NULL) {
+		ArenaBlock *next = block->next;
+		atomic_fetch_sub(&live_bytes, block->used);
+		if (kept == NULL && block->size == ARENA_BLOCK_SIZE) {
+			kept = block;
+			kept->used = 0;
+			kept->next = NULL;
+		} else {
+			atomic_fetch_sub(&reserved_bytes, block->size);
+			free(block);
+		}
+		block = next;
+	}
+
+	arena->blocks = kept != NULL ? kept : allocate_block(ARENA_BLOCK_SIZE);
+}
+
+void
+arena_release(Arena *arena)
+{
+	if (arena == NULL)
+		return;
+
+	arena_reset(arena);
+
+	pthread_mutex_lock(&pool_lock);
+	arena->next_free = free_arenas;
+	free_arenas = arena;
+	pthread_mutex_unlock(&pool_lock);
+}
+
+void *
+arena_alloc(Arena *arena, size_t size)
+{
+	size_t alignment = alignof(max_align_t);
+	size = (size + alignment - 1) & ~(alignment - 1);
+
+	ArenaBlock *block = arena->blocks;
+	if (block->size - block->used < size) {
+		block = allocate_block(size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE);
+		block->next = arena->blocks;
+		arena->blocks = block;
+	}
+
+	void *memory = (char *)block->data + block->used;
+	block->used += size;
+	atomic_fetch_add(&live_bytes, size);
+
+	memset(memory, 0, size);
+	return memory;
+}
+
+void
+arena_statistics(size_t *live, size_t *reserved)
+{
+	*live = atomic_load(&live_bytes);
+	*reserved = atomic_load(&reserved_bytes);
+}
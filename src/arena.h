@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stddef.h>
+
+typedef struct _ArenaBlock {
+	struct _ArenaBlock *next;
+	size_t size;
+	size_t used;
+	max_align_t data[];
+} ArenaBlock;
+
+///
+// Bump allocator for everything owned by one command. Memory handed out by
+// arena_alloc() is zeroed and stays valid until the arena is released back
+// to the pool, which happens once the command's response has been written.
+///
+typedef struct _Arena {
+	ArenaBlock *blocks;
+	struct _Arena *next_free;
+} Arena;
+
+Arena *arena_acquire(void);
+void arena_release(Arena *arena);
+void *arena_alloc(Arena *arena, size_t size);
+
+///
+// Returns the number of bytes currently handed out by all arenas and the
+// number of bytes reserved for their blocks.
+///
+void arena_statistics(size_t *live_bytes, size_t *reserved_bytes);
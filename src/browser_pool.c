@@ -0,0 +1,128 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "browser_pool.h"
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static Context **ready;
+static int ready_count;
+static int starting_count;
+static int pool_size;
+static int closed;
+
+static
+void
+idle_window_loaded(Context *context)
+{ }
+
+///
+// Called for the first load of a pooled window, which is its about:blank.
+///
+static
+void
+pooled_window_loaded(Context *context)
+{
+	pthread_mutex_lock(&pool_lock);
+	starting_count--;
+	if (closed) {
+		pthread_mutex_unlock(&pool_lock);
+		cef_browser_host_t *host = context->browser->get_host(context->browser);
+		host->close_browser(host, 1);
+		host->base.release((cef_base_t *)host);
+		return;
+	}
+	// Set before the window is published, so that it cannot overwrite
+	// what Reset sets once it takes the window.
+	context->on_load_end = idle_window_loaded;
+	ready[ready_count++] = context;
+	pthread_mutex_unlock(&pool_lock);
+
+	fprintf(stderr, "Pooled browser %d ready\n", context->handle);
+}
+
+static
+void
+CEF_CALLBACK
+refill(cef_task_t *self)
+{
+	pthread_mutex_lock(&pool_lock);
+	int missing = closed ? 0 : pool_size - ready_count - starting_count;
+	if (missing > 0)
+		starting_count += missing;
+	pthread_mutex_unlock(&pool_lock);
+
+	for (int i = 0; i < missing; i++) {
+		Context *context = create_window(NULL);
+		context->on_load_end = pooled_window_loaded;
+		start_browser(context);
+	}
+}
+
+static
+void
+post_refill(void)
+{
+	cef_task_t *t = calloc(1, sizeof(cef_task_t));
+	t->base.size = sizeof(cef_task_t);
+	t->execute = refill;
+	cef_post_task(TID_UI, t);
+}
+
+void
+initialize_browser_pool(int size)
+{
+	pool_size = size;
+	ready = calloc(size > 0 ? size : 1, sizeof(Context *));
+	if (size > 0)
+		post_refill();
+}
+
+Context *
+take_pooled_window(void)
+{
+	Context *context = NULL;
+
+	pthread_mutex_lock(&pool_lock);
+	if (ready_count > 0) {
+		context = ready[0];
+		ready_count--;
+		for (int i = 0; i < ready_count; i++)
+			ready[i] = ready[i + 1];
+	}
+	pthread_mutex_unlock(&pool_lock);
+
+	if (pool_size > 0)
+		post_refill();
+	return context;
+}
+
+static
+void
+CEF_CALLBACK
+close_pooled_windows(cef_task_t *self)
+{
+	pthread_mutex_lock(&pool_lock);
+	closed = 1;
+	int count = ready_count;
+	Context *windows[count > 0 ? count : 1];
+	for (int i = 0; i < count; i++)
+		windows[i] = ready[i];
+	ready_count = 0;
+	pthread_mutex_unlock(&pool_lock);
+
+	for (int i = 0; i < count; i++) {
+		cef_browser_host_t *host = windows[i]->browser->get_host(windows[i]->browser);
+		host->close_browser(host, 1);
+		host->base.release((cef_base_t *)host);
+	}
+}
+
+void
+close_browser_pool(void)
+{
+	cef_task_t *t = calloc(1, sizeof(cef_task_t));
+	t->base.size = sizeof(cef_task_t);
+	t->execute = close_pooled_windows;
+	cef_post_task(TID_UI, t);
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "context.h"
+
+///
+// Sets how many blank windows are kept ready for Reset and starts creating
+// them. Must be called on the UI thread.
+///
+void initialize_browser_pool(int size);
+
+///
+// Takes a window whose browser has loaded about:blank out of the pool, or
+// returns NULL if none is ready. The pool is refilled in the background.
+// Called on the UI thread, where the window is handed over.
+///
+Context *take_pooled_window(void);
+
+///
+// Closes the windows left in the pool. Safe to call from any thread.
+///
+void close_browser_pool(void);
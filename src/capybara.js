@@ -1,17 +1,62 @@
 Capybara = {
-  nextIndex: 0,
-  nodes: {},
+  // Found nodes are registered under ids made of a slot in |nodes|, in the
+  // low bits, and the generation of that slot. |nodeIds| gives the id of a
+  // node already registered. A node found detached by two sweeps in a row
+  // is dropped, and its slot is reused under the next generation so that
+  // its old id no longer resolves. Slot 0 is never used and ids stay below
+  // 2^31.
+  nodeSlotBits: 20,
+  nodeGenerations: 2048,
+  nodes: [null],
+  generations: [0],
+  detachedSlots: [false],
+  freeSlots: [],
+  nodeIds: new WeakMap(),
+  nodeCount: 0,
+  registrationsUntilSweep: 1024,
+  // What getNodeFacts() and isNodeVisible() found out about nodes, kept
+  // while the epoch they were found in lasts.
+  nodeFacts: new WeakMap(),
+  nodeFactsEpoch: -1,
+  visibilities: new WeakMap(),
+  visibilitiesEpoch: "",
   attachedFiles: [],
 
-  invoke: function () {
+  invoke: function (fn) {
     try {
-      return this[CapybaraInvocation.functionName].apply(this, CapybaraInvocation.arguments);
+      return fn.apply(this, Array.prototype.slice.call(arguments, 1));
     } catch(e) {
       window.CapybaraInvocationError = e;
       throw new Error();
     }
   },
 
+  softReset: function () {
+    try { localStorage.clear(); } catch (e) {}
+    try { sessionStorage.clear(); } catch (e) {}
+    if (window.indexedDB && indexedDB.webkitGetDatabaseNames) {
+      indexedDB.webkitGetDatabaseNames().onsuccess = function (event) {
+        var names = event.target.result;
+        for (var i = 0; i < names.length; i++)
+          indexedDB.deleteDatabase(names[i]);
+      };
+    }
+    this.resetNodes();
+    this.attachedFiles = [];
+  },
+
+  serializeDocument: function () {
+    var doctype = document.doctype ? new XMLSerializer().serializeToString(document.doctype) : "";
+    return doctype + (document.documentElement ? document.documentElement.outerHTML : "");
+  },
+
+  serializeDocumentIfChanged: function (epoch) {
+    var current = this.documentEpoch();
+    if (epoch === current)
+      return "unchanged";
+    return current + "\n" + this.serializeDocument();
+  },
+
   findXpath: function (xpath) {
     return this.findXpathRelativeTo(document, xpath);
   },
@@ -20,6 +65,84 @@ Capybara = {
     return this.findCssRelativeTo(document, selector);
   },
 
+  // Answers once |condition| ("present", "absent" or "count") holds for the
+  // nodes matching |selector|, or once |timeout| milliseconds have passed,
+  // with the nodes matching at that point. The selector is only evaluated
+  // again when the document changes.
+  waitFor: function (kind, selector, condition, timeout, count) {
+    var self = this;
+    var invocation = CapybaraInvocation;
+    var commandId = invocation.commandId;
+
+    var matches = function () {
+      if (kind === "xpath")
+        return document.evaluate("count(" + selector + ")", document, null, XPathResult.NUMBER_TYPE, null).numberValue;
+      return document.querySelectorAll(selector).length;
+    };
+
+    var holds = function () {
+      var found = matches();
+      if (condition === "absent")
+        return found === 0;
+      if (condition === "count")
+        return found === parseInt(count, 10);
+      return found > 0;
+    };
+
+    var find = function () {
+      return kind === "xpath" ? self.findXpath(selector) : self.findCss(selector);
+    };
+
+    if (holds())
+      return find();
+
+    var observer = new MutationObserver(function () {
+      if (holds())
+        finish();
+    });
+    var timer = Capybara.setTimeoutUncounted(finish, parseInt(timeout, 10));
+
+    function finish() {
+      observer.disconnect();
+      clearTimeout(timer);
+      invocation.done(commandId, find().join(","));
+    }
+
+    observer.observe(document, { childList: true, subtree: true, attributes: true, characterData: true });
+    return function () {};
+  },
+
+  // Answers "true" once the page has had no XMLHttpRequest, fetch or short
+  // timeout pending for |idle| milliseconds, or "false" once |timeout|
+  // milliseconds have passed. Tracking starts with the first wait on a page,
+  // so requests the page made before then are not waited on.
+  waitForIdle: function (idle, timeout) {
+    Capybara.trackActivity();
+    var invocation = CapybaraInvocation;
+    var commandId = invocation.commandId;
+    var idleMs = parseInt(idle, 10);
+    var deadline = Date.now() + parseInt(timeout, 10);
+
+    var settled = function () {
+      var activity = Capybara.pendingActivity();
+      return activity.count === 0 && Date.now() - activity.changedAt >= idleMs;
+    };
+
+    if (settled())
+      return "true";
+
+    var check = function () {
+      if (settled())
+        invocation.done(commandId, "true");
+      else if (Date.now() >= deadline)
+        invocation.done(commandId, "false");
+      else
+        Capybara.setTimeoutUncounted(check, 25);
+    };
+    Capybara.setTimeoutUncounted(check, 25);
+    return function () {};
+  },
+
   findXpathWithin: function (index, xpath) {
     return this.findXpathRelativeTo(this.getNode(index), xpath);
   },
@@ -32,33 +155,125 @@ Capybara = {
     var iterator = document.evaluate(xpath, reference, null, XPathResult.ORDERED_NODE_ITERATOR_TYPE, null);
     var node;
     var results = [];
-    while (node = iterator.iterateNext()) {
-      this.nextIndex++;
-      this.nodes[this.nextIndex] = node;
-      results.push(this.nextIndex);
-    }
-    return results.join(",");
+    while (node = iterator.iterateNext())
+      results.push(this.registerNode(node));
+    return results;
   },
 
   findCssRelativeTo: function (reference, selector) {
     var elements = reference.querySelectorAll(selector);
     var results = [];
-    for (var i = 0; i < elements.length; i++) {
-      this.nextIndex++;
-      this.nodes[this.nextIndex] = elements[i];
-      results.push(this.nextIndex);
+    for (var i = 0; i < elements.length; i++)
+      results.push(this.registerNode(elements[i]));
+    return results;
+  },
+
+  resetNodes: function () {
+    this.nodes = [null];
+    this.generations = [0];
+    this.detachedSlots = [false];
+    this.freeSlots = [];
+    this.nodeIds = new WeakMap();
+    this.nodeCount = 0;
+    this.registrationsUntilSweep = 1024;
+  },
+
+  registerNode: function (node) {
+    var id = this.nodeIds.get(node);
+    if (id !== undefined)
+      return id;
+
+    // Sweeping again once as many nodes were registered as the last sweep
+    // kept keeps its cost proportional to the finds.
+    if (--this.registrationsUntilSweep <= 0)
+      this.sweepNodes();
+
+    var slot;
+    if (this.freeSlots.length > 0) {
+      slot = this.freeSlots.pop();
+    } else {
+      slot = this.nodes.length;
+      if (slot >= 1 << this.nodeSlotBits)
+        throw new Error("Too many nodes registered");
+      this.generations[slot] = 0;
+    }
+
+    this.nodes[slot] = node;
+    this.nodeCount++;
+    this.detachedSlots[slot] = false;
+    id = this.generations[slot] * (1 << this.nodeSlotBits) + slot;
+    this.nodeIds.set(node, id);
+    return id;
+  },
+
+  sweepNodes: function () {
+    for (var slot = 1; slot < this.nodes.length; slot++) {
+      var node = this.nodes[slot];
+      if (!node)
+        continue;
+      if (this.isNodeAttached(node)) {
+        this.detachedSlots[slot] = false;
+      } else if (this.detachedSlots[slot]) {
+        this.nodeIds.delete(node);
+        this.nodes[slot] = null;
+        this.nodeCount--;
+        this.generations[slot] = (this.generations[slot] + 1) % this.nodeGenerations;
+        this.freeSlots.push(slot);
+      } else {
+        this.detachedSlots[slot] = true;
+      }
     }
-    return results.join(",");
+    this.registrationsUntilSweep = Math.max(this.nodeCount, 1024);
+  },
+
+  lookupNode: function (index) {
+    var id = Number(index);
+    var slot = id % (1 << this.nodeSlotBits);
+    var generation = (id - slot) / (1 << this.nodeSlotBits);
+    if (slot > 0 && this.generations[slot] === generation)
+      return this.nodes[slot] || undefined;
+    return undefined;
+  },
+
+  // Returns the facts cached for |node|, which hold until the DOM changes.
+  getNodeFacts: function (node) {
+    var epoch = this.mutationCount();
+    if (epoch !== this.nodeFactsEpoch) {
+      this.nodeFacts = new WeakMap();
+      this.nodeFactsEpoch = epoch;
+    }
+    var facts = this.nodeFacts.get(node);
+    if (!facts) {
+      facts = {};
+      this.nodeFacts.set(node, facts);
+    }
+    return facts;
+  },
+
+  isNodeAttached: function (node) {
+    var facts = this.getNodeFacts(node);
+    if (facts.attached === undefined) {
+      var root = document.documentElement;
+      facts.attached = !!root && root.contains(node);
+    }
+    return facts.attached;
   },
 
   isAttached: function(index) {
-    return this.nodes[index] &&
-      document.evaluate("ancestor-or-self::html", this.nodes[index], null, XPathResult.FIRST_ORDERED_NODE_TYPE, null).singleNodeValue != null;
+    var node = this.lookupNode(index);
+    return !!node && this.isNodeAttached(node);
+  },
+
+  // Registers the nodes that Evaluate results contain, which are sent as
+  // their ids.
+  nodeId: function (value) {
+    return value instanceof Node ? this.registerNode(value) : -1;
   },
 
   getNode: function(index) {
-    if (CapybaraInvocation.allowUnattached || this.isAttached(index)) {
-      return this.nodes[index];
+    var node = this.lookupNode(index);
+    if (node && (CapybaraInvocation.allowUnattached || this.isNodeAttached(node))) {
+      return node;
     } else {
       throw new Capybara.NodeNotAttachedError(index);
     }
@@ -111,7 +326,10 @@ Capybara = {
   },
 
   pathForNode: function(node) {
-    return "/" + this.getXPathNode(node).join("/");
+    var facts = this.getNodeFacts(node);
+    if (facts.path === undefined)
+      facts.path = "/" + this.getXPathNode(node).join("/");
+    return facts.path;
   },
 
   getXPathNode: function(node, path) {
@@ -143,7 +361,11 @@ Capybara = {
   },
 
   tagName: function(index) {
-    return this.getNode(index).tagName.toLowerCase();
+    var node = this.getNode(index);
+    var facts = this.getNodeFacts(node);
+    if (facts.tagName === undefined)
+      facts.tagName = node.tagName.toLowerCase();
+    return facts.tagName;
   },
 
   submit: function(index) {
@@ -216,31 +438,66 @@ Capybara = {
     throw new Capybara.UnpositionedElement(this.pathForNode(node), visible);
   },
 
-  click: function (index, action) {
+  // Presses the mouse button over the node |presses| times. The click is
+  // answered once the page has dispatched one of |events|, and fails with
+  // ClickFailed when the last mouseup passes without it. A click whose
+  // mouse events the page never sees fails after a delay in the browser
+  // process instead.
+  click: function (index, action, events, presses) {
     var node = this.getNode(index);
     node.scrollIntoViewIfNeeded();
     var pos = this.clickPosition(node);
     CapybaraInvocation.hover(pos.relativeX, pos.relativeY);
     this.expectNodeAtPosition(node, pos);
-    document.addEventListener('click', function() {
-      document.removeEventListener('click', this, true);
-      CapybaraInvocation.done();
-    }, true);
-    action(pos.relativeX, pos.relativeY);
+    var commandId = CapybaraInvocation.commandId;
+    if (this.pendingClick)
+      this.pendingClick();
+    var mouseups = 0;
+    var detach = this.pendingClick = function () {
+      events.forEach(function (event) {
+        document.removeEventListener(event, clicked, true);
+      });
+      document.removeEventListener('mouseup', released, true);
+      Capybara.pendingClick = null;
+    };
+    var clicked = function () {
+      detach();
+      CapybaraInvocation.clicked(commandId, true);
+    };
+    // The click events follow the last mouseup in the same dispatch, so a
+    // task posted from it runs after they would have.
+    var released = function () {
+      if (++mouseups === presses)
+        setTimeout(function () {
+          if (Capybara.pendingClick === detach) {
+            detach();
+            CapybaraInvocation.clicked(commandId, false);
+          }
+        }, 0);
+    };
+    events.forEach(function (event) {
+      document.addEventListener(event, clicked, true);
+    });
+    document.addEventListener('mouseup', released, true);
+    action(pos.relativeX, pos.relativeY, commandId);
   },
 
   leftClick: function (index) {
-    this.click(index, CapybaraInvocation.leftClick);
+    this.click(index, CapybaraInvocation.leftClick, ['click'], 1);
     return function() {};
   },
 
   doubleClick: function(index) {
-    this.click(index, CapybaraInvocation.leftClick);
-    this.click(index, CapybaraInvocation.doubleClick);
+    this.click(index, CapybaraInvocation.doubleClick, ['dblclick'], 2);
+    return function() {};
   },
 
+  // The context menu opens on mousedown or mouseup depending on the
+  // platform, so either answers a right click.
   rightClick: function(index) {
-    this.click(index, CapybaraInvocation.rightClick);
+    this.click(index, CapybaraInvocation.rightClick,
+      ['contextmenu', 'mouseup'], 1);
+    return function() {};
   },
 
   hover: function (index) {
@@ -265,15 +522,44 @@ Capybara = {
     return this.isNodeVisible(this.getNode(index));
   },
 
+  // A node is visible when neither it nor an ancestor is hidden. Ancestors
+  // are looked up until one already known, and every node on the way is
+  // remembered, so that nodes sharing ancestors share the work.
   isNodeVisible: function(node) {
-    while (node) {
-      var style = node.ownerDocument.defaultView.getComputedStyle(node, null);
-      if (style.getPropertyValue('display') == 'none' || style.getPropertyValue('visibility') == 'hidden')
-        return false;
+    var epoch = this.styleEpoch();
+    if (epoch !== this.visibilitiesEpoch) {
+      this.visibilities = new WeakMap();
+      this.visibilitiesEpoch = epoch;
+    }
 
-      node = node.parentElement;
+    var unknown = [];
+    var visible = true;
+    for (; node; node = node.parentElement) {
+      var known = this.visibilities.get(node);
+      if (known !== undefined) {
+        visible = known;
+        break;
+      }
+      unknown.push(node);
     }
-    return true;
+
+    for (var i = unknown.length - 1; i >= 0; i--) {
+      if (visible) {
+        var style = unknown[i].ownerDocument.defaultView.getComputedStyle(unknown[i], null);
+        visible = style.getPropertyValue('display') != 'none' && style.getPropertyValue('visibility') != 'hidden';
+      }
+      this.visibilities.set(unknown[i], visible);
+    }
+    return visible;
+  },
+
+  // Options and option groups are also disabled by a disabled group or
+  // select around them.
+  disabled: function (index) {
+    var node = this.getNode(index);
+    while (!node.disabled && /^(option|optgroup)$/i.test(node.tagName) && node.parentElement)
+      node = node.parentElement;
+    return !!node.disabled;
   },
 
   selected: function (index) {
@@ -293,14 +579,19 @@ Capybara = {
     return true;
   },
 
+  isTextField: function (node) {
+    var type = (node.type || node.tagName).toLowerCase();
+    var textTypes = ["email", "number", "password", "search", "tel", "text", "textarea", "url"];
+    return textTypes.indexOf(type) != -1;
+  },
+
   set: function (index, value) {
-    var length, maxLength, node, strindex, textTypes, type;
+    var length, maxLength, node, type;
 
     node = this.getNode(index);
     type = (node.type || node.tagName).toLowerCase();
-    textTypes = ["email", "number", "password", "search", "tel", "text", "textarea", "url"];
 
-    if (textTypes.indexOf(type) != -1) {
+    if (this.isTextField(node)) {
       maxLength = this.attribute(index, "maxlength");
       if (maxLength && value.length > maxLength) {
         length = maxLength;
@@ -313,9 +604,8 @@ Capybara = {
 
         node.value = "";
 
-        for (strindex = 0; strindex < length; strindex++) {
-          CapybaraInvocation.keypress(value.charCodeAt(strindex));
-        }
+        if (length > 0)
+          CapybaraInvocation.sendKeys(value.substring(0, length));
 
         if (value == '')
           this.trigger(index, "change");
@@ -336,6 +626,25 @@ Capybara = {
     }
   },
 
+  // Fills a text field without typing it, with a single input and change
+  // event. Only for fields that do not listen to keys.
+  insertText: function (index, value) {
+    var node = this.getNode(index);
+    if (!this.isTextField(node))
+      return this.set(index, value);
+    if (node.readOnly)
+      return;
+
+    var maxLength = this.attribute(index, "maxlength");
+    if (maxLength && value.length > maxLength)
+      value = value.substring(0, maxLength);
+
+    this.focus(index);
+    node.value = value;
+    this.trigger(index, "input");
+    this.trigger(index, "change");
+  },
+
   isContentEditable: function(node) {
     if (node.contentEditable == 'true') {
       return true;
@@ -467,3 +776,213 @@ Capybara.NodeNotAttachedError = function(index) {
 };
 Capybara.NodeNotAttachedError.prototype = new Error();
 Capybara.NodeNotAttachedError.prototype.constructor = Capybara.NodeNotAttachedError;
+
+// Counts the XMLHttpRequests, fetches and short timeouts the page has
+// pending, for Capybara.waitForIdle(). Nothing is counted, and the page's
+// own functions are left alone, until Capybara.trackActivity() is called,
+// after which the page is tracked until it unloads. Longer timeouts are
+// usually polling, and a callback that schedules itself again, or a timeout
+// scheduled from inside a counted one, is usually an animation or a poll
+// loop, so only its first timeout is counted.
+(function () {
+  var tracking = false;
+  var pending = 0;
+  var changedAt = Date.now();
+  var change = function (delta) {
+    pending += delta;
+    changedAt = Date.now();
+  };
+
+  Capybara.pendingActivity = function () {
+    return { count: pending, changedAt: changedAt };
+  };
+
+  var setTimeoutUncounted = window.setTimeout;
+  var clearTimeoutUncounted = window.clearTimeout;
+  Capybara.setTimeoutUncounted = function (callback, delay) {
+    return setTimeoutUncounted.call(window, callback, delay);
+  };
+
+  Capybara.trackActivity = function () {
+    if (tracking)
+      return;
+    tracking = true;
+    changedAt = Date.now();
+
+    var timers = {};
+    var scheduled = new WeakSet();
+    var firing = 0;
+    window.setTimeout = function (callback, delay) {
+      if (typeof callback !== "function" || delay > 1000 || firing > 0 ||
+          scheduled.has(callback))
+        return setTimeoutUncounted.apply(window, arguments);
+      scheduled.add(callback);
+      var rest = Array.prototype.slice.call(arguments, 2);
+      var id = setTimeoutUncounted.call(window, function () {
+        delete timers[id];
+        firing++;
+        try {
+          callback.apply(window, rest);
+        } finally {
+          firing--;
+          change(-1);
+        }
+      }, delay);
+      timers[id] = true;
+      change(1);
+      return id;
+    };
+    window.clearTimeout = function (id) {
+      if (timers[id]) {
+        delete timers[id];
+        change(-1);
+      }
+      return clearTimeoutUncounted.call(window, id);
+    };
+
+    if (window.XMLHttpRequest) {
+      var send = XMLHttpRequest.prototype.send;
+      XMLHttpRequest.prototype.send = function () {
+        var finished = false;
+        var finish = function () {
+          if (!finished) {
+            finished = true;
+            change(-1);
+          }
+        };
+        change(1);
+        this.addEventListener("loadend", finish);
+        try {
+          return send.apply(this, arguments);
+        } catch (e) {
+          finish();
+          throw e;
+        }
+      };
+    }
+
+    if (window.fetch) {
+      var fetch = window.fetch;
+      window.fetch = function () {
+        change(1);
+        var request = fetch.apply(window, arguments);
+        request.then(function () { change(-1); }, function () { change(-1); });
+        return request;
+      };
+    }
+  };
+})();
+
+// Counts DOM mutations for Capybara.serializeDocumentIfChanged() and the
+// node caches. Document epochs carry an identifier of the document, so that
+// one taken before a navigation never matches the next page.
+(function () {
+  var documentId = Date.now().toString(36) + Math.random().toString(36).slice(2);
+  var mutations = 0;
+  var observer = new MutationObserver(function () {
+    mutations++;
+  });
+  observer.observe(document, {
+    childList: true,
+    attributes: true,
+    characterData: true,
+    subtree: true
+  });
+
+  Capybara.mutationCount = function () {
+    // Mutations made by the current task have not been delivered yet.
+    if (observer.takeRecords().length > 0)
+      mutations++;
+    return mutations;
+  };
+
+  Capybara.documentEpoch = function () {
+    return documentId + "." + Capybara.mutationCount();
+  };
+
+  // Styles also change with what pseudo-classes and the viewport select,
+  // with stylesheets loading and through the CSSOM, none of which a
+  // mutation reports. Visibility is kept only until one of the events or
+  // calls that go with such a change. The calls are watched from the first
+  // time visibility is cached, as watching them replaces page methods.
+  var styleChanges = 0;
+  var styleChanged = function () {
+    styleChanges++;
+  };
+  ["resize", "hashchange", "mouseover", "mouseout", "focusin", "focusout",
+   "change", "input", "transitionrun", "transitionstart", "transitionend",
+   "transitioncancel", "animationstart", "animationiteration",
+   "animationend", "animationcancel"].forEach(function (name) {
+    window.addEventListener(name, styleChanged, true);
+  });
+  // Load events of stylesheets do not reach the window.
+  document.addEventListener("load", styleChanged, true);
+
+  // Counts calls to the methods and setters |names| of |prototype| as style
+  // changes.
+  var watchCalls = function (prototype, names) {
+    if (!prototype)
+      return;
+    names.forEach(function (name) {
+      var descriptor = Object.getOwnPropertyDescriptor(prototype, name);
+      if (!descriptor || !descriptor.configurable)
+        return;
+      if (typeof descriptor.value === "function") {
+        var method = descriptor.value;
+        descriptor.value = function () {
+          styleChanges++;
+          return method.apply(this, arguments);
+        };
+      } else if (descriptor.set) {
+        var setter = descriptor.set;
+        descriptor.set = function (value) {
+          styleChanges++;
+          setter.call(this, value);
+        };
+      } else {
+        return;
+      }
+      Object.defineProperty(prototype, name, descriptor);
+    });
+  };
+
+  var watchingStyles = false;
+  var watchStyles = function () {
+    watchingStyles = true;
+    watchCalls(window.CSSStyleSheet && CSSStyleSheet.prototype,
+      ["insertRule", "deleteRule", "addRule", "removeRule", "replace",
+       "replaceSync"]);
+    watchCalls(window.CSSGroupingRule && CSSGroupingRule.prototype,
+      ["insertRule", "deleteRule"]);
+    watchCalls(window.CSSMediaRule && CSSMediaRule.prototype,
+      ["insertRule", "deleteRule"]);
+    watchCalls(window.StyleSheet && StyleSheet.prototype, ["disabled"]);
+    watchCalls(window.MediaList && MediaList.prototype,
+      ["appendMedium", "deleteMedium", "mediaText"]);
+    // Rule styles change through these. Engines that expose each property
+    // as an accessor have their setters watched as well, but not the
+    // getters, which visibility itself reads.
+    if (window.CSSStyleDeclaration) {
+      var declaration = CSSStyleDeclaration.prototype;
+      watchCalls(declaration, ["setProperty", "removeProperty"].concat(
+        Object.getOwnPropertyNames(declaration).filter(function (name) {
+          return Object.getOwnPropertyDescriptor(declaration, name).set;
+        })));
+    }
+    // State that :checked, :indeterminate and the like select on.
+    watchCalls(window.HTMLInputElement && HTMLInputElement.prototype,
+      ["checked", "indeterminate", "value"]);
+    watchCalls(window.HTMLOptionElement && HTMLOptionElement.prototype,
+      ["selected"]);
+    watchCalls(window.HTMLSelectElement && HTMLSelectElement.prototype,
+      ["selectedIndex", "value"]);
+    watchCalls(window.HTMLTextAreaElement && HTMLTextAreaElement.prototype,
+      ["value"]);
+  };
+
+  Capybara.styleEpoch = function () {
+    if (!watchingStyles)
+      watchStyles();
+    return Capybara.mutationCount() + "." + styleChanges;
+  };
+})();
@@ -3,6 +3,7 @@
 #include "capybara_invocation_handler.h"
 
 #include "cef_base.h"
+#include "transcode.h"
 
 IMPLEMENT_REFCOUNTING(capybara_invocation_handler)
 GENERATE_CEF_BASE_INITIALIZER(capybara_invocation_handler)
@@ -24,12 +25,14 @@ execute(struct _cef_v8handler_t* self,
 {
 	int success;
 	cef_string_utf8_t out = {};
-	cef_string_utf16_to_utf8(name->str, name->length, &out);
+	transcode_utf16_to_utf8(name->str, name->length, &out);
 	if (strcmp(out.str, "clickTest") == 0) {
 		cef_v8value_t *result = cef_v8value_create_bool(1);
 		*retval = result;
 		success = 1;
-	} else if (strcmp(out.str, "leftClick") == 0) {
+	} else if (strcmp(out.str, "leftClick") == 0 ||
+	    strcmp(out.str, "rightClick") == 0 ||
+	    strcmp(out.str, "doubleClick") == 0) {
 		cef_v8context_t *context = cef_v8context_get_current_context();
 		cef_browser_t *browser = context->get_browser(context);
 
@@ -41,8 +44,17 @@ execute(struct _cef_v8handler_t* self,
 
 		int x = arguments[0]->get_int_value(arguments[0]);
 		args->set_int(args, 0, x);
-		int y = arguments[0]->get_int_value(arguments[1]);
+		int y = arguments[1]->get_int_value(arguments[1]);
 		args->set_int(args, 1, y);
+		// The command is answered by ClickDispatched, or by a fallback
+		// armed in the browser process.
+		if (argumentsCount > 2)
+			args->set_int(args, 2, arguments[2]->get_int_value(arguments[2]));
+		else
+			args->set_null(args, 2);
+		args->set_int(args, 3,
+		    strcmp(out.str, "rightClick") == 0 ? MBT_RIGHT : MBT_LEFT);
+		args->set_int(args, 4, strcmp(out.str, "doubleClick") == 0 ? 2 : 1);
 
 		browser->send_process_message(browser, PID_BROWSER, cef_message);
 		browser->base.release((cef_base_t *)browser);
@@ -53,10 +65,45 @@ execute(struct _cef_v8handler_t* self,
 		cef_string_set(u"RequestInvocationResult", 23, &name, 0);
 		cef_process_message_t *message = cef_process_message_create(&name);
 
+		cef_list_value_t *args = message->get_argument_list(message);
+		args->set_int(args, 0, arguments[0]->get_int_value(arguments[0]));
+		// An optional string becomes the invocation's result.
+		if (argumentsCount > 1 && arguments[1]->is_string(arguments[1])) {
+			cef_string_userfree_t value = arguments[1]->get_string_value(arguments[1]);
+			args->set_string(args, 1, value);
+			if (value != NULL)
+				cef_string_userfree_free(value);
+		}
+
+		cef_v8context_t *context = cef_v8context_get_current_context();
+		cef_browser_t *browser = context->get_browser(context);
+		browser->base.add_ref((cef_base_t *)browser);
+
+		BrowserMessageTask *t = calloc(1, sizeof(BrowserMessageTask));
+		t->browser = browser;
+		t->message = message;
+		((cef_task_t *)t)->base.size = sizeof(BrowserMessageTask);
+		((cef_task_t *)t)->execute = execute_done_task;
+		cef_post_task(TID_RENDERER, (cef_task_t *)t);
+
+		success = 1;
+	} else if (strcmp(out.str, "clicked") == 0) {
+		cef_string_t name = {};
+		cef_string_set(u"ClickDispatched", 15, &name, 0);
+		cef_process_message_t *message = cef_process_message_create(&name);
+
+		cef_list_value_t *args = message->get_argument_list(message);
+		args->set_int(args, 0, arguments[0]->get_int_value(arguments[0]));
+		// Whether the page dispatched the click.
+		args->set_bool(args, 1, argumentsCount < 2 ||
+		    arguments[1]->get_bool_value(arguments[1]));
+
 		cef_v8context_t *context = cef_v8context_get_current_context();
 		cef_browser_t *browser = context->get_browser(context);
 		browser->base.add_ref((cef_base_t *)browser);
 
+		// Sent once the click's listeners have all run, so that whatever
+		// they started, like a navigation, reaches the browser first.
 		BrowserMessageTask *t = calloc(1, sizeof(BrowserMessageTask));
 		t->browser = browser;
 		t->message = message;
@@ -65,18 +112,21 @@ execute(struct _cef_v8handler_t* self,
 		cef_post_task(TID_RENDERER, (cef_task_t *)t);
 
 		success = 1;
-	} else if (strcmp(out.str, "keypress") == 0) {
+	} else if (strcmp(out.str, "sendKeys") == 0) {
 		cef_v8context_t *context = cef_v8context_get_current_context();
 		cef_browser_t *browser = context->get_browser(context);
 
 		cef_string_t message_name = {};
-		cef_string_set(u"SendKeyEvent", 12, &message_name, 0);
+		cef_string_set(u"SendKeyEvents", 13, &message_name, 0);
 		cef_process_message_t *cef_message = cef_process_message_create(&message_name);
 
 		cef_list_value_t *args = cef_message->get_argument_list(cef_message);
 
-		int c = arguments[0]->get_int_value(arguments[0]);
-		args->set_int(args, 0, c);
+		// The whole string is typed by the browser process.
+		cef_string_userfree_t text = arguments[0]->get_string_value(arguments[0]);
+		args->set_string(args, 0, text);
+		if (text != NULL)
+			cef_string_userfree_free(text);
 
 		browser->send_process_message(browser, PID_BROWSER, cef_message);
 		browser->base.release((cef_base_t *)browser);
@@ -74,19 +74,21 @@ struct _life_span_handler_t;
 struct _client_t;
 struct _render_process_handler;
 struct _load_handler;
+struct _request_handler;
 struct _render_handler;
-struct _string_visitor;
 struct _app;
 struct _capybara_invocation_handler;
+struct _Task;
 
 void initialize_life_span_handler_t_base(struct _life_span_handler_t *object);
 void initialize_client_t_base(struct _client_t *object);
 void initialize_render_process_handler_base(struct _render_process_handler *object);
 void initialize_load_handler_base(struct _load_handler *object);
+void initialize_request_handler_base(struct _request_handler *object);
 void initialize_render_handler_base(struct _render_handler *object);
-void initialize_string_visitor_base(struct _string_visitor *object);
 void initialize_app_base(struct _app *object);
 void initialize_capybara_invocation_handler_base(struct _capybara_invocation_handler *object);
+void initialize_Task_base(struct _Task *object);
 
 #define initialize_cef_base(T) \
     _Generic((T), \
@@ -94,7 +96,8 @@ void initialize_capybara_invocation_handler_base(struct _capybara_invocation_han
 	struct _client_t*: initialize_client_t_base, \
 	struct _render_process_handler*: initialize_render_process_handler_base, \
 	struct _load_handler*: initialize_load_handler_base, \
+	struct _request_handler*: initialize_request_handler_base, \
 	struct _render_handler*: initialize_render_handler_base, \
-	struct _string_visitor*: initialize_string_visitor_base, \
 	struct _app*: initialize_app_base, \
-	struct _capybara_invocation_handler*: initialize_capybara_invocation_handler_base)(T)
+	struct _capybara_invocation_handler*: initialize_capybara_invocation_handler_base, \
+	struct _Task*: initialize_Task_base)(T)
@@ -2,15 +2,25 @@
 // License: BSD 3-clause.
 // Website: https://github.com/CzarekTomczak/cefcapi
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 
 #include "cef_life_span_handler.h"
 #include "cef_render_handler.h"
 #include "cef_load_handler.h"
+#include "cef_request_handler.h"
 #include "context.h"
 #include "cef_client.h"
 #include "cef_base.h"
+#include "shared_ring.h"
+#include "transcode.h"
+#include "typed_value.h"
+
+// How long a click waits for the page to see its mouse events before it
+// fails, when the session has no timeout.
+#define CLICK_FALLBACK_MS 10000
 
 IMPLEMENT_REFCOUNTING(client_t)
 GENERATE_CEF_BASE_INITIALIZER(client_t)
@@ -186,7 +196,286 @@ struct _cef_render_handler_t* CEF_CALLBACK get_render_handler(
 ///
 struct _cef_request_handler_t* CEF_CALLBACK get_request_handler(
         struct _cef_client_t* self) {
-    return NULL;
+    request_handler *h;
+    h = calloc(1, sizeof(request_handler));
+
+    h->context = ((client_t *)self)->context;
+    h->client = (client_t *)self;
+    cef_request_handler_t *handler = &h->handler;
+
+    initialize_cef_base(h);
+    handler->on_before_resource_load = on_before_resource_load;
+    handler->on_resource_load_complete = on_resource_load_complete;
+    handler->on_render_process_terminated = on_render_process_terminated;
+
+    handler->base.add_ref((cef_base_t *)h);
+
+    return handler;
+}
+
+static
+void
+free_utf8(char *str)
+{
+	free(str);
+}
+
+///
+// Converts the value an invocation returned, found at |index| of |arguments|,
+// into a response. Returns NULL for invocations without a value. Numbers,
+// lists and maps are encoded with their types when |typed| is given, which
+// is then set, and formatted as text otherwise.
+///
+static
+cef_string_userfree_utf8_t
+invocation_result(cef_list_value_t *arguments, int index, int *typed)
+{
+	cef_string_userfree_utf8_t result = NULL;
+
+	cef_value_type_t type = arguments->get_type(arguments, index);
+	if (type == VTYPE_STRING) {
+		cef_string_userfree_t value;
+		value = arguments->get_string(arguments, index);
+		if (value != NULL) {
+			result = cef_string_userfree_utf8_alloc();
+			transcode_utf16_to_utf8(value->str, value->length, result);
+			cef_string_userfree_free(value);
+		}
+	} else if (type == VTYPE_BINARY) {
+		// Already UTF-8, as Evaluate sends its JSON.
+		cef_binary_value_t *value = arguments->get_binary(arguments, index);
+		size_t length = value->get_size(value);
+		char *data = malloc(length + 1);
+		value->get_data(value, data, length, 0);
+		value->base.release((cef_base_t *)value);
+		data[length] = 0;
+		result = cef_string_userfree_utf8_alloc();
+		result->str = data;
+		result->length = length;
+		result->dtor = free_utf8;
+	} else if (type == VTYPE_BOOL) {
+		result = cef_string_userfree_utf8_alloc();
+		if (arguments->get_bool(arguments, index)) {
+			cef_string_utf8_set("true", 4, result, 0);
+		} else {
+			cef_string_utf8_set("false", 5, result, 0);
+		}
+	} else if (type == VTYPE_INT || type == VTYPE_DOUBLE ||
+	    type == VTYPE_LIST || type == VTYPE_DICTIONARY) {
+		if (typed != NULL) {
+			result = encode_typed_value(arguments, index);
+			*typed = 1;
+		} else {
+			result = format_value(arguments, index);
+		}
+	}
+
+	return result;
+}
+
+///
+// Converts the error name and message an invocation threw, found at |index|
+// and |index| + 1 of |arguments|, into a JSON error response.
+///
+static
+cef_string_userfree_utf8_t
+invocation_error(cef_list_value_t *arguments, int index)
+{
+	cef_string_userfree_t value;
+	value = arguments->get_string(arguments, index);
+	cef_string_userfree_utf8_t name = cef_string_userfree_utf8_alloc();
+	if (value != NULL) {
+		transcode_utf16_to_utf8(value->str, value->length, name);
+		cef_string_userfree_free(value);
+	}
+
+	const char *error_class = "InvalidResponseError";
+	if (name->str != NULL && strcmp(name->str, "Capybara.ClickFailed") == 0)
+		error_class = "ClickFailed";
+	else if (name->str != NULL && strcmp(name->str, "Capybara.NodeNotAttachedError") == 0)
+		error_class = "NodeNotAttachedError";
+	cef_string_userfree_utf8_free(name);
+
+	value = arguments->get_string(arguments, index + 1);
+	cef_string_userfree_utf8_t msg = cef_string_userfree_utf8_alloc();
+	if (value != NULL) {
+		transcode_utf16_to_utf8(value->str, value->length, msg);
+		cef_string_userfree_free(value);
+	}
+
+	// Messages of evaluated scripts can hold anything, so they are escaped.
+	cef_string_userfree_utf8_t result = encode_error(error_class,
+	    msg->str != NULL ? msg->str : "", msg->length);
+	cef_string_userfree_utf8_free(msg);
+
+	return result;
+}
+
+///
+// How long a click may wait for the page to see its mouse events before it
+// fails: the session's timeout, or CLICK_FALLBACK_MS when none is set.
+// Clicks the page sees but does not dispatch fail as soon as the renderer
+// reports it.
+///
+static
+long
+click_fallback_delay(Session *session)
+{
+	int timeout = atomic_load(&session->timeout);
+	return timeout > 0 ? timeout * 1000L : CLICK_FALLBACK_MS;
+}
+
+///
+// The error a click is failed with when the page has not dispatched it, as
+// if the renderer had thrown Capybara.ClickFailed.
+///
+static
+cef_string_userfree_utf8_t
+click_not_seen_error(void)
+{
+	cef_list_value_t *error = cef_list_value_create();
+	cef_string_t value = {};
+	cef_string_set(u"Capybara.ClickFailed", 20, &value, 0);
+	error->set_string(error, 0, &value);
+	cef_string_set(u"The page did not receive the click", 34, &value, 0);
+	error->set_string(error, 1, &value);
+
+	cef_string_userfree_utf8_t json = invocation_error(error, 0);
+	error->base.release((cef_base_t *)error);
+	return json;
+}
+
+static
+void
+append_response(char **buffer, size_t *length, int success,
+    cef_string_userfree_utf8_t response)
+{
+	size_t response_length = response != NULL ? response->length : 0;
+	char header[32];
+	int header_length = snprintf(header, sizeof(header), "%s\n%zu\n",
+	    success ? "ok" : "failure", response_length);
+
+	*buffer = realloc(*buffer, *length + header_length + response_length);
+	memcpy(*buffer + *length, header, header_length);
+	*length += header_length;
+	if (response_length > 0) {
+		memcpy(*buffer + *length, response->str, response_length);
+		*length += response_length;
+	}
+
+	if (response != NULL)
+		cef_string_userfree_utf8_free(response);
+}
+
+///
+// Joins the results of a batch of invocations, each a list of a success flag
+// followed by the value or the error, into one response. Every result is
+// written the way a single command's response is written in text mode: a
+// status line, a length line and the body.
+///
+static
+cef_string_userfree_utf8_t
+multi_invocation_result(cef_list_value_t *arguments, int index)
+{
+	char *buffer = NULL;
+	size_t length = 0;
+
+	int size = arguments->get_size(arguments);
+	for (int i = index; i < size; i++) {
+		cef_list_value_t *item = arguments->get_list(arguments, i);
+		if (item->get_bool(item, 0))
+			append_response(&buffer, &length, 1, invocation_result(item, 1, NULL));
+		else
+			append_response(&buffer, &length, 0, invocation_error(item, 1));
+		item->base.release((cef_base_t *)item);
+	}
+
+	cef_string_userfree_utf8_t result = cef_string_userfree_utf8_alloc();
+	cef_string_utf8_set(buffer, length, result, 1);
+	free(buffer);
+
+	return result;
+}
+
+///
+// Returns the Windows virtual key code of the key typing |c| on a US
+// keyboard. Characters without a key of their own are sent as VK_PACKET,
+// which carries any character.
+///
+static
+int
+key_code_for(int c)
+{
+	if (c > 127)
+		return 0xe7;  // VK_PACKET
+
+	int key_code = toupper(c);
+
+	switch (key_code) {
+	case '`': key_code = 192; break;
+	case '-': key_code = 189; break;
+	case '=': key_code = 187; break;
+	case '[': key_code = 219; break;
+	case ']': key_code = 221; break;
+	case '\\': key_code = 220; break;
+	case ';': key_code = 186; break;
+	case '\'': key_code = 222; break;
+	case ',': key_code = 188; break;
+	case '.': key_code = 190; break;
+	case '/': key_code = 191; break;
+	case 127: key_code = 46; break;  //delete
+	case '~': key_code = 192; break;
+	case '!': key_code = 49; break;
+	case '@': key_code = 50; break;
+	case '#': key_code = 51; break;
+	case '$': key_code = 52; break;
+	case '%': key_code = 53; break;
+	case '^': key_code = 54; break;
+	case '&': key_code = 55; break;
+	case '*': key_code = 56; break;
+	case '(': key_code = 57; break;
+	case ')': key_code = 48; break;
+	case '_': key_code = 189; break;
+	case '+': key_code = 187; break;
+	case '{': key_code = 219; break;
+	case '}': key_code = 221; break;
+	case '|': key_code = 220; break;
+	case ':': key_code = 186; break;
+	case '"': key_code = 222; break;
+	case '<': key_code = 188; break;
+	case '>': key_code = 190; break;
+	case '?': key_code = 191; break;
+	case '\b':
+	case '\t':
+	case '\n':
+	case '\e':
+	case ' ': break;
+	default:
+		if (key_code < '0' || key_code > 'Z')
+			key_code = 0;
+	}
+
+	return key_code;
+}
+
+///
+// Types one UTF-16 code unit: a key down, the character and a key up.
+///
+static
+void
+send_character(cef_browser_host_t *host, char16 c)
+{
+	cef_key_event_t event = {};
+	event.type = KEYEVENT_KEYDOWN;
+	event.windows_key_code = event.native_key_code = key_code_for(c);
+	event.character = c;
+	host->send_key_event(host, &event);
+
+	event.type = KEYEVENT_CHAR;
+	host->send_key_event(host, &event);
+
+	event.type = KEYEVENT_KEYUP;
+	host->send_key_event(host, &event);
 }
 
 ///
@@ -201,63 +490,112 @@ int CEF_CALLBACK on_process_message_received(
     int success;
     cef_string_userfree_t name = message->get_name(message);
     cef_string_utf8_t out = {};
-    cef_string_utf16_to_utf8(name->str, name->length, &out);
+    transcode_utf16_to_utf8(name->str, name->length, &out);
     cef_string_userfree_free(name);
     client_t *client = (client_t *)self;
     if (strcmp(out.str, "InvocationResult") == 0) {
-	    cef_string_userfree_utf8_t result = NULL;
-
 	    cef_list_value_t *arguments = message->get_argument_list(message);
+	    unsigned int command_id = arguments->get_int(arguments, 0);
+
+	    Session *session = client->context->session;
+	    int typed = 0;
+	    cef_string_userfree_utf8_t result = invocation_result(arguments, 1,
+		session->binary_framing ? &typed : NULL);
+	    if (typed)
+		    post_typed_response(session, command_id, result);
+	    else
+		    client->context->finish(client->context, command_id, result);
 
-	    cef_value_type_t type = arguments->get_type(arguments, 0);
-	    if (type == VTYPE_STRING) {
-		    cef_string_userfree_t value;
-		    value = arguments->get_string(arguments, 0);
-		    if (value != NULL) {
-			    result = cef_string_userfree_utf8_alloc();
-			    cef_string_utf16_to_utf8(value->str, value->length, result);
-			    cef_string_userfree_free(value);
-		    }
-	    } else if (type == VTYPE_BOOL) {
-		    result = cef_string_userfree_utf8_alloc();
-		    if (arguments->get_bool(arguments, 0)) {
-			    cef_string_utf8_set("true", 4, result, 0);
+	    success = 1;
+    } else if (strcmp(out.str, "SharedInvocationResult") == 0) {
+	    cef_list_value_t *arguments = message->get_argument_list(message);
+	    unsigned int command_id = arguments->get_int(arguments, 0);
+
+	    // The ring stays mapped for the next result of the same renderer,
+	    // and is only mapped again once the browser's renderer changes.
+	    int pid = arguments->get_int(arguments, 1);
+	    int fd = arguments->get_int(arguments, 2);
+	    if (client->ring != NULL && !shared_ring_is(client->ring, pid, fd)) {
+		    shared_ring_close(client->ring);
+		    client->ring = NULL;
+	    }
+	    if (client->ring == NULL)
+		    client->ring = shared_ring_open(pid, fd);
+
+	    // Without the ring, the result is asked for again, to be sent in
+	    // the message like a small one.
+	    if (client->ring == NULL) {
+		    cef_string_t name = {};
+		    cef_string_set(u"SharedResultRefused", 19, &name, 0);
+		    cef_process_message_t *request = cef_process_message_create(&name);
+		    cef_list_value_t *args = request->get_argument_list(request);
+		    args->set_int(args, 0, command_id);
+		    args->set_double(args, 1, arguments->get_double(arguments, 3));
+		    args->set_double(args, 2, arguments->get_double(arguments, 4));
+		    browser->send_process_message(browser, PID_RENDERER, request);
+	    } else {
+		    // Already UTF-8, so it is copied out of the ring once and
+		    // sent.
+		    cef_string_userfree_utf8_t result = cef_string_userfree_utf8_alloc();
+		    if (shared_ring_read(client->ring,
+			(uint64_t)arguments->get_double(arguments, 3),
+			(size_t)arguments->get_double(arguments, 4), result)) {
+			    client->context->finish(client->context, command_id,
+				result);
 		    } else {
-			    cef_string_utf8_set("false", 5, result, 0);
+			    const char *error = "{\"class\":\"InvalidResponseError\","
+				"\"message\":\"Could not read the result from the "
+				"render process\"}";
+			    cef_string_utf8_set(error, strlen(error), result, 1);
+			    client->context->finishFailure(client->context,
+				command_id, result);
 		    }
 	    }
 
-	    client->context->finish(client->context, result);
-
 	    success = 1;
     } else if (strcmp(out.str, "InvocationError") == 0) {
 	    cef_list_value_t *arguments = message->get_argument_list(message);
+	    unsigned int command_id = arguments->get_int(arguments, 0);
 
-	    cef_string_userfree_t value;
-	    value = arguments->get_string(arguments, 0);
-	    cef_string_userfree_utf8_t name = cef_string_userfree_utf8_alloc();
-	    cef_string_utf16_to_utf8(value->str, value->length, name);
-	    cef_string_userfree_free(value);
+	    client->context->finishFailure(client->context, command_id,
+		invocation_error(arguments, 1));
 
-	    if (strcmp(name->str, "Capybara.ClickFailed") == 0)
-		    cef_string_utf8_set("ClickFailed", 11, name, 0);
-	    else if (strcmp(name->str, "Capybara.NodeNotAttachedError") == 0)
-		    cef_string_utf8_set("NodeNotAttachedError", 20, name, 0);
-	    else
-		    cef_string_utf8_set("InvalidResponseError", 20, name, 0);
+	    success = 1;
+    } else if (strcmp(out.str, "MultiInvocationResult") == 0) {
+	    cef_list_value_t *arguments = message->get_argument_list(message);
+	    unsigned int command_id = arguments->get_int(arguments, 0);
+
+	    client->context->finish(client->context, command_id,
+		multi_invocation_result(arguments, 1));
+
+	    success = 1;
+    } else if (strcmp(out.str, "BodyStart") == 0) {
+	    cef_list_value_t *arguments = message->get_argument_list(message);
+	    unsigned int command_id = arguments->get_int(arguments, 0);
+	    size_t length = (size_t)arguments->get_double(arguments, 1);
 
-	    value = arguments->get_string(arguments, 1);
-	    cef_string_userfree_utf8_t msg = cef_string_userfree_utf8_alloc();
-	    cef_string_utf16_to_utf8(value->str, value->length, msg);
-	    cef_string_userfree_free(value);
+	    begin_streamed_response(client->context->session, command_id, length);
 
-	    cef_string_userfree_utf8_t result = cef_string_userfree_utf8_alloc();
-	    char buf[25 + name->length + msg->length];
-	    sprintf(buf, "{\"class\":\"%s\",\"message\":\"%s\"}", name->str, msg->str);
-	    cef_string_userfree_utf8_free(msg);
-	    cef_string_utf8_set(buf, sizeof(buf), result, 1);
+	    success = 1;
+    } else if (strcmp(out.str, "BodyChunk") == 0) {
+	    cef_list_value_t *arguments = message->get_argument_list(message);
+	    unsigned int command_id = arguments->get_int(arguments, 0);
+
+	    // Each chunk is converted on its own, so only one chunk is held
+	    // in both encodings at a time.
+	    cef_string_userfree_utf8_t chunk = cef_string_userfree_utf8_alloc();
+	    cef_string_userfree_t value = arguments->get_string(arguments, 1);
+	    if (value != NULL) {
+		    transcode_utf16_to_utf8(value->str, value->length, chunk);
+		    cef_string_userfree_free(value);
+	    }
 
-	    client->context->finishFailure(client->context, result);
+	    // A body that is no longer streaming still has to be drained from
+	    // the renderer, which only sends more as chunks are released.
+	    int last = arguments->get_bool(arguments, 2);
+	    if (!append_streamed_response(client->context->session, command_id,
+		chunk, last) && !last)
+		    release_body_chunks(client->context, command_id, 1);
 
 	    success = 1;
     } else if (strcmp(out.str, "SendMouseClickEvent") == 0) {
@@ -265,87 +603,68 @@ int CEF_CALLBACK on_process_message_received(
 
 	    int x = arguments->get_int(arguments, 0);
 	    int y = arguments->get_int(arguments, 1);
+	    cef_mouse_button_type_t button = MBT_LEFT;
+	    int presses = 1;
+	    if (arguments->get_size(arguments) > 4) {
+		    button = arguments->get_int(arguments, 3);
+		    presses = arguments->get_int(arguments, 4);
+	    }
 	    cef_mouse_event_t event = { .x = x, .y = y };
 	    cef_browser_host_t *host = browser->get_host(browser);
-	    host->send_mouse_click_event(host, &event, MBT_LEFT, 0, 1);
-	    host->send_mouse_click_event(host, &event, MBT_LEFT, 1, 1);
+	    for (int count = 1; count <= presses; count++) {
+		    host->send_mouse_click_event(host, &event, button, 0, count);
+		    host->send_mouse_click_event(host, &event, button, 1, count);
+	    }
 	    host->base.release((cef_base_t *)host);
 
+	    if (arguments->get_type(arguments, 2) == VTYPE_INT)
+		    post_fallback_error(client->context->session,
+			arguments->get_int(arguments, 2),
+			click_fallback_delay(client->context->session),
+			click_not_seen_error());
+
 	    success = 1;
-    } else if (strcmp(out.str, "RequestInvocationResult") == 0) {
-	    cef_string_t name = {};
-	    cef_string_set(u"InvocationResultRequest", 23, &name, 0);
-	    cef_process_message_t *message = cef_process_message_create(&name);
+    } else if (strcmp(out.str, "ClickDispatched") == 0) {
+	    cef_list_value_t *arguments = message->get_argument_list(message);
+	    unsigned int command_id = arguments->get_int(arguments, 0);
 
-	    browser->send_process_message(browser, PID_RENDERER, message);
+	    if (arguments->get_size(arguments) > 1 &&
+		!arguments->get_bool(arguments, 1))
+		    client->context->finishFailure(client->context, command_id,
+			click_not_seen_error());
+	    else
+		    client->context->finish(client->context, command_id, NULL);
 
 	    success = 1;
-    } else if (strcmp(out.str, "SendKeyEvent") == 0) {
+    } else if (strcmp(out.str, "RequestInvocationResult") == 0) {
 	    cef_list_value_t *arguments = message->get_argument_list(message);
 
-	    int c = arguments->get_int(arguments, 0);
-
-	    cef_key_event_t event = {};
-	    event.type = KEYEVENT_KEYDOWN;
-
-	    int key_code = toupper(c);
-
-	    switch (key_code) {
-	    case '`': key_code = 192; break;
-	    case '-': key_code = 189; break;
-	    case '=': key_code = 187; break;
-	    case '[': key_code = 219; break;
-	    case ']': key_code = 221; break;
-	    case '\\': key_code = 220; break;
-	    case ';': key_code = 186; break;
-	    case '\'': key_code = 222; break;
-	    case ',': key_code = 188; break;
-	    case '.': key_code = 190; break;
-	    case '/': key_code = 191; break;
-	    case 127: key_code = 46; break;  //delete
-	    case '~': key_code = 192; break;
-	    case '!': key_code = 49; break;
-	    case '@': key_code = 50; break;
-	    case '#': key_code = 51; break;
-	    case '$': key_code = 52; break;
-	    case '%': key_code = 53; break;
-	    case '^': key_code = 54; break;
-	    case '&': key_code = 55; break;
-	    case '*': key_code = 56; break;
-	    case '(': key_code = 57; break;
-	    case ')': key_code = 48; break;
-	    case '_': key_code = 189; break;
-	    case '+': key_code = 187; break;
-	    case '{': key_code = 219; break;
-	    case '}': key_code = 221; break;
-	    case '|': key_code = 220; break;
-	    case ':': key_code = 186; break;
-	    case '"': key_code = 222; break;
-	    case '<': key_code = 188; break;
-	    case '>': key_code = 190; break;
-	    case '?': key_code = 191; break;
-	    case '\b':
-	    case '\t':
-	    case '\n':
-	    case '\e':
-	    case ' ': break;
-	    default:
-		     if (key_code < '0' || key_code > 'Z')
-			     key_code = 0;
+	    cef_string_t name = {};
+	    cef_string_set(u"InvocationResultRequest", 23, &name, 0);
+	    cef_process_message_t *request = cef_process_message_create(&name);
+
+	    cef_list_value_t *args = request->get_argument_list(request);
+	    args->set_int(args, 0, arguments->get_int(arguments, 0));
+	    if (arguments->get_type(arguments, 1) == VTYPE_STRING) {
+		    cef_string_userfree_t value = arguments->get_string(arguments, 1);
+		    args->set_string(args, 1, value);
+		    if (value != NULL)
+			    cef_string_userfree_free(value);
 	    }
 
-	    event.windows_key_code = event.native_key_code = key_code;
-	    event.character = c;
-
-	    cef_browser_host_t *host = browser->get_host(browser);
-	    host->send_key_event(host, &event);
-
-	    event.type = KEYEVENT_CHAR;
-	    host->send_key_event(host, &event);
+	    browser->send_process_message(browser, PID_RENDERER, request);
 
-	    event.type = KEYEVENT_KEYUP;
-	    host->send_key_event(host, &event);
+	    success = 1;
+    } else if (strcmp(out.str, "SendKeyEvents") == 0) {
+	    cef_list_value_t *arguments = message->get_argument_list(message);
+	    cef_string_userfree_t text = arguments->get_string(arguments, 0);
 
+	    cef_browser_host_t *host = browser->get_host(browser);
+	    if (text != NULL) {
+		    for (size_t i = 0; i < text->length; i++)
+			    send_character(host, text->str[i]);
+		    cef_string_userfree_free(text);
+	    }
 	    host->base.release((cef_base_t *)host);
 
 	    success = 1;
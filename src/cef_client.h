@@ -7,11 +7,21 @@
 #include "cef_life_span_handler.h"
 #include "cef_render_handler.h"
 #include "context.h"
+#include "shared_ring.h"
 
 typedef struct _client_t {
 	cef_client_t client;
 	atomic_int ref_count;
 	Context *context;
+	// Resource requests of the browser in flight and the CLOCK_MONOTONIC
+	// time, in nanoseconds, at which their number last changed. Counted on
+	// the IO thread, where the window itself may already be gone, so they
+	// live with the client rather than the window.
+	atomic_int requests_in_flight;
+	atomic_llong network_changed_at;
+	// The ring of the browser's render process, mapped on its first large
+	// result and dropped when the renderer goes away. UI thread only.
+	SharedRing *ring;
 } client_t;
 
 struct _cef_context_menu_handler_t* CEF_CALLBACK get_context_menu_handler(
@@ -31,7 +31,16 @@ int CEF_CALLBACK on_before_popup(struct _cef_life_span_handler_t* self,
     const struct _cef_popup_features_t* popupFeatures,
     struct _cef_window_info_t* windowInfo, struct _cef_client_t** client,
     struct _cef_browser_settings_t* settings, int* no_javascript_access) {
-	return 1;
+	life_span_handler_t *handler = (life_span_handler_t *)self;
+
+	// Popups join the session of the window that opened them, as windows
+	// of their own.
+	Context *context = create_window(handler->context->session);
+#ifdef WINDOWLESS
+	windowInfo->windowless_rendering_enabled = 1;
+#endif
+	*client = context->client;
+	return 0;
 }
 
 ///
@@ -39,7 +48,10 @@ int CEF_CALLBACK on_before_popup(struct _cef_life_span_handler_t* self,
 ///
 void CEF_CALLBACK on_after_created(struct _cef_life_span_handler_t* self,
     struct _cef_browser_t* browser)
-{ }
+{
+	life_span_handler_t *handler = (life_span_handler_t *)self;
+	window_created(handler->context, browser);
+}
 
 ///
 // Called when a modal window is about to display and the modal loop should
@@ -124,5 +136,6 @@ int CEF_CALLBACK do_close(struct _cef_life_span_handler_t* self,
 void CEF_CALLBACK on_before_close(struct _cef_life_span_handler_t* self,
     struct _cef_browser_t* browser)
 {
-	browser->base.release((cef_base_t *)browser);
+	life_span_handler_t *handler = (life_span_handler_t *)self;
+	window_closed(handler->context, browser);
 }
@@ -41,7 +41,18 @@ void CEF_CALLBACK on_loading_state_change(struct _cef_load_handler_t* self,
 // OnLoadingStateChange instead.
 ///
 void CEF_CALLBACK on_load_start(struct _cef_load_handler_t* self,
-    struct _cef_browser_t* browser, struct _cef_frame_t* frame) {}
+    struct _cef_browser_t* browser, struct _cef_frame_t* frame)
+{
+	// Frames of other origins keep storage of their own, which Reset has
+	// to clear as well.
+	cef_string_userfree_t url = frame->get_url(frame);
+	if (url != NULL) {
+		window_loading(((load_handler *)self)->context, url);
+		cef_string_userfree_free(url);
+	}
+	frame->base.release((cef_base_t *)frame);
+	browser->base.release((cef_base_t *)browser);
+}
 
 ///
 // Called when the browser is done loading a frame. The |frame| value will
@@ -1,11 +1,16 @@
+#include <limits.h>
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
 
 #include "include/capi/cef_render_process_handler_capi.h"
 
 #include "capybara_invocation_handler.h"
 #include "cef_render_process_handler.h"
 #include "cef_base.h"
+#include "shared_ring.h"
+#include "transcode.h"
+#include "typed_value.h"
 
 IMPLEMENT_REFCOUNTING(render_process_handler)
 GENERATE_CEF_BASE_INITIALIZER(render_process_handler)
@@ -43,7 +48,7 @@ loadJavascript() {
 	int size = (char *)&_binary_src_capybara_js_end - (char *)&_binary_src_capybara_js_start;
 
 	m_capybaraJavascript = calloc(1, sizeof(cef_string_t));
-	cef_string_utf8_to_utf16(&_binary_src_capybara_js_start, size, m_capybaraJavascript);
+	transcode_utf8_to_utf16(&_binary_src_capybara_js_start, size, m_capybaraJavascript);
 	return m_capybaraJavascript;
 }
 
@@ -72,6 +77,8 @@ on_browser_created(
     struct _cef_browser_t* browser)
 { }
 
+static void drop_pending_bodies(cef_browser_t *browser);
+
 ///
 // Called before a browser is destroyed.
 ///
@@ -80,7 +87,9 @@ CEF_CALLBACK
 on_browser_destroyed(
     struct _cef_render_process_handler_t* self,
     struct _cef_browser_t* browser)
-{ }
+{
+	drop_pending_bodies(browser);
+}
 
 ///
 // Return the handler for browser load status events.
@@ -110,6 +119,231 @@ on_before_navigation(
 	return 0;
 }
 
+static
+cef_v8handler_t *
+create_invocation_handler(void)
+{
+	capybara_invocation_handler *h = calloc(1, sizeof(capybara_invocation_handler));
+	initialize_capybara_invocation_handler(h);
+	return (cef_v8handler_t *)h;
+}
+
+///
+// Native bridge functions of the CapybaraInvocation object and the
+// Capybara functions they are called from are kept for each V8 context of
+// a main frame, from its creation until its release, instead of being
+// rebuilt for every invocation. Only used on the renderer thread.
+///
+typedef struct _BridgeFunction {
+	struct _BridgeFunction *next;
+	cef_string_t name;
+	cef_v8value_t *function;
+} BridgeFunction;
+
+typedef struct _InvocationBridge {
+	struct _InvocationBridge *next;
+	cef_v8context_t *context;
+	cef_v8value_t *capybara;
+	cef_v8value_t *invoke;
+	cef_v8value_t *invocation;
+	BridgeFunction *functions;
+} InvocationBridge;
+
+static InvocationBridge *bridges;
+
+static
+void
+set_invocation_function(cef_v8value_t *invocation, cef_v8handler_t *handler,
+    const char16 *name, size_t length)
+{
+	cef_string_t key = {};
+	cef_string_set(name, length, &key, 0);
+	handler->base.add_ref((cef_base_t *)handler);
+	cef_v8value_t *fn = cef_v8value_create_function(&key, handler);
+	invocation->set_value_bykey(invocation, &key, fn, V8_PROPERTY_ATTRIBUTE_NONE);
+}
+
+///
+// Looks up the Capybara object of |context| and installs the
+// CapybaraInvocation object, with its bridge functions, on its window.
+// Returns NULL when the Capybara extension is missing from the context.
+///
+static
+InvocationBridge *
+create_bridge(cef_v8context_t *context)
+{
+	cef_v8value_t *window = context->get_global(context);
+
+	cef_string_t key = {};
+	cef_string_set(u"Capybara", 8, &key, 0);
+	cef_v8value_t *capybara = window->get_value_bykey(window, &key);
+	if (capybara == NULL || !capybara->is_object(capybara)) {
+		if (capybara != NULL)
+			capybara->base.release((cef_base_t *)capybara);
+		window->base.release((cef_base_t *)window);
+		return NULL;
+	}
+
+	InvocationBridge *bridge = calloc(1, sizeof(InvocationBridge));
+	context->base.add_ref((cef_base_t *)context);
+	bridge->context = context;
+	bridge->capybara = capybara;
+
+	cef_string_set(u"invoke", 6, &key, 0);
+	bridge->invoke = capybara->get_value_bykey(capybara, &key);
+
+	cef_v8handler_t *handler = create_invocation_handler();
+	cef_v8value_t *invocation = cef_v8value_create_object(NULL);
+	set_invocation_function(invocation, handler, u"hover", 5);
+	set_invocation_function(invocation, handler, u"clickTest", 9);
+	set_invocation_function(invocation, handler, u"leftClick", 9);
+	set_invocation_function(invocation, handler, u"rightClick", 10);
+	set_invocation_function(invocation, handler, u"doubleClick", 11);
+	set_invocation_function(invocation, handler, u"done", 4);
+	set_invocation_function(invocation, handler, u"clicked", 7);
+	set_invocation_function(invocation, handler, u"sendKeys", 8);
+
+	invocation->base.add_ref((cef_base_t *)invocation);
+	bridge->invocation = invocation;
+	cef_string_set(u"CapybaraInvocation", 18, &key, 0);
+	window->set_value_bykey(window, &key, invocation, V8_PROPERTY_ATTRIBUTE_NONE);
+	window->base.release((cef_base_t *)window);
+
+	bridge->next = bridges;
+	bridges = bridge;
+	return bridge;
+}
+
+///
+// Returns the bridge of |context|, creating it if the context was not seen
+// being created.
+///
+static
+InvocationBridge *
+find_bridge(cef_v8context_t *context)
+{
+	for (InvocationBridge *bridge = bridges; bridge != NULL; bridge = bridge->next) {
+		context->base.add_ref((cef_base_t *)context);
+		if (bridge->context->is_same(bridge->context, context))
+			return bridge;
+	}
+
+	return create_bridge(context);
+}
+
+static
+void
+free_bridge(InvocationBridge *bridge)
+{
+	BridgeFunction *function = bridge->functions;
+	while (function != NULL) {
+		BridgeFunction *next = function->next;
+		function->function->base.release((cef_base_t *)function->function);
+		cef_string_clear(&function->name);
+		free(function);
+		function = next;
+	}
+
+	if (bridge->invoke != NULL)
+		bridge->invoke->base.release((cef_base_t *)bridge->invoke);
+	bridge->invocation->base.release((cef_base_t *)bridge->invocation);
+	bridge->capybara->base.release((cef_base_t *)bridge->capybara);
+	bridge->context->base.release((cef_base_t *)bridge->context);
+	free(bridge);
+}
+
+///
+// Returns Capybara[|name|], looking it up on first use, or NULL when it is
+// not a function.
+///
+static
+cef_v8value_t *
+find_function(InvocationBridge *bridge, const cef_string_t *name)
+{
+	for (BridgeFunction *function = bridge->functions; function != NULL;
+	    function = function->next) {
+		if (function->name.length == name->length &&
+		    memcmp(function->name.str, name->str,
+		    name->length * sizeof(char16)) == 0)
+			return function->function;
+	}
+
+	cef_v8value_t *value = bridge->capybara->get_value_bykey(bridge->capybara, name);
+	if (value == NULL)
+		return NULL;
+	if (!value->is_function(value)) {
+		value->base.release((cef_base_t *)value);
+		return NULL;
+	}
+
+	BridgeFunction *function = calloc(1, sizeof(BridgeFunction));
+	cef_string_set(name->str, name->length, &function->name, 1);
+	function->function = value;
+	function->next = bridge->functions;
+	bridge->functions = function;
+	return value;
+}
+
+///
+// Calls Capybara[name] through Capybara.invoke(), which leaves what the
+// function throws in window.CapybaraInvocationError. The function name,
+// the allowUnattached flag and the function arguments are taken from
+// |arguments|, starting at |index|. Returns 1 and sets |retval| when the
+// function returned, or 0 when it threw.
+///
+static
+int
+run_invocation(InvocationBridge *bridge, int command_id,
+    cef_list_value_t *arguments, int index, cef_v8value_t **retval)
+{
+	*retval = NULL;
+	if (bridge == NULL || bridge->invoke == NULL)
+		return 0;
+
+	cef_v8value_t *invocation = bridge->invocation;
+	cef_string_t key = {};
+	cef_string_set(u"commandId", 9, &key, 0);
+	invocation->set_value_bykey(invocation, &key, cef_v8value_create_int(command_id), V8_PROPERTY_ATTRIBUTE_NONE);
+	cef_string_set(u"allowUnattached", 15, &key, 0);
+	invocation->set_value_bykey(invocation, &key,
+	    cef_v8value_create_bool(arguments->get_bool(arguments, index + 1)),
+	    V8_PROPERTY_ATTRIBUTE_NONE);
+
+	cef_string_userfree_t name = arguments->get_string(arguments, index);
+	cef_v8value_t *function = name != NULL ? find_function(bridge, name) : NULL;
+	if (name != NULL)
+		cef_string_userfree_free(name);
+
+	// Capybara.invoke() takes the function followed by its arguments. A
+	// missing function is passed as undefined so that calling it throws.
+	int size = arguments->get_size(arguments);
+	size_t count = size - index - 1;
+	cef_v8value_t **argv = malloc(count * sizeof(cef_v8value_t *));
+	if (function != NULL) {
+		function->base.add_ref((cef_base_t *)function);
+		argv[0] = function;
+	} else {
+		argv[0] = cef_v8value_create_undefined();
+	}
+	for (int i = index + 2, j = 1; i < size; i++, j++) {
+		cef_string_userfree_t s = arguments->get_string(arguments, i);
+		argv[j] = cef_v8value_create_string(s);
+		if (s != NULL)
+			cef_string_userfree_free(s);
+	}
+
+	bridge->capybara->base.add_ref((cef_base_t *)bridge->capybara);
+	*retval = bridge->invoke->execute_function(bridge->invoke,
+	    bridge->capybara, count, argv);
+	free(argv);
+
+	if (*retval == NULL) {
+		bridge->invoke->clear_exception(bridge->invoke);
+		return 0;
+	}
+	return 1;
+}
+
 ///
 // Called immediately after the V8 context for a frame has been created. To
 // retrieve the JavaScript 'window' object use the
@@ -124,7 +358,10 @@ on_context_created(
     struct _cef_render_process_handler_t* self,
     struct _cef_browser_t* browser, struct _cef_frame_t* frame,
     struct _cef_v8context_t* context)
-{ }
+{
+	if (frame->is_main(frame))
+		create_bridge(context);
+}
 
 ///
 // Called immediately before the V8 context for a frame is released. No
@@ -136,7 +373,17 @@ on_context_released(
     struct _cef_render_process_handler_t* self,
     struct _cef_browser_t* browser, struct _cef_frame_t* frame,
     struct _cef_v8context_t* context)
-{ }
+{
+	for (InvocationBridge **link = &bridges; *link != NULL; link = &(*link)->next) {
+		InvocationBridge *bridge = *link;
+		context->base.add_ref((cef_base_t *)context);
+		if (bridge->context->is_same(bridge->context, context)) {
+			*link = bridge->next;
+			free_bridge(bridge);
+			return;
+		}
+	}
+}
 
 ///
 // Called for global uncaught exceptions in a frame. Execution of this
@@ -168,26 +415,232 @@ on_focused_node_changed(
     struct _cef_domnode_t* node)
 { }
 
+// Deeper values, which are most likely cycles, are sent as null.
+#define RESULT_MAX_DEPTH 32
+
+///
+// Copies a V8 value into a value that can cross to the browser process.
+// Whole numbers that fit are integers, arrays become lists and other
+// objects maps of their own enumerable properties. Functions and undefined
+// become null.
+///
+static
+cef_value_t *
+copy_v8_value(cef_v8value_t *object, int depth)
+{
+	cef_value_t *value = cef_value_create();
+
+	if (object->is_string(object)) {
+		cef_string_userfree_t string = object->get_string_value(object);
+		value->set_string(value, string);
+		if (string != NULL)
+			cef_string_userfree_free(string);
+	} else if (object->is_bool(object)) {
+		value->set_bool(value, object->get_bool_value(object));
+	} else if (object->is_int(object) || object->is_uint(object) ||
+	    object->is_double(object)) {
+		double number = object->get_double_value(object);
+		if (number >= INT_MIN && number <= INT_MAX && number == (int)number)
+			value->set_int(value, (int)number);
+		else
+			value->set_double(value, number);
+	} else if (depth >= RESULT_MAX_DEPTH || object->is_function(object)) {
+		value->set_null(value);
+	} else if (object->is_array(object)) {
+		int length = object->get_array_length(object);
+		cef_list_value_t *list = cef_list_value_create();
+		list->set_size(list, length);
+		for (int i = 0; i < length; i++) {
+			cef_v8value_t *item = object->get_value_byindex(object, i);
+			list->set_value(list, i, copy_v8_value(item, depth + 1));
+			item->base.release((cef_base_t *)item);
+		}
+		value->set_list(value, list);
+	} else if (object->is_object(object)) {
+		cef_dictionary_value_t *dictionary = cef_dictionary_value_create();
+		cef_string_list_t keys = cef_string_list_alloc();
+		object->get_keys(object, keys);
+		int size = cef_string_list_size(keys);
+		for (int i = 0; i < size; i++) {
+			cef_string_t key = {};
+			cef_string_list_value(keys, i, &key);
+			cef_v8value_t *item = object->get_value_bykey(object, &key);
+			if (item != NULL) {
+				dictionary->set_value(dictionary, &key, copy_v8_value(item, depth + 1));
+				item->base.release((cef_base_t *)item);
+			}
+			cef_string_clear(&key);
+		}
+		cef_string_list_free(keys);
+		value->set_dictionary(value, dictionary);
+	} else {
+		value->set_null(value);
+	}
+
+	return value;
+}
+
+///
+// Stores the return value of an invocation at |index| of |args|. Functions
+// are returned by invocations that report their result later through
+// CapybaraInvocation.done(), in which case nothing is stored and 0 is
+// returned.
+///
+static
+int
+set_invocation_result(cef_list_value_t *args, int index, cef_v8value_t *object)
+{
+	if (object->is_string(object)) {
+		cef_string_userfree_t value = object->get_string_value(object);
+		args->set_string(args, index, value);
+		if (value != NULL)
+			cef_string_userfree_free(value);
+	} else if (object->is_bool(object)) {
+		args->set_bool(args, index, object->get_bool_value(object));
+	} else if (object->is_function(object)) {
+		return 0;
+	} else if (!object->is_null(object) && !object->is_undefined(object)) {
+		args->set_value(args, index, copy_v8_value(object, 0));
+	}
+
+	return 1;
+}
+
+///
+// Stores the string at |name| of |error| at |index| of |args|, or |fallback|
+// when |error| is not an object or the value there is not a string.
+///
+static
+void
+set_error_string(cef_list_value_t *args, int index, cef_v8value_t *error,
+    const char16 *name, size_t name_length, const char16 *fallback,
+    size_t fallback_length)
+{
+	cef_v8value_t *value = NULL;
+	if (error != NULL && error->is_object(error)) {
+		cef_string_t key = {};
+		cef_string_set(name, name_length, &key, 0);
+		value = error->get_value_bykey(error, &key);
+	}
+
+	cef_string_userfree_t str = NULL;
+	if (value != NULL && value->is_string(value))
+		str = value->get_string_value(value);
+	if (value != NULL)
+		value->base.release((cef_base_t *)value);
+
+	if (str != NULL) {
+		args->set_string(args, index, str);
+		cef_string_userfree_free(str);
+	} else {
+		cef_string_t text = {};
+		cef_string_set(fallback, fallback_length, &text, 0);
+		args->set_string(args, index, &text);
+	}
+}
+
+///
+// Stores the name and message of the error thrown by an invocation, which
+// Capybara.invoke() leaves in window.CapybaraInvocationError, at |index| and
+// |index| + 1 of |args|. Anything thrown that is not an error with a string
+// name and message is reported as a generic error.
+///
+static
+void
+set_invocation_error(cef_list_value_t *args, int index,
+    cef_v8context_t *context)
+{
+	cef_v8value_t *window = context->get_global(context);
+	cef_string_t key = {};
+	cef_string_set(u"CapybaraInvocationError", 23, &key, 0);
+	cef_v8value_t *error_object = window->get_value_bykey(window, &key);
+	window->base.release((cef_base_t *)window);
+
+	set_error_string(args, index, error_object, u"name", 4, u"Error", 5);
+	set_error_string(args, index + 1, error_object, u"message", 7,
+	    u"JavaScript error", 16);
+
+	if (error_object != NULL)
+		error_object->base.release((cef_base_t *)error_object);
+}
+
+///
+// Hands a result of |length| bytes of UTF-8 to the browser process through
+// the shared ring, so that only where it lies goes in the message. Returns
+// 0 when the ring has no room for it.
+///
+static
+int
+send_shared_utf8(cef_browser_t *browser, int command_id, const char *data,
+    size_t length)
+{
+	int fd;
+	uint64_t position;
+	if (!shared_ring_write(data, length, &fd, &position))
+		return 0;
+
+	cef_string_t name = {};
+	cef_string_set(u"SharedInvocationResult", 22, &name, 0);
+	cef_process_message_t *message = cef_process_message_create(&name);
+
+	// Positions and lengths go as doubles, which hold them exactly.
+	cef_list_value_t *args = message->get_argument_list(message);
+	args->set_int(args, 0, command_id);
+	args->set_int(args, 1, getpid());
+	args->set_int(args, 2, fd);
+	args->set_double(args, 3, position);
+	args->set_double(args, 4, length);
+
+	browser->send_process_message(browser, PID_BROWSER, message);
+	return 1;
+}
+
+///
+// Sends a large string result through the shared ring, converted to UTF-8
+// once here. Returns 0 when the result should be sent in the message
+// instead.
+///
+static
+int
+send_shared_result(cef_browser_t *browser, int command_id,
+    cef_v8value_t *object)
+{
+	if (!object->is_string(object))
+		return 0;
+
+	cef_string_userfree_t value = object->get_string_value(object);
+	if (value == NULL)
+		return 0;
+	if (value->length < SHARED_RING_THRESHOLD) {
+		cef_string_userfree_free(value);
+		return 0;
+	}
+
+	cef_string_utf8_t utf8 = {};
+	transcode_utf16_to_utf8(value->str, value->length, &utf8);
+	cef_string_userfree_free(value);
+
+	int sent = send_shared_utf8(browser, command_id, utf8.str, utf8.length);
+	cef_string_utf8_clear(&utf8);
+	return sent;
+}
+
 void
 CEF_CALLBACK
-handle_invocation_result(struct _cef_browser_t *browser, struct _cef_v8value_t* object)
+handle_invocation_result(struct _cef_browser_t *browser, int command_id, struct _cef_v8value_t* object)
 {
+	if (send_shared_result(browser, command_id, object))
+		return;
+
 	cef_string_t name = {};
 	cef_string_set(u"InvocationResult", 16, &name, 0);
 	cef_process_message_t *message = cef_process_message_create(&name);
 
 	cef_list_value_t *args = message->get_argument_list(message);
+	args->set_int(args, 0, command_id);
 
-	cef_string_userfree_t value = NULL;
-	if (object->is_string(object)) {
-		value = object->get_string_value(object);
-		args->set_string(args, 0, value);
-		if (value != NULL)
-			cef_string_userfree_free(value);
-	} else if (object->is_bool(object)) {
-		int value = object->get_bool_value(object);
-		args->set_bool(args, 0, value);
-	} else if (object->is_function(object)) {
+	if (!set_invocation_result(args, 1, object)) {
+		message->base.release((cef_base_t *)message);
 		return;
 	}
 
@@ -196,36 +649,310 @@ handle_invocation_result(struct _cef_browser_t *browser, struct _cef_v8value_t*
 
 void
 CEF_CALLBACK
-handle_invocation_exception(struct _cef_browser_t *browser, cef_v8value_t *window, struct _cef_v8exception_t* object)
+handle_invocation_exception(struct _cef_browser_t *browser, int command_id, cef_v8context_t *context, struct _cef_v8exception_t* object)
 {
 	cef_string_t message_name = {};
 	cef_string_set(u"InvocationError", 19, &message_name, 0);
 	cef_process_message_t *cef_message = cef_process_message_create(&message_name);
 
 	cef_list_value_t *args = cef_message->get_argument_list(cef_message);
+	args->set_int(args, 0, command_id);
+	set_invocation_error(args, 1, context);
 
-	cef_string_t key = {};
-	cef_string_set(u"CapybaraInvocationError", 23, &key, 0);
-	cef_v8value_t *error_object = window->get_value_bykey(window, &key);
+	browser->send_process_message(browser, PID_BROWSER, cef_message);
+}
 
-	if (error_object != NULL) {
-		cef_v8value_t *val;
-		cef_string_userfree_t str = NULL;
+#define BODY_CHUNK_LENGTH 65536
+// Chunks of a body sent but not yet written out by the browser process.
+// Together with the document's own copy, this bounds what a body holds in
+// memory outside the page to about this many chunks in each process.
+#define BODY_CHUNKS_IN_FLIGHT 4
 
-		cef_string_set(u"name", 4, &key, 0);
-		val = error_object->get_value_bykey(error_object, &key);
-		str = val->get_string_value(val);
-		args->set_string(args, 0, str);
-		cef_string_userfree_free(str);
+///
+// A serialized document being sent to the browser process. Renderer main
+// thread only.
+///
+typedef struct _PendingBody {
+	struct _PendingBody *next;
+	cef_browser_t *browser;
+	int command_id;
+	cef_string_userfree_t text;
+	// The first code unit not sent yet, and the chunks sent but not yet
+	// released by the browser process.
+	size_t start;
+	int in_flight;
+} PendingBody;
 
-		cef_string_set(u"message", 7, &key, 0);
-		val = error_object->get_value_bykey(error_object, &key);
-		str = val->get_string_value(val);
-		args->set_string(args, 1, str);
-		cef_string_userfree_free(str);
+static PendingBody *pending_bodies;
+
+///
+// Returns the number of bytes |length| UTF-16 code units take as UTF-8,
+// counting unpaired surrogates as the replacement character they become.
+///
+static
+size_t
+utf8_length(const char16 *data, size_t length)
+{
+	size_t bytes = 0;
+	for (size_t i = 0; i < length; i++) {
+		char16 c = data[i];
+		if (c < 0x80) {
+			bytes += 1;
+		} else if (c < 0x800) {
+			bytes += 2;
+		} else if (c >= 0xd800 && c <= 0xdbff && i + 1 < length &&
+		    data[i + 1] >= 0xdc00 && data[i + 1] <= 0xdfff) {
+			bytes += 4;
+			i++;
+		} else {
+			bytes += 3;
+		}
 	}
+	return bytes;
+}
 
-	browser->send_process_message(browser, PID_BROWSER, cef_message);
+///
+// Sends chunks of |body| until BODY_CHUNKS_IN_FLIGHT are in flight, and
+// frees it once its last chunk has been sent. Returns 1 when it was freed.
+///
+static
+int
+send_body_chunks(PendingBody *body)
+{
+	const char16 *data = body->text != NULL && body->text->str != NULL ?
+	    body->text->str : u"";
+	size_t length = body->text != NULL ? body->text->length : 0;
+
+	while (body->in_flight < BODY_CHUNKS_IN_FLIGHT) {
+		size_t start = body->start;
+		size_t end = length - start > BODY_CHUNK_LENGTH ?
+		    start + BODY_CHUNK_LENGTH : length;
+		if (end < length && data[end - 1] >= 0xd800 && data[end - 1] <= 0xdbff)
+			end--;
+
+		cef_string_t name = {};
+		cef_string_set(u"BodyChunk", 9, &name, 0);
+		cef_process_message_t *message = cef_process_message_create(&name);
+		cef_list_value_t *args = message->get_argument_list(message);
+		args->set_int(args, 0, body->command_id);
+		cef_string_t chunk = {};
+		cef_string_set(data + start, end - start, &chunk, 0);
+		args->set_string(args, 1, &chunk);
+		args->set_bool(args, 2, end == length);
+		body->browser->send_process_message(body->browser, PID_BROWSER,
+		    message);
+
+		body->start = end;
+		body->in_flight++;
+		if (end == length)
+			break;
+	}
+
+	if (body->start < length)
+		return 0;
+
+	for (PendingBody **link = &pending_bodies; *link != NULL;
+	    link = &(*link)->next) {
+		if (*link == body) {
+			*link = body->next;
+			break;
+		}
+	}
+	if (body->text != NULL)
+		cef_string_userfree_free(body->text);
+	body->browser->base.release((cef_base_t *)body->browser);
+	free(body);
+	return 1;
+}
+
+///
+// Sends a serialized document to the browser process: its length as UTF-8
+// in BodyStart, then the text in BodyChunk messages of at most
+// BODY_CHUNK_LENGTH code units. Chunks never end between the halves of a
+// surrogate pair, so that each one can be converted on its own. At most
+// BODY_CHUNKS_IN_FLIGHT chunks are sent ahead of the client reading them;
+// the browser process releases more with BodyChunksReleased.
+///
+static
+void
+send_body(cef_browser_t *browser, int command_id, cef_v8value_t *body)
+{
+	PendingBody *pending = calloc(1, sizeof(PendingBody));
+	pending->text = body->get_string_value(body);
+	pending->command_id = command_id;
+	browser->base.add_ref((cef_base_t *)browser);
+	pending->browser = browser;
+
+	const char16 *data = pending->text != NULL && pending->text->str != NULL ?
+	    pending->text->str : u"";
+	size_t length = pending->text != NULL ? pending->text->length : 0;
+
+	cef_string_t name = {};
+	cef_string_set(u"BodyStart", 9, &name, 0);
+	cef_process_message_t *message = cef_process_message_create(&name);
+	cef_list_value_t *args = message->get_argument_list(message);
+	args->set_int(args, 0, command_id);
+	args->set_double(args, 1, (double)utf8_length(data, length));
+	browser->send_process_message(browser, PID_BROWSER, message);
+
+	if (!send_body_chunks(pending)) {
+		pending->next = pending_bodies;
+		pending_bodies = pending;
+	}
+}
+
+///
+// Sends more of the body of |command_id| now that |count| of its chunks
+// have left the browser process.
+///
+static
+void
+release_body_chunks(int command_id, int count)
+{
+	for (PendingBody *body = pending_bodies; body != NULL; body = body->next) {
+		if (body->command_id == command_id) {
+			body->in_flight -= count;
+			send_body_chunks(body);
+			return;
+		}
+	}
+}
+
+///
+// Forgets the bodies still being sent through |browser|.
+///
+static
+void
+drop_pending_bodies(cef_browser_t *browser)
+{
+	PendingBody **link = &pending_bodies;
+	while (*link != NULL) {
+		PendingBody *body = *link;
+		browser->base.add_ref((cef_base_t *)browser);
+		if (!body->browser->is_same(body->browser, browser)) {
+			link = &body->next;
+			continue;
+		}
+		*link = body->next;
+		if (body->text != NULL)
+			cef_string_userfree_free(body->text);
+		body->browser->base.release((cef_base_t *)body->browser);
+		free(body);
+	}
+}
+
+///
+// Returns the id Capybara.nodeId() registers |value| under in the context
+// of |data|, an InvocationBridge, or -1 when it is not a node.
+///
+static
+int
+evaluated_node_id(cef_v8value_t *value, void *data)
+{
+	InvocationBridge *bridge = data;
+	cef_string_t name = {};
+	cef_string_set(u"nodeId", 6, &name, 0);
+	cef_v8value_t *function = bridge != NULL ? find_function(bridge, &name) : NULL;
+	if (function == NULL)
+		return -1;
+
+	value->base.add_ref((cef_base_t *)value);
+	bridge->capybara->base.add_ref((cef_base_t *)bridge->capybara);
+	cef_v8value_t *argv[] = { value };
+	cef_v8value_t *id = function->execute_function(function, bridge->capybara,
+	    1, argv);
+	if (id == NULL) {
+		function->clear_exception(function);
+		return -1;
+	}
+
+	int result = id->is_int(id) ? id->get_int_value(id) : -1;
+	id->base.release((cef_base_t *)id);
+	return result;
+}
+
+static
+void
+send_evaluate_error(cef_browser_t *browser, int command_id,
+    const cef_string_t *error)
+{
+	cef_string_t name = {};
+	cef_string_set(u"InvocationError", 15, &name, 0);
+	cef_process_message_t *message = cef_process_message_create(&name);
+
+	cef_list_value_t *args = message->get_argument_list(message);
+	args->set_int(args, 0, command_id);
+	cef_string_set(u"Capybara.JavascriptError", 24, &name, 0);
+	args->set_string(args, 1, &name);
+	args->set_string(args, 2, error);
+
+	browser->send_process_message(browser, PID_BROWSER, message);
+}
+
+///
+// Evaluates |script| in |context| and answers with its value serialized as
+// JSON. The JSON is sent as UTF-8 bytes, or through the shared ring when it
+// is large, so it is never converted to UTF-16 and back.
+///
+static
+void
+evaluate(cef_browser_t *browser, int command_id, cef_v8context_t *context,
+    const cef_string_t *script)
+{
+	cef_v8value_t *retval = NULL;
+	cef_v8exception_t *exception = NULL;
+	if (!context->eval(context, script, &retval, &exception)) {
+		cef_string_userfree_t text = exception != NULL ?
+		    exception->get_message(exception) : NULL;
+		send_evaluate_error(browser, command_id, text);
+		if (text != NULL)
+			cef_string_userfree_free(text);
+		if (exception != NULL)
+			exception->base.release((cef_base_t *)exception);
+		return;
+	}
+
+	if (retval == NULL)
+		retval = cef_v8value_create_undefined();
+	const char *error = NULL;
+	cef_string_userfree_utf8_t json = encode_v8_json(retval,
+	    evaluated_node_id, find_bridge(context), &error);
+	retval->base.release((cef_base_t *)retval);
+
+	if (json == NULL) {
+		cef_string_t text = {};
+		transcode_utf8_to_utf16(error, strlen(error), &text);
+		send_evaluate_error(browser, command_id, &text);
+		cef_string_clear(&text);
+		return;
+	}
+
+	if (json->length < SHARED_RING_THRESHOLD ||
+	    !send_shared_utf8(browser, command_id, json->str, json->length)) {
+		cef_string_t name = {};
+		cef_string_set(u"InvocationResult", 16, &name, 0);
+		cef_process_message_t *message = cef_process_message_create(&name);
+
+		cef_list_value_t *args = message->get_argument_list(message);
+		args->set_int(args, 0, command_id);
+		args->set_binary(args, 1,
+		    cef_binary_value_create(json->str, json->length));
+
+		browser->send_process_message(browser, PID_BROWSER, message);
+	}
+
+	cef_string_userfree_utf8_free(json);
+}
+
+static
+cef_v8context_t *
+enter_main_frame_context(struct _cef_browser_t *browser)
+{
+	cef_frame_t *frame = browser->get_main_frame(browser);
+	cef_v8context_t *context = frame->get_v8context(frame);
+	frame->base.release((cef_base_t* )frame);
+	context->enter(context);
+	return context;
 }
 
 ///
@@ -243,97 +970,154 @@ on_render_process_message_received(
 	int success;
 	cef_string_userfree_t name = message->get_name(message);
 	cef_string_utf8_t out = {};
-	cef_string_utf16_to_utf8(name->str, name->length, &out);
+	transcode_utf16_to_utf8(name->str, name->length, &out);
 	cef_string_userfree_free(name);
 	if (strcmp(out.str, "CapybaraInvocation") == 0) {
 		cef_list_value_t *arguments = message->get_argument_list(message);
+		int command_id = arguments->get_int(arguments, 0);
 
-		cef_frame_t *frame = browser->get_main_frame(browser);
-		cef_v8context_t *context = frame->get_v8context(frame);
-		frame->base.release((cef_base_t* )frame);
-		context->enter(context);
-
-		cef_v8value_t *invocation = cef_v8value_create_object(NULL);
+		cef_v8context_t *context = enter_main_frame_context(browser);
+		InvocationBridge *bridge = find_bridge(context);
 
-		cef_string_userfree_t s;
-		s = arguments->get_string(arguments, 0);
-		cef_v8value_t *function_name = cef_v8value_create_string(s);
-		cef_string_userfree_free(s);
-		cef_string_t key = {};
-		cef_string_set(u"functionName", 12, &key, 0);
-		invocation->set_value_bykey(invocation, &key, function_name, V8_PROPERTY_ATTRIBUTE_NONE);
+		cef_v8value_t *retval = NULL;
+		if (run_invocation(bridge, command_id, arguments, 1, &retval))
+			handle_invocation_result(browser, command_id, retval);
+		else
+			handle_invocation_exception(browser, command_id, context, NULL);
+		if (retval != NULL)
+			retval->base.release((cef_base_t *)retval);
 
-		cef_v8value_t *allow_unattached = cef_v8value_create_bool(arguments->get_bool(arguments, 1));
-		cef_string_set(u"allowUnattached", 15, &key, 0);
-		invocation->set_value_bykey(invocation, &key, allow_unattached, V8_PROPERTY_ATTRIBUTE_NONE);
+		context->exit(context);
+		context->base.release((cef_base_t *)context);
 
-		int size = arguments->get_size(arguments);
-		cef_v8value_t *invocation_arguments = cef_v8value_create_array(size - 2);
-		for (int i = 2, j = 0; i < size; i++, j++) {
-			s = arguments->get_string(arguments, i);
-			cef_v8value_t *argument = cef_v8value_create_string(s);
-			if (s != NULL)
-				cef_string_userfree_free(s);
-			invocation_arguments->set_value_byindex(invocation_arguments, j, argument);
-		}
+		success = 1;
+	} else if (strcmp(out.str, "CapybaraBody") == 0) {
+		cef_list_value_t *arguments = message->get_argument_list(message);
+		int command_id = arguments->get_int(arguments, 0);
 
-		cef_string_set(u"arguments", 9, &key, 0);
-		invocation->set_value_bykey(invocation, &key, invocation_arguments, V8_PROPERTY_ATTRIBUTE_NONE);
+		cef_v8context_t *context = enter_main_frame_context(browser);
+		InvocationBridge *bridge = find_bridge(context);
 
-		capybara_invocation_handler *h = calloc(1, sizeof(capybara_invocation_handler));
-		initialize_capybara_invocation_handler(h);
-		cef_v8handler_t *handler = (cef_v8handler_t *)h;
+		cef_v8value_t *retval = NULL;
+		if (run_invocation(bridge, command_id, arguments, 1, &retval) && retval->is_string(retval))
+			send_body(browser, command_id, retval);
+		else
+			handle_invocation_exception(browser, command_id, context, NULL);
+		if (retval != NULL)
+			retval->base.release((cef_base_t *)retval);
 
-		handler->base.add_ref((cef_base_t *)handler);
-		cef_string_set(u"hover", 5, &key, 0);
-		cef_v8value_t *fn = cef_v8value_create_function(&key, handler);
-		invocation->set_value_bykey(invocation, &key, fn, V8_PROPERTY_ATTRIBUTE_NONE);
+		context->exit(context);
+		context->base.release((cef_base_t *)context);
 
-		handler->base.add_ref((cef_base_t *)handler);
-		cef_string_set(u"clickTest", 9, &key, 0);
-		fn = cef_v8value_create_function(&key, handler);
-		invocation->set_value_bykey(invocation, &key, fn, V8_PROPERTY_ATTRIBUTE_NONE);
+		success = 1;
+	} else if (strcmp(out.str, "BodyChunksReleased") == 0) {
+		cef_list_value_t *arguments = message->get_argument_list(message);
+		release_body_chunks(arguments->get_int(arguments, 0),
+		    arguments->get_int(arguments, 1));
 
-		handler->base.add_ref((cef_base_t *)handler);
-		cef_string_set(u"leftClick", 9, &key, 0);
-		fn = cef_v8value_create_function(&key, handler);
-		invocation->set_value_bykey(invocation, &key, fn, V8_PROPERTY_ATTRIBUTE_NONE);
+		success = 1;
+	} else if (strcmp(out.str, "CapybaraEvaluate") == 0) {
+		cef_list_value_t *arguments = message->get_argument_list(message);
+		int command_id = arguments->get_int(arguments, 0);
+		cef_string_userfree_t script = arguments->get_string(arguments, 1);
 
-		handler->base.add_ref((cef_base_t *)handler);
-		cef_string_set(u"done", 4, &key, 0);
-		fn = cef_v8value_create_function(&key, handler);
-		invocation->set_value_bykey(invocation, &key, fn, V8_PROPERTY_ATTRIBUTE_NONE);
+		cef_v8context_t *context = enter_main_frame_context(browser);
+		evaluate(browser, command_id, context, script);
+		context->exit(context);
+		context->base.release((cef_base_t *)context);
 
-		handler->base.add_ref((cef_base_t *)handler);
-		cef_string_set(u"keypress", 8, &key, 0);
-		fn = cef_v8value_create_function(&key, handler);
-		invocation->set_value_bykey(invocation, &key, fn, V8_PROPERTY_ATTRIBUTE_NONE);
+		if (script != NULL)
+			cef_string_userfree_free(script);
 
-		cef_v8value_t *object = context->get_global(context);
+		success = 1;
+	} else if (strcmp(out.str, "CapybaraMultiInvocation") == 0) {
+		cef_list_value_t *arguments = message->get_argument_list(message);
+		int command_id = arguments->get_int(arguments, 0);
+		int size = arguments->get_size(arguments);
 
-		cef_string_set(u"CapybaraInvocation", 18, &key, 0);
-		object->set_value_bykey(object, &key, invocation, V8_PROPERTY_ATTRIBUTE_NONE);
+		cef_string_t name = {};
+		cef_string_set(u"MultiInvocationResult", 21, &name, 0);
+		cef_process_message_t *result = cef_process_message_create(&name);
+		cef_list_value_t *results = result->get_argument_list(result);
+		results->set_int(results, 0, command_id);
 
-		cef_string_t script = {};
-		cef_string_set(u"Capybara.invoke()", 17, &script, 0);
+		cef_v8context_t *context = enter_main_frame_context(browser);
+		InvocationBridge *bridge = find_bridge(context);
 
-		cef_v8value_t *retval = NULL;
-		cef_v8exception_t *exception = NULL;
-		if (context->eval(context, &script, &retval, &exception))
-			handle_invocation_result(browser, retval);
-		else
-			handle_invocation_exception(browser, object, exception);
+		// Every item is evaluated within this one context entry. Items
+		// are lists of the function name, the allowUnattached flag and
+		// the function arguments, and each one is answered by a list of
+		// a success flag followed by the value or the error name and
+		// message.
+		for (int i = 1; i < size; i++) {
+			cef_list_value_t *item = arguments->get_list(arguments, i);
+			cef_list_value_t *item_result = cef_list_value_create();
+			cef_v8value_t *retval = NULL;
+			int returned = run_invocation(bridge, command_id, item, 0, &retval);
+			item->base.release((cef_base_t *)item);
+			if (returned) {
+				item_result->set_bool(item_result, 0, 1);
+				set_invocation_result(item_result, 1, retval);
+				retval->base.release((cef_base_t *)retval);
+			} else {
+				item_result->set_bool(item_result, 0, 0);
+				set_invocation_error(item_result, 1, context);
+			}
+			results->set_list(results, i, item_result);
+		}
 
 		context->exit(context);
 		context->base.release((cef_base_t *)context);
 
+		browser->send_process_message(browser, PID_BROWSER, result);
+
 		success = 1;
 	} else if (strcmp(out.str, "InvocationResultRequest") == 0) {
+		cef_list_value_t *arguments = message->get_argument_list(message);
+
 		cef_string_t name = {};
 		cef_string_set(u"InvocationResult", 16, &name, 0);
-		cef_process_message_t *message = cef_process_message_create(&name);
+		cef_process_message_t *result = cef_process_message_create(&name);
 
-		browser->send_process_message(browser, PID_BROWSER, message);
+		cef_list_value_t *args = result->get_argument_list(result);
+		args->set_int(args, 0, arguments->get_int(arguments, 0));
+		if (arguments->get_type(arguments, 1) == VTYPE_STRING) {
+			cef_string_userfree_t value = arguments->get_string(arguments, 1);
+			args->set_string(args, 1, value);
+			if (value != NULL)
+				cef_string_userfree_free(value);
+		}
+
+		browser->send_process_message(browser, PID_BROWSER, result);
+
+		success = 1;
+	} else if (strcmp(out.str, "SharedResultRefused") == 0) {
+		cef_list_value_t *arguments = message->get_argument_list(message);
+		int command_id = arguments->get_int(arguments, 0);
+
+		// The browser process could not open the ring, so the result is
+		// copied back out of it and sent in the message instead.
+		cef_string_utf8_t data = {};
+		if (shared_ring_take((uint64_t)arguments->get_double(arguments, 1),
+		    (size_t)arguments->get_double(arguments, 2), &data)) {
+			cef_string_t name = {};
+			cef_string_set(u"InvocationResult", 16, &name, 0);
+			cef_process_message_t *result = cef_process_message_create(&name);
+
+			cef_list_value_t *args = result->get_argument_list(result);
+			args->set_int(args, 0, command_id);
+			args->set_binary(args, 1,
+			    cef_binary_value_create(data.str, data.length));
+			cef_string_utf8_clear(&data);
+
+			browser->send_process_message(browser, PID_BROWSER, result);
+		} else {
+			cef_string_t text = {};
+			cef_string_set(u"Could not read the result back", 30, &text, 0);
+			send_evaluate_error(browser, command_id, &text);
+		}
+
+		success = 1;
 	} else {
 		success = 0;
 	}
@@ -0,0 +1,77 @@
+#include <stdio.h>
+
+#include "network_idle.h"
+
+#include "cef_request_handler.h"
+#include "cef_base.h"
+#include "context.h"
+
+IMPLEMENT_REFCOUNTING(request_handler)
+GENERATE_CEF_BASE_INITIALIZER(request_handler)
+
+///
+// Implement this structure to handle events related to browser requests. The
+// functions of this structure will be called on the thread indicated.
+///
+
+///
+// Called on the IO thread before a resource request is loaded. The |request|
+// object may be modified. Return RV_CONTINUE to continue the request
+// immediately. Return RV_CONTINUE_ASYNC and call cef_request_tCallback::
+// cont() at a later time to continue or cancel the request asynchronously.
+// Return RV_CANCEL to cancel the request immediately.
+///
+cef_return_value_t CEF_CALLBACK on_before_resource_load(
+    struct _cef_request_handler_t* self, struct _cef_browser_t* browser,
+    struct _cef_frame_t* frame, struct _cef_request_t* request,
+    struct _cef_request_callback_t* callback)
+{
+	client_t *client = ((request_handler *)self)->client;
+	atomic_fetch_add(&client->requests_in_flight, 1);
+	atomic_store(&client->network_changed_at, monotonic_ns());
+	return RV_CONTINUE;
+}
+
+///
+// Called on the IO thread when a resource load has completed. |request| and
+// |response| represent the request and response respectively and cannot be
+// modified in this callback. |status| indicates the load completion status.
+// |received_content_length| is the number of response bytes actually read.
+///
+void CEF_CALLBACK on_resource_load_complete(
+    struct _cef_request_handler_t* self, struct _cef_browser_t* browser,
+    struct _cef_frame_t* frame, struct _cef_request_t* request,
+    struct _cef_response_t* response, cef_urlrequest_status_t status,
+    int64 received_content_length)
+{
+	client_t *client = ((request_handler *)self)->client;
+	// Requests cancelled before they started may complete without having
+	// been counted, so the count never drops below zero.
+	int count = atomic_load(&client->requests_in_flight);
+	while (count > 0 && !atomic_compare_exchange_weak(
+	    &client->requests_in_flight, &count, count - 1))
+		;
+	atomic_store(&client->network_changed_at, monotonic_ns());
+}
+
+///
+// Called on the browser process UI thread when the render process terminates
+// unexpectedly. |status| indicates how the process terminated.
+///
+void CEF_CALLBACK on_render_process_terminated(
+    struct _cef_request_handler_t* self, struct _cef_browser_t* browser,
+    cef_termination_status_t status)
+{
+	Context *context = ((request_handler *)self)->context;
+	fprintf(stderr, "Renderer terminated with status %d\n", status);
+
+	// The browser survives its renderer, but only a new browser gets a
+	// healthy one, so the next Reset must not clean up in place.
+	atomic_store(&context->renderer_crashed, 1);
+
+	client_t *client = ((request_handler *)self)->client;
+	if (client->ring != NULL) {
+		shared_ring_close(client->ring);
+		client->ring = NULL;
+	}
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdatomic.h>
+
+#include "include/capi/cef_request_handler_capi.h"
+
+#include "context.h"
+#include "cef_client.h"
+
+typedef struct _request_handler {
+	cef_request_handler_t handler;
+	Context *context;
+	client_t *client;
+	atomic_int ref_count;
+} request_handler;
+
+cef_return_value_t CEF_CALLBACK on_before_resource_load(
+    struct _cef_request_handler_t* self, struct _cef_browser_t* browser,
+    struct _cef_frame_t* frame, struct _cef_request_t* request,
+    struct _cef_request_callback_t* callback);
+
+void CEF_CALLBACK on_resource_load_complete(
+    struct _cef_request_handler_t* self, struct _cef_browser_t* browser,
+    struct _cef_frame_t* frame, struct _cef_request_t* request,
+    struct _cef_response_t* response, cef_urlrequest_status_t status,
+    int64 received_content_length);
+
+void CEF_CALLBACK on_render_process_terminated(
+    struct _cef_request_handler_t* self, struct _cef_browser_t* browser,
+    cef_termination_status_t status);
@@ -1,68 +1,211 @@
+#include <limits.h>
 #include <string.h>
 #include <stdlib.h>
 
 #include "command.h"
-#include "string_visitor.h"
 #include "cef_base.h"
 #include "context.h"
+#include "command_registry.h"
+#include "cef_client.h"
+#include "network_idle.h"
+#include "transcode.h"
+#include "typed_value.h"
+
+static
+int
+argument_equals(Argument *argument, const char *value)
+{
+	size_t length = strlen(value);
+	return argument->length == length &&
+	    memcmp(argument->data, value, length) == 0;
+}
+
+///
+// Parses the decimal integer that starts |argument| into |value|, ignoring
+// whatever follows its digits. Returns 0 when it does not fit in an int.
+///
+static
+int
+argument_to_int(Argument *argument, int *value)
+{
+	long long parsed = 0;
+	int sign = 1;
+	size_t i = 0;
+	if (argument->length > 0 && argument->data[0] == '-') {
+		sign = -1;
+		i++;
+	}
+	for (; i < argument->length; i++) {
+		if (argument->data[i] < '0' || argument->data[i] > '9')
+			break;
+		parsed = parsed * 10 + (argument->data[i] - '0');
+		if (parsed > (long long)INT_MAX + 1)
+			return 0;
+	}
+	parsed *= sign;
+	if (parsed > INT_MAX)
+		return 0;
+	*value = (int)parsed;
+	return 1;
+}
+
+static
+void
+fail_command(Command *self, const char *error_class, const char *message)
+{
+	post_response(self->session, self->id, 0,
+	    encode_error(error_class, message, strlen(message)));
+}
+
+///
+// Parses integer argument |index| of |self|, failing the command when it
+// does not fit in an int. Returns 0 once the command has failed.
+///
+static
+int
+int_argument(Command *self, int index, int *value)
+{
+	if (argument_to_int(&self->arguments[index], value))
+		return 1;
+	fail_command(self, "InvalidResponseError", "Integer argument out of range");
+	return 0;
+}
 
+static
+void
+finish_with_string(Command *self, const char *value, size_t length)
+{
+	cef_string_userfree_utf8_t response = cef_string_userfree_utf8_alloc();
+	cef_string_utf8_set(value, length, response, 1);
+	post_response(self->session, self->id, 1, response);
+}
+
+///
+// How long a wait for the network to go idle may take when neither the
+// command nor SetTimeout says.
+///
+#define NETWORK_IDLE_TIMEOUT_MS 10000
+
+static
+int
+network_idle_timeout(Command *self)
+{
+	int timeout = atomic_load(&self->session->timeout);
+	return timeout > 0 ? timeout * 1000 : NETWORK_IDLE_TIMEOUT_MS;
+}
+
+///
+// Visit(url[, idle_ms]): with |idle_ms|, the response also waits until the
+// page's requests have settled for that long.
+///
 static
 void
 run_visit_command(Command *self, Context *context)
 {
 	fprintf(stderr, "Started Visit\n");
+	int idle_ms = 0;
+	if (self->argument_count > 1 && !int_argument(self, 1, &idle_ms))
+		return;
+	if (idle_ms > 0) {
+		client_t *client = (client_t *)context->client;
+		atomic_store(&client->network_changed_at, monotonic_ns());
+	}
+
 	cef_string_t url = {};
-	cef_string_utf8_to_utf16(self->arguments[0], strlen(self->arguments[0]), &url);
+	transcode_utf8_to_utf16(self->arguments[0].data, self->arguments[0].length, &url);
 	cef_frame_t *frame = context->browser->get_main_frame(context->browser);
 	frame->load_url(frame, &url);
 	frame->base.release((cef_base_t *)frame);
 	cef_string_clear(&url);
-	context->finish(context, NULL);
+
+	if (idle_ms > 0)
+		wait_for_network_idle(context, self->id, idle_ms,
+		    network_idle_timeout(self), 0);
+	else
+		context->finish(context, self->id, NULL);
 }
 
 void
-initialize_visit_command(Command *command, char *arguments[])
+initialize_visit_command(Command *command, Argument arguments[], int argument_count)
 {
+	command->argument_count = argument_count;
 	command->arguments = arguments;
 	command->run = run_visit_command;
 }
 
-IMPLEMENT_REFCOUNTING(string_visitor)
-GENERATE_CEF_BASE_INITIALIZER(string_visitor)
-
-static
-void CEF_CALLBACK get_frame_source(struct _cef_string_visitor_t* self,
-    const cef_string_t* string) {
-	cef_string_userfree_utf8_t out = cef_string_userfree_utf8_alloc();
-	cef_string_utf16_to_utf8(string->str, string->length, out);
-	Context *context = ((string_visitor *)self)->context;
-	context->finish(context, out);
-}
-
+///
+// Asks the renderer to serialize the current document. The body is streamed
+// back in chunks and on to the client as they arrive.
+///
 static
 void
 run_body_command(Command *self, Context *context)
 {
 	fprintf(stderr, "Started Body\n");
-	string_visitor *v;
-	v = calloc(1, sizeof(string_visitor));
-	cef_string_visitor_t *visitor = (cef_string_visitor_t *)v;
-	initialize_cef_base(v);
-	v->context = context;
-	visitor->visit = get_frame_source;
-	visitor->base.add_ref((cef_base_t *)v);
-	cef_frame_t *frame = context->browser->get_main_frame(context->browser);
-	frame->get_source(frame, visitor);
-	frame->base.release((cef_base_t *)frame);
+	cef_string_t name = {};
+	cef_string_set(u"CapybaraBody", 12, &name, 0);
+	cef_process_message_t *message = cef_process_message_create(&name);
+
+	cef_list_value_t *args = message->get_argument_list(message);
+
+	args->set_int(args, 0, self->id);
+
+	cef_string_t value = {};
+	cef_string_set(u"serializeDocument", 17, &value, 0);
+	args->set_string(args, 1, &value);
+
+	args->set_bool(args, 2, 1);
+
+	context->browser->send_process_message(context->browser, PID_RENDERER, message);
 }
 
 void
-initialize_body_command(Command *command, char *arguments[])
+initialize_body_command(Command *command, Argument arguments[], int argument_count)
 {
+	command->argument_count = argument_count;
 	command->arguments = arguments;
 	command->run = run_body_command;
 }
 
+///
+// Answers "unchanged" when the document has not mutated since the epoch in
+// the first argument, and otherwise the current epoch, a newline and the
+// document.
+///
+static
+void
+run_body_if_changed_command(Command *self, Context *context)
+{
+	fprintf(stderr, "Started BodyIfChanged\n");
+	cef_string_t name = {};
+	cef_string_set(u"CapybaraBody", 12, &name, 0);
+	cef_process_message_t *message = cef_process_message_create(&name);
+
+	cef_list_value_t *args = message->get_argument_list(message);
+
+	args->set_int(args, 0, self->id);
+
+	cef_string_t value = {};
+	cef_string_set(u"serializeDocumentIfChanged", 26, &value, 0);
+	args->set_string(args, 1, &value);
+
+	args->set_bool(args, 2, 1);
+
+	transcode_utf8_to_utf16(self->arguments[0].data, self->arguments[0].length, &value);
+	args->set_string(args, 3, &value);
+	cef_string_clear(&value);
+
+	context->browser->send_process_message(context->browser, PID_RENDERER, message);
+}
+
+void
+initialize_body_if_changed_command(Command *command, Argument arguments[], int argument_count)
+{
+	command->argument_count = argument_count;
+	command->arguments = arguments;
+	command->run = run_body_if_changed_command;
+}
+
 static
 void
 run_find_css_command(Command *self, Context *context)
@@ -74,22 +217,25 @@ run_find_css_command(Command *self, Context *context)
 
 	cef_list_value_t *args = message->get_argument_list(message);
 
+	args->set_int(args, 0, self->id);
+
 	cef_string_t value = {};
 	cef_string_set(u"findCss", 7, &value, 0);
-	args->set_string(args, 0, &value);
+	args->set_string(args, 1, &value);
 
-	args->set_bool(args, 1, 1);
+	args->set_bool(args, 2, 1);
 
-	cef_string_utf8_to_utf16(self->arguments[0], strlen(self->arguments[0]), &value);
-	args->set_string(args, 2, &value);
+	transcode_utf8_to_utf16(self->arguments[0].data, self->arguments[0].length, &value);
+	args->set_string(args, 3, &value);
 	cef_string_clear(&value);
 
 	context->browser->send_process_message(context->browser, PID_RENDERER, message);
 }
 
 void
-initialize_find_css_command(Command *command, char *arguments[])
+initialize_find_css_command(Command *command, Argument arguments[], int argument_count)
 {
+	command->argument_count = argument_count;
 	command->arguments = arguments;
 	command->run = run_find_css_command;
 }
@@ -105,15 +251,18 @@ run_node_command(Command *self, Context *context)
 
 	cef_list_value_t *args = message->get_argument_list(message);
 
+	args->set_int(args, 0, self->id);
+
 	cef_string_t value = {};
-	cef_string_utf8_to_utf16(self->arguments[0], strlen(self->arguments[0]), &value);
-	args->set_string(args, 0, &value);
+	transcode_utf8_to_utf16(self->arguments[0].data, self->arguments[0].length, &value);
+	args->set_string(args, 1, &value);
+	cef_string_clear(&value);
 
-	args->set_bool(args, 1, strcmp(self->arguments[1], "true") == 0);
+	args->set_bool(args, 2, argument_equals(&self->arguments[1], "true"));
 
 	for (int i = 2; i < self->argument_count; i++) {
-		cef_string_utf8_to_utf16(self->arguments[i], strlen(self->arguments[i]), &value);
-		args->set_string(args, i, &value);
+		transcode_utf8_to_utf16(self->arguments[i].data, self->arguments[i].length, &value);
+		args->set_string(args, i + 1, &value);
 		cef_string_clear(&value);
 	}
 
@@ -121,7 +270,7 @@ run_node_command(Command *self, Context *context)
 }
 
 void
-initialize_node_command(Command *command, char *arguments[], int argument_count)
+initialize_node_command(Command *command, Argument arguments[], int argument_count)
 {
 	command->argument_count = argument_count;
 	command->arguments = arguments;
@@ -139,47 +288,109 @@ run_find_xpath_command(Command *self, Context *context)
 
 	cef_list_value_t *args = message->get_argument_list(message);
 
+	args->set_int(args, 0, self->id);
+
 	cef_string_t value = {};
 	cef_string_set(u"findXpath", 9, &value, 0);
-	args->set_string(args, 0, &value);
+	args->set_string(args, 1, &value);
 
-	args->set_bool(args, 1, 1);
+	args->set_bool(args, 2, 1);
 
-	cef_string_utf8_to_utf16(self->arguments[0], strlen(self->arguments[0]), &value);
-	args->set_string(args, 2, &value);
+	transcode_utf8_to_utf16(self->arguments[0].data, self->arguments[0].length, &value);
+	args->set_string(args, 3, &value);
 	cef_string_clear(&value);
 
 	context->browser->send_process_message(context->browser, PID_RENDERER, message);
 }
 
 void
-initialize_find_xpath_command(Command *command, char *arguments[])
+initialize_find_xpath_command(Command *command, Argument arguments[], int argument_count)
 {
+	command->argument_count = argument_count;
 	command->arguments = arguments;
 	command->run = run_find_xpath_command;
 }
 
+///
+// Asks the renderer to answer once a selector's matches reach a condition,
+// as described by Capybara.waitFor(). Should the page go away before it
+// answers, an empty response is sent shortly after the timeout instead.
+///
+static
+void
+run_wait_for_command(Command *self, Context *context)
+{
+	fprintf(stderr, "Started WaitFor\n");
+	int timeout;
+	if (!int_argument(self, 3, &timeout))
+		return;
+
+	cef_string_t name = {};
+	cef_string_set(u"CapybaraInvocation", 18, &name, 0);
+	cef_process_message_t *message = cef_process_message_create(&name);
+
+	cef_list_value_t *args = message->get_argument_list(message);
+
+	args->set_int(args, 0, self->id);
+
+	cef_string_t value = {};
+	cef_string_set(u"waitFor", 7, &value, 0);
+	args->set_string(args, 1, &value);
+
+	args->set_bool(args, 2, 1);
+
+	for (int i = 0; i < self->argument_count; i++) {
+		transcode_utf8_to_utf16(self->arguments[i].data, self->arguments[i].length, &value);
+		args->set_string(args, i + 3, &value);
+		cef_string_clear(&value);
+	}
+
+	context->browser->send_process_message(context->browser, PID_RENDERER, message);
+
+	post_fallback_response(self->session, self->id,
+	    (timeout > 0 ? timeout : 0) + 1000L);
+}
+
+void
+initialize_wait_for_command(Command *command, Argument arguments[], int argument_count)
+{
+	command->argument_count = argument_count;
+	command->arguments = arguments;
+	command->run = run_wait_for_command;
+}
+
 static
 void
 run_resize_window_command(Command *self, Context *context)
 {
 	fprintf(stderr, "Started ResizeWindow\n");
 
-	int width = atoi(self->arguments[1]);
-	int height = atoi(self->arguments[2]);
-	context->width = width;
-	context->height = height;
+	int handle, width, height;
+	if (!int_argument(self, 0, &handle) || !int_argument(self, 1, &width) ||
+	    !int_argument(self, 2, &height))
+		return;
 
-	cef_browser_host_t *host = context->browser->get_host(context->browser);
+	Context *window = find_window(self->session, handle);
+	if (window == NULL) {
+		fail_command(self, "NoSuchWindowError", "No such window");
+		return;
+	}
+
+	window->width = width;
+	window->height = height;
+
+	cef_browser_host_t *host = window->browser->get_host(window->browser);
 	host->was_resized(host);
 	host->base.release((cef_base_t *)host);
+	release_window(window);
 
-	context->finish(context, NULL);
+	post_response(self->session, self->id, 1, NULL);
 }
 
 void
-initialize_resize_window_command(Command *command, char *arguments[])
+initialize_resize_window_command(Command *command, Argument arguments[], int argument_count)
 {
+	command->argument_count = argument_count;
 	command->arguments = arguments;
 	command->run = run_resize_window_command;
 }
@@ -190,14 +401,14 @@ run_execute_command(Command *self, Context *context)
 {
 	fprintf(stderr, "Started Execute\n");
 
-	char *script = self->arguments[0];
+	Argument *script = &self->arguments[0];
 
 	cef_browser_host_t *host = context->browser->get_host(context->browser);
 	host->was_resized(host);
 	host->base.release((cef_base_t *)host);
 
 	cef_string_t code = {};
-	cef_string_utf8_to_utf16(script, strlen(script), &code);
+	transcode_utf8_to_utf16(script->data, script->length, &code);
 
 	cef_frame_t *frame = context->browser->get_main_frame(context->browser);
 	frame->execute_java_script(frame, &code, NULL, 0);
@@ -205,12 +416,418 @@ run_execute_command(Command *self, Context *context)
 
 	cef_string_clear(&code);
 
-	context->finish(context, NULL);
+	context->finish(context, self->id, NULL);
 }
 
 void
-initialize_execute_command(Command *command, char *arguments[])
+initialize_execute_command(Command *command, Argument arguments[], int argument_count)
 {
+	command->argument_count = argument_count;
 	command->arguments = arguments;
 	command->run = run_execute_command;
 }
+
+///
+// Evaluates a script in the renderer and answers with its value as JSON.
+///
+static
+void
+run_evaluate_command(Command *self, Context *context)
+{
+	fprintf(stderr, "Started Evaluate\n");
+	cef_string_t name = {};
+	cef_string_set(u"CapybaraEvaluate", 16, &name, 0);
+	cef_process_message_t *message = cef_process_message_create(&name);
+
+	cef_list_value_t *args = message->get_argument_list(message);
+
+	args->set_int(args, 0, self->id);
+
+	cef_string_t value = {};
+	transcode_utf8_to_utf16(self->arguments[0].data, self->arguments[0].length, &value);
+	args->set_string(args, 1, &value);
+	cef_string_clear(&value);
+
+	context->browser->send_process_message(context->browser, PID_RENDERER, message);
+}
+
+void
+initialize_evaluate_command(Command *command, Argument arguments[], int argument_count)
+{
+	command->argument_count = argument_count;
+	command->arguments = arguments;
+	command->run = run_evaluate_command;
+}
+
+///
+// Runs a batch of node invocations in one renderer round trip. The arguments
+// are groups of a function name, the allowUnattached flag, the number of
+// function arguments and the function arguments themselves, each group being
+// sent to the renderer as one list.
+///
+static
+void
+run_multi_command(Command *self, Context *context)
+{
+	fprintf(stderr, "Started Multi\n");
+	cef_string_t name = {};
+	cef_string_set(u"CapybaraMultiInvocation", 23, &name, 0);
+	cef_process_message_t *message = cef_process_message_create(&name);
+
+	cef_list_value_t *args = message->get_argument_list(message);
+
+	args->set_int(args, 0, self->id);
+
+	cef_string_t value = {};
+	int i = 0, item = 1;
+	while (i < self->argument_count) {
+		int count = -1;
+		if (i + 2 < self->argument_count &&
+		    !argument_to_int(&self->arguments[i + 2], &count))
+			count = -1;
+		if (count < 0 || count > self->argument_count - i - 3) {
+			message->base.release((cef_base_t *)message);
+			fail_command(self, "InvalidResponseError",
+			    "Malformed Multi invocation");
+			return;
+		}
+
+		cef_list_value_t *invocation = cef_list_value_create();
+
+		transcode_utf8_to_utf16(self->arguments[i].data, self->arguments[i].length, &value);
+		invocation->set_string(invocation, 0, &value);
+		cef_string_clear(&value);
+
+		invocation->set_bool(invocation, 1, argument_equals(&self->arguments[i + 1], "true"));
+
+		for (int j = 0; j < count; j++) {
+			Argument *argument = &self->arguments[i + 3 + j];
+			transcode_utf8_to_utf16(argument->data, argument->length, &value);
+			invocation->set_string(invocation, j + 2, &value);
+			cef_string_clear(&value);
+		}
+
+		args->set_list(args, item++, invocation);
+		i += 3 + count;
+	}
+
+	context->browser->send_process_message(context->browser, PID_RENDERER, message);
+}
+
+void
+initialize_multi_command(Command *command, Argument arguments[], int argument_count)
+{
+	command->argument_count = argument_count;
+	command->arguments = arguments;
+	command->run = run_multi_command;
+}
+
+///
+// Switches the connection to binary framing, answering with the command
+// names in opcode order, or back to text.
+///
+static
+void
+run_framing_command(Command *self, Context *context)
+{
+	if (argument_equals(&self->arguments[0], "binary")) {
+		size_t length = 0;
+		for (unsigned int i = 1; i <= command_count(); i++)
+			length += strlen(command_for_opcode(i)->name) + 1;
+
+		char *opcodes = arena_alloc(self->arena, length);
+		char *cursor = opcodes;
+		for (unsigned int i = 1; i <= command_count(); i++) {
+			const char *name = command_for_opcode(i)->name;
+			size_t name_length = strlen(name);
+			memcpy(cursor, name, name_length);
+			cursor[name_length] = '\n';
+			cursor += name_length + 1;
+		}
+
+		finish_with_string(self, opcodes, length);
+		self->session->binary_framing = 1;
+	} else if (argument_equals(&self->arguments[0], "text")) {
+		post_response(self->session, self->id, 1, NULL);
+		self->session->binary_framing = 0;
+	} else {
+		fail_command(self, "InvalidResponseError",
+		    "Unsupported framing");
+	}
+}
+
+void
+initialize_framing_command(Command *command, Argument arguments[], int argument_count)
+{
+	command->argument_count = argument_count;
+	command->arguments = arguments;
+	command->run = run_framing_command;
+}
+
+typedef struct {
+	cef_task_t task;
+	Context *context;
+} WindowOpenTask;
+
+static
+void
+CEF_CALLBACK
+execute_window_open(cef_task_t *self)
+{
+	create_browser(((WindowOpenTask *)self)->context);
+}
+
+///
+// Opens a blank window without focusing it. The response is sent once the
+// window's browser exists, so that it is listed by GetWindowHandles.
+///
+static
+void
+run_window_open_command(Command *self, Context *context)
+{
+	fprintf(stderr, "Started WindowOpen\n");
+
+	Context *window = create_window(self->session);
+	window->open_command_id = self->id;
+
+	WindowOpenTask *task = calloc(1, sizeof(WindowOpenTask));
+	task->context = window;
+	cef_task_t *t = (cef_task_t *)task;
+	t->base.size = sizeof(WindowOpenTask);
+	t->execute = execute_window_open;
+	cef_post_task(TID_UI, t);
+}
+
+void
+initialize_window_open_command(Command *command, Argument arguments[], int argument_count)
+{
+	command->argument_count = argument_count;
+	command->arguments = arguments;
+	command->run = run_window_open_command;
+}
+
+static
+void
+run_window_focus_command(Command *self, Context *context)
+{
+	int handle;
+	if (!int_argument(self, 0, &handle))
+		return;
+
+	Context *window = find_window(self->session, handle);
+	if (window == NULL) {
+		fail_command(self, "NoSuchWindowError", "No such window");
+		return;
+	}
+
+	int focused = focus_window(self->session, window);
+	release_window(window);
+	if (!focused) {
+		fail_command(self, "NoSuchWindowError", "No such window");
+		return;
+	}
+
+	post_response(self->session, self->id, 1, NULL);
+}
+
+void
+initialize_window_focus_command(Command *command, Argument arguments[], int argument_count)
+{
+	command->argument_count = argument_count;
+	command->arguments = arguments;
+	command->run = run_window_focus_command;
+}
+
+///
+// Closes a window. Closing the focused window leaves no window focused until
+// the client focuses another one.
+///
+static
+void
+run_window_close_command(Command *self, Context *context)
+{
+	int handle;
+	if (!int_argument(self, 0, &handle))
+		return;
+
+	Context *window = find_window(self->session, handle);
+	if (window == NULL) {
+		fail_command(self, "NoSuchWindowError", "No such window");
+		return;
+	}
+
+	cef_browser_host_t *host = window->browser->get_host(window->browser);
+	host->close_browser(host, 1);
+	host->base.release((cef_base_t *)host);
+	release_window(window);
+
+	post_response(self->session, self->id, 1, NULL);
+}
+
+void
+initialize_window_close_command(Command *command, Argument arguments[], int argument_count)
+{
+	command->argument_count = argument_count;
+	command->arguments = arguments;
+	command->run = run_window_close_command;
+}
+
+static
+void
+run_get_window_handles_command(Command *self, Context *context)
+{
+	size_t length;
+	char *handles = window_handles(self->session, self->arena, &length);
+	finish_with_string(self, handles, length);
+}
+
+void
+initialize_get_window_handles_command(Command *command, Argument arguments[], int argument_count)
+{
+	command->argument_count = argument_count;
+	command->arguments = arguments;
+	command->run = run_get_window_handles_command;
+}
+
+static
+void
+run_get_window_handle_command(Command *self, Context *context)
+{
+	char handle[16];
+	int length = snprintf(handle, sizeof(handle), "%d", context->handle);
+	finish_with_string(self, handle, length);
+}
+
+void
+initialize_get_window_handle_command(Command *command, Argument arguments[], int argument_count)
+{
+	command->argument_count = argument_count;
+	command->arguments = arguments;
+	command->run = run_get_window_handle_command;
+}
+
+static
+void
+run_window_size_command(Command *self, Context *context)
+{
+	int handle;
+	if (!int_argument(self, 0, &handle))
+		return;
+
+	Context *window = find_window(self->session, handle);
+	if (window == NULL) {
+		fail_command(self, "NoSuchWindowError", "No such window");
+		return;
+	}
+
+	char size[32];
+	int length = snprintf(size, sizeof(size), "[%d,%d]", window->width,
+	    window->height);
+	release_window(window);
+	finish_with_string(self, size, length);
+}
+
+void
+initialize_window_size_command(Command *command, Argument arguments[], int argument_count)
+{
+	command->argument_count = argument_count;
+	command->arguments = arguments;
+	command->run = run_window_size_command;
+}
+
+static
+void
+run_set_timeout_command(Command *self, Context *context)
+{
+	int timeout;
+	if (!int_argument(self, 0, &timeout))
+		return;
+
+	atomic_store(&self->session->timeout, timeout);
+	post_response(self->session, self->id, 1, NULL);
+}
+
+void
+initialize_set_timeout_command(Command *command, Argument arguments[], int argument_count)
+{
+	command->argument_count = argument_count;
+	command->arguments = arguments;
+	command->run = run_set_timeout_command;
+}
+
+static
+void
+run_get_timeout_command(Command *self, Context *context)
+{
+	char timeout[16];
+	int length = snprintf(timeout, sizeof(timeout), "%d",
+	    atomic_load(&self->session->timeout));
+	finish_with_string(self, timeout, length);
+}
+
+void
+initialize_get_timeout_command(Command *command, Argument arguments[], int argument_count)
+{
+	command->argument_count = argument_count;
+	command->arguments = arguments;
+	command->run = run_get_timeout_command;
+}
+
+///
+// WaitForNetworkIdle(idle_ms[, timeout_ms[, "renderer"]]) answers "true"
+// once the focused window's requests have settled for |idle_ms|, or "false"
+// if they have not by the timeout. With "renderer", the page's own count of
+// pending XMLHttpRequests, fetches and short timeouts is waited on instead.
+///
+static
+void
+run_wait_for_network_idle_command(Command *self, Context *context)
+{
+	int idle_ms, timeout_ms = 0;
+	if (!int_argument(self, 0, &idle_ms) ||
+	    (self->argument_count > 1 && !int_argument(self, 1, &timeout_ms)))
+		return;
+	if (timeout_ms <= 0)
+		timeout_ms = network_idle_timeout(self);
+
+	if (self->argument_count < 3 ||
+	    !argument_equals(&self->arguments[2], "renderer")) {
+		wait_for_network_idle(context, self->id, idle_ms, timeout_ms, 1);
+		return;
+	}
+
+	cef_string_t name = {};
+	cef_string_set(u"CapybaraInvocation", 18, &name, 0);
+	cef_process_message_t *message = cef_process_message_create(&name);
+
+	cef_list_value_t *args = message->get_argument_list(message);
+
+	args->set_int(args, 0, self->id);
+
+	cef_string_t value = {};
+	cef_string_set(u"waitForIdle", 11, &value, 0);
+	args->set_string(args, 1, &value);
+
+	args->set_bool(args, 2, 1);
+
+	char number[16];
+	int length = snprintf(number, sizeof(number), "%d", idle_ms);
+	transcode_utf8_to_utf16(number, length, &value);
+	args->set_string(args, 3, &value);
+	length = snprintf(number, sizeof(number), "%d", timeout_ms);
+	transcode_utf8_to_utf16(number, length, &value);
+	args->set_string(args, 4, &value);
+	cef_string_clear(&value);
+
+	context->browser->send_process_message(context->browser, PID_RENDERER, message);
+
+	post_fallback_response(self->session, self->id, timeout_ms + 1000L);
+}
+
+void
+initialize_wait_for_network_idle_command(Command *command, Argument arguments[], int argument_count)
+{
+	command->argument_count = argument_count;
+	command->arguments = arguments;
+	command->run = run_wait_for_network_idle_command;
+}
@@ -1,16 +1,85 @@
+#pragma once
+
+#include <stdatomic.h>
+
+#include "include/capi/cef_base_capi.h"
+
+#include "arena.h"
+#include "command_reader.h"
+
 struct _Context;
+struct _Session;
+struct _CommandDefinition;
+
+///
+// A piece of a response body that is streamed to the client.
+///
+typedef struct _ResponseChunk {
+	struct _ResponseChunk *next;
+	cef_string_userfree_utf8_t data;
+} ResponseChunk;
 
 typedef struct _Command {
 	int argument_count;
-	char **arguments;
+	Argument *arguments;
 	void (*run)(struct _Command *self, struct _Context *context);
+	Arena *arena;
+	const struct _CommandDefinition *definition;
+	// Assigned by the server; travels with messages to the renderer.
+	unsigned int id;
+	// Chosen by the client and echoed in binary responses.
+	size_t sequence;
+	int binary_framing;
+	struct _Session *session;
+	// The window focused when the command arrived. Cleared when the
+	// window closes, while the reference taken to it is kept in
+	// held_window until the command is freed.
+	struct _Context *context;
+	struct _Context *held_window;
+	struct _Command *next;
+	int finished;
+	// Work the command started that must complete before its response is
+	// written, such as deleting cookies. See hold_response().
+	atomic_int pending_work;
+	int blocked;
+	// Set once the command's load wait has passed its deadline.
+	int timed_out;
+	int success;
+	// Set when the response is a typed value rather than a string.
+	int typed;
+	cef_string_userfree_utf8_t response;
+	// Links commands whose responses wait for the writer thread.
+	struct _Command *next_response;
+	// Set when the response body is streamed in after the command has
+	// finished: streamed_length bytes, arriving as chunks (newest first)
+	// until stream_complete is set.
+	int streamed;
+	size_t streamed_length;
+	_Atomic(ResponseChunk *) chunks;
+	atomic_int stream_complete;
+	// Links the session's commands whose body is still streaming in.
+	struct _Command *next_stream;
 } Command;
 
-void initialize_visit_command(Command *command, char *arguments[]);
-void initialize_body_command(Command *command, char *arguments[]);
-void initialize_find_css_command(Command *command, char *arguments[]);
-void initialize_node_command(Command *command, char *arguments[], int argument_count);
-void initialize_find_xpath_command(Command *command, char *arguments[]);
-void initialize_reset_command(Command *command, char *arguments[]);
-void initialize_resize_window_command(Command *command, char *arguments[]);
-void initialize_execute_command(Command *command, char *arguments[]);
+void initialize_visit_command(Command *command, Argument arguments[], int argument_count);
+void initialize_body_command(Command *command, Argument arguments[], int argument_count);
+void initialize_body_if_changed_command(Command *command, Argument arguments[], int argument_count);
+void initialize_find_css_command(Command *command, Argument arguments[], int argument_count);
+void initialize_node_command(Command *command, Argument arguments[], int argument_count);
+void initialize_find_xpath_command(Command *command, Argument arguments[], int argument_count);
+void initialize_reset_command(Command *command, Argument arguments[], int argument_count);
+void initialize_resize_window_command(Command *command, Argument arguments[], int argument_count);
+void initialize_execute_command(Command *command, Argument arguments[], int argument_count);
+void initialize_evaluate_command(Command *command, Argument arguments[], int argument_count);
+void initialize_framing_command(Command *command, Argument arguments[], int argument_count);
+void initialize_multi_command(Command *command, Argument arguments[], int argument_count);
+void initialize_window_open_command(Command *command, Argument arguments[], int argument_count);
+void initialize_window_focus_command(Command *command, Argument arguments[], int argument_count);
+void initialize_window_close_command(Command *command, Argument arguments[], int argument_count);
+void initialize_get_window_handles_command(Command *command, Argument arguments[], int argument_count);
+void initialize_get_window_handle_command(Command *command, Argument arguments[], int argument_count);
+void initialize_window_size_command(Command *command, Argument arguments[], int argument_count);
+void initialize_set_timeout_command(Command *command, Argument arguments[], int argument_count);
+void initialize_get_timeout_command(Command *command, Argument arguments[], int argument_count);
+void initialize_wait_for_command(Command *command, Argument arguments[], int argument_count);
+void initialize_wait_for_network_idle_command(Command *command, Argument arguments[], int argument_count);
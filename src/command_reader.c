@@ -0,0 +1,330 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "command_reader.h"
+#include "command_registry.h"
+#include "framing.h"
+
+#define READER_BUFFER_SIZE ((size_t)1 << 20)
+// Larger commands are taken for a broken client rather than buffered.
+#define READER_MAX_COMMAND_SIZE ((size_t)256 << 20)
+#define READER_MAX_LINE 4096
+#define READER_MAX_ARGUMENTS 65536
+#define READER_MAX_VARINT_LENGTH 5
+
+void
+initialize_command_reader(CommandReader *reader, int fd)
+{
+	reader->fd = fd;
+	reader->capacity = READER_BUFFER_SIZE;
+	reader->buffer = malloc(reader->capacity);
+	reader->start = 0;
+	reader->end = 0;
+	reader->slices = NULL;
+	reader->slices_capacity = 0;
+	reader->binary = 0;
+}
+
+void
+free_command_reader(CommandReader *reader)
+{
+	free(reader->buffer);
+	free(reader->slices);
+}
+
+static
+void
+compact(CommandReader *reader)
+{
+	size_t remaining = reader->end - reader->start;
+	if (remaining > 0 && reader->start > 0)
+		memmove(reader->buffer, reader->buffer + reader->start, remaining);
+	reader->start = 0;
+	reader->end = remaining;
+}
+
+///
+// Drops the bytes of the previous command. A buffer grown for a large
+// payload is shrunk back once nothing past the default size is buffered.
+///
+static
+void
+discard_consumed(CommandReader *reader)
+{
+	if (reader->start == reader->end) {
+		reader->start = 0;
+		reader->end = 0;
+	}
+
+	if (reader->capacity > READER_BUFFER_SIZE &&
+	    reader->end - reader->start <= READER_BUFFER_SIZE) {
+		compact(reader);
+		// A failed shrink keeps the larger buffer.
+		char *buffer = realloc(reader->buffer, READER_BUFFER_SIZE);
+		if (buffer != NULL) {
+			reader->buffer = buffer;
+			reader->capacity = READER_BUFFER_SIZE;
+		}
+	}
+}
+
+///
+// Reads until at least |size| bytes past the start of the current command
+// are buffered. Read-ahead is only moved to the front of the buffer once the
+// tail is exhausted, and each read(2) asks for as much as the buffer can
+// hold so that several small commands are picked up by one system call.
+///
+static
+int
+fill(CommandReader *reader, size_t size)
+{
+	if (size > READER_MAX_COMMAND_SIZE)
+		return -1;
+
+	if (reader->start + size > reader->capacity)
+		compact(reader);
+
+	if (size > reader->capacity) {
+		size_t capacity = reader->capacity;
+		while (capacity < size)
+			capacity *= 2;
+		char *buffer = realloc(reader->buffer, capacity);
+		if (buffer == NULL)
+			return -1;
+		reader->buffer = buffer;
+		reader->capacity = capacity;
+	}
+
+	while (reader->end - reader->start < size) {
+		ssize_t bytes_read = read(reader->fd, reader->buffer + reader->end,
+		    reader->capacity - reader->end);
+		if (bytes_read < 0 && errno == EINTR)
+			continue;
+		if (bytes_read <= 0)
+			return 0;
+		reader->end += bytes_read;
+	}
+
+	return 1;
+}
+
+///
+// Finds the next line at |cursor|, which like the returned slice is relative
+// to the start of the current command.
+///
+static
+int
+read_line(CommandReader *reader, size_t *cursor, Slice *line)
+{
+	size_t scanned = *cursor;
+
+	for (;;) {
+		char *data = reader->buffer + reader->start;
+		size_t available = reader->end - reader->start;
+		char *newline = memchr(data + scanned, '\n', available - scanned);
+		if (newline != NULL) {
+			line->offset = *cursor;
+			line->length = newline - (data + *cursor);
+			*cursor = line->offset + line->length + 1;
+			return 1;
+		}
+
+		scanned = available;
+		if (scanned - *cursor > READER_MAX_LINE)
+			return -1;
+
+		int status = fill(reader, available + 1);
+		if (status <= 0)
+			return status;
+	}
+}
+
+static
+int
+parse_size(const char *data, size_t length, size_t *value)
+{
+	if (length == 0 || length > 10)
+		return 0;
+
+	*value = 0;
+	for (size_t i = 0; i < length; i++) {
+		if (data[i] < '0' || data[i] > '9')
+			return 0;
+		*value = *value * 10 + (data[i] - '0');
+	}
+
+	return 1;
+}
+
+///
+// Makes room for the slices of |count| arguments. Returns 0 when they
+// cannot be allocated.
+///
+static
+int
+reserve_slices(CommandReader *reader, int count)
+{
+	if (count <= reader->slices_capacity)
+		return 1;
+
+	int capacity = reader->slices_capacity ? reader->slices_capacity : 8;
+	while (capacity < count)
+		capacity *= 2;
+	Slice *slices = realloc(reader->slices, capacity * sizeof(Slice));
+	if (slices == NULL)
+		return 0;
+	reader->slices = slices;
+	reader->slices_capacity = capacity;
+	return 1;
+}
+
+static
+int
+read_varint(CommandReader *reader, size_t *cursor, size_t *value)
+{
+	*value = 0;
+
+	for (int i = 0; i < READER_MAX_VARINT_LENGTH; i++) {
+		int status = fill(reader, *cursor + 1);
+		if (status <= 0)
+			return status;
+
+		unsigned char byte = reader->buffer[reader->start + *cursor];
+		*cursor += 1;
+		*value = (*value << 7) | (byte & 0x7f);
+		if ((byte & 0x80) == 0)
+			return 1;
+	}
+
+	return -1;
+}
+
+///
+// Hands out the command whose |count| arguments have been recorded in the
+// reader's slices and consumes its |length| bytes.
+///
+static
+void
+take_command(CommandReader *reader, Arena *arena, ReceivedCommand *command,
+    size_t length, Slice *name, size_t count)
+{
+	// The buffer may have moved while reading, so pointers are only taken
+	// once the whole command is buffered.
+	char *data = reader->buffer + reader->start;
+	reader->start += length;
+
+	if (command->definition != NULL) {
+		command->name.data = command->definition->name;
+		command->name.length = strlen(command->definition->name);
+	} else {
+		command->name.data = data + name->offset;
+		command->name.length = name->length;
+	}
+
+	command->argument_count = count;
+	command->arguments = arena_alloc(arena, count * sizeof(Argument));
+	for (size_t i = 0; i < count; i++) {
+		command->arguments[i].data = data + reader->slices[i].offset;
+		command->arguments[i].length = reader->slices[i].length;
+	}
+}
+
+static
+int
+read_binary_command(CommandReader *reader, Arena *arena,
+    ReceivedCommand *command)
+{
+	size_t cursor = 1;
+	size_t count, length;
+	Slice name = {};
+	int status;
+
+	if ((status = fill(reader, 1)) <= 0)
+		return status;
+
+	unsigned char opcode = reader->buffer[reader->start];
+	if ((status = read_varint(reader, &cursor, &command->sequence)) <= 0)
+		return status;
+
+	command->definition = NULL;
+	if (opcode == FRAME_OPCODE_NAMED) {
+		if ((status = read_varint(reader, &cursor, &length)) <= 0)
+			return status;
+		if ((status = fill(reader, cursor + length)) <= 0)
+			return status;
+		name.offset = cursor;
+		name.length = length;
+		cursor += length;
+	} else if ((command->definition = command_for_opcode(opcode)) == NULL) {
+		return -1;
+	}
+
+	if ((status = read_varint(reader, &cursor, &count)) <= 0)
+		return status;
+	if (count > READER_MAX_ARGUMENTS)
+		return -1;
+
+	if (!reserve_slices(reader, count))
+		return -1;
+
+	for (size_t i = 0; i < count; i++) {
+		if ((status = read_varint(reader, &cursor, &length)) <= 0)
+			return status;
+		if ((status = fill(reader, cursor + length)) <= 0)
+			return status;
+
+		reader->slices[i].offset = cursor;
+		reader->slices[i].length = length;
+		cursor += length;
+	}
+
+	take_command(reader, arena, command, cursor, &name, count);
+	return 1;
+}
+
+int
+read_command(CommandReader *reader, Arena *arena, ReceivedCommand *command)
+{
+	discard_consumed(reader);
+
+	if (reader->binary)
+		return read_binary_command(reader, arena, command);
+
+	size_t cursor = 0;
+	size_t count, length;
+	Slice name, line;
+	int status;
+
+	if ((status = read_line(reader, &cursor, &name)) <= 0)
+		return status;
+
+	if ((status = read_line(reader, &cursor, &line)) <= 0)
+		return status;
+	if (!parse_size(reader->buffer + reader->start + line.offset, line.length, &count) ||
+	    count > READER_MAX_ARGUMENTS)
+		return -1;
+
+	if (!reserve_slices(reader, count))
+		return -1;
+
+	for (size_t i = 0; i < count; i++) {
+		if ((status = read_line(reader, &cursor, &line)) <= 0)
+			return status;
+		if (!parse_size(reader->buffer + reader->start + line.offset, line.length, &length))
+			return -1;
+
+		if ((status = fill(reader, cursor + length)) <= 0)
+			return status;
+
+		reader->slices[i].offset = cursor;
+		reader->slices[i].length = length;
+		cursor += length;
+	}
+
+	command->definition = NULL;
+	command->sequence = 0;
+	take_command(reader, arena, command, cursor, &name, count);
+	return 1;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "arena.h"
+
+typedef struct {
+	const char *data;
+	size_t length;
+} Argument;
+
+struct _CommandDefinition;
+
+typedef struct {
+	Argument name;
+	int argument_count;
+	Argument *arguments;
+	// Set when a binary frame named the command by opcode.
+	const struct _CommandDefinition *definition;
+	size_t sequence;
+} ReceivedCommand;
+
+typedef struct {
+	size_t offset;
+	size_t length;
+} Slice;
+
+typedef struct {
+	int fd;
+	char *buffer;
+	size_t capacity;
+	size_t start;
+	size_t end;
+	Slice *slices;
+	int slices_capacity;
+	int binary;
+} CommandReader;
+
+void initialize_command_reader(CommandReader *reader, int fd);
+void free_command_reader(CommandReader *reader);
+
+///
+// Reads the next command from the reader's file descriptor, as a text
+// command or as a binary frame once |binary| has been set. The argument
+// vector of |command| is allocated from |arena|, while the name and argument
+// data point into the reader's buffer and remain valid until the next call.
+// Returns 1 when a command was read, 0 at end of input and -1 if the peer
+// sent a malformed command, or one too large to be buffered.
+///
+int read_command(CommandReader *reader, Arena *arena, ReceivedCommand *command);
@@ -0,0 +1,125 @@
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "command_registry.h"
+
+///
+// Commands understood by the server. Arity is the minimum number of
+// arguments; affinity is the thread a command runs on; commands that wait
+// for load have their response held back while the page is loading.
+// Window commands run against the focused window, the others against the
+// session.
+///
+static const CommandDefinition commands[] = {
+	// name                 initializer                                arity  affinity                   waits  window
+	{ "Visit",              initialize_visit_command,                  1,     COMMAND_AFFINITY_UI,       1,     1 },
+	{ "Body",               initialize_body_command,                   0,     COMMAND_AFFINITY_RENDERER, 1,     1 },
+	{ "FindCss",            initialize_find_css_command,               1,     COMMAND_AFFINITY_RENDERER, 1,     1 },
+	{ "Node",               initialize_node_command,                   2,     COMMAND_AFFINITY_RENDERER, 1,     1 },
+	{ "FindXpath",          initialize_find_xpath_command,             1,     COMMAND_AFFINITY_RENDERER, 1,     1 },
+	{ "WindowResize",       initialize_resize_window_command,          3,     COMMAND_AFFINITY_UI,       1,     0 },
+	{ "Execute",            initialize_execute_command,                1,     COMMAND_AFFINITY_UI,       1,     1 },
+	{ "Reset",              initialize_reset_command,                  0,     COMMAND_AFFINITY_UI,       1,     1 },
+	{ "Framing",            initialize_framing_command,                1,     COMMAND_AFFINITY_READER,   0,     0 },
+	{ "Multi",              initialize_multi_command,                  0,     COMMAND_AFFINITY_RENDERER, 1,     1 },
+	{ "WindowOpen",         initialize_window_open_command,            0,     COMMAND_AFFINITY_UI,       0,     0 },
+	{ "WindowFocus",        initialize_window_focus_command,           1,     COMMAND_AFFINITY_UI,       0,     0 },
+	{ "WindowClose",        initialize_window_close_command,           1,     COMMAND_AFFINITY_UI,       0,     0 },
+	{ "GetWindowHandles",   initialize_get_window_handles_command,     0,     COMMAND_AFFINITY_UI,       0,     0 },
+	{ "GetWindowHandle",    initialize_get_window_handle_command,      0,     COMMAND_AFFINITY_UI,       0,     1 },
+	{ "WindowSize",         initialize_window_size_command,            1,     COMMAND_AFFINITY_UI,       0,     0 },
+	{ "SetTimeout",         initialize_set_timeout_command,            1,     COMMAND_AFFINITY_READER,   0,     0 },
+	{ "GetTimeout",         initialize_get_timeout_command,            0,     COMMAND_AFFINITY_READER,   0,     0 },
+	{ "WaitFor",            initialize_wait_for_command,               4,     COMMAND_AFFINITY_RENDERER, 1,     1 },
+	{ "WaitForNetworkIdle", initialize_wait_for_network_idle_command,  1,     COMMAND_AFFINITY_UI,       1,     1 },
+	{ "BodyIfChanged",      initialize_body_if_changed_command,        1,     COMMAND_AFFINITY_RENDERER, 1,     1 },
+	{ "Evaluate",           initialize_evaluate_command,               1,     COMMAND_AFFINITY_RENDERER, 1,     1 },
+};
+
+#define COMMAND_COUNT (sizeof(commands) / sizeof(commands[0]))
+
+static const CommandDefinition **table;
+static uint32_t seed;
+static uint32_t mask;
+static atomic_ulong misses;
+
+static
+uint32_t
+hash(const char *name, size_t length, uint32_t seed)
+{
+	uint32_t h = 2166136261u ^ seed;
+	for (size_t i = 0; i < length; i++) {
+		h ^= (unsigned char)name[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+///
+// Searches for a seed under which every command name lands in its own slot,
+// doubling the table whenever no seed is found.
+///
+void
+initialize_command_registry(void)
+{
+	uint32_t size = 1;
+	while (size < 2 * COMMAND_COUNT)
+		size <<= 1;
+
+	for (;;) {
+		table = calloc(size, sizeof(CommandDefinition *));
+		mask = size - 1;
+
+		for (seed = 0; seed < 100000; seed++) {
+			size_t i;
+			for (i = 0; i < COMMAND_COUNT; i++) {
+				const char *name = commands[i].name;
+				uint32_t slot = hash(name, strlen(name), seed) & mask;
+				if (table[slot] != NULL)
+					break;
+				table[slot] = &commands[i];
+			}
+			if (i == COMMAND_COUNT)
+				return;
+			memset(table, 0, size * sizeof(CommandDefinition *));
+		}
+
+		free(table);
+		size <<= 1;
+	}
+}
+
+const CommandDefinition *
+find_command(const char *name, size_t length)
+{
+	const CommandDefinition *definition = table[hash(name, length, seed) & mask];
+	if (definition != NULL && strncmp(definition->name, name, length) == 0 &&
+	    definition->name[length] == '\0')
+		return definition;
+
+	atomic_fetch_add(&misses, 1);
+	return NULL;
+}
+
+const CommandDefinition *
+command_for_opcode(unsigned int opcode)
+{
+	if (opcode == 0 || opcode > COMMAND_COUNT)
+		return NULL;
+	return &commands[opcode - 1];
+}
+
+size_t
+command_count(void)
+{
+	return COMMAND_COUNT;
+}
+
+unsigned long
+command_registry_misses(void)
+{
+	return atomic_load(&misses);
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "command.h"
+
+typedef enum {
+	// Runs on the reader thread before the next command is read, for
+	// commands that change how the session reads or times commands.
+	COMMAND_AFFINITY_READER,
+	// Runs on the browser UI thread, in the order received.
+	COMMAND_AFFINITY_UI,
+	// Completes after a round trip to the renderer process. Sent from the
+	// reader thread, or from the UI thread behind UI commands still
+	// waiting to run, so that it sees the window they leave focused.
+	COMMAND_AFFINITY_RENDERER
+} CommandAffinity;
+
+typedef struct _CommandDefinition {
+	const char *name;
+	void (*initialize)(Command *command, Argument arguments[], int argument_count);
+	int arity;
+	CommandAffinity affinity;
+	int waits_for_load;
+	// Whether the command acts on the focused window, and so fails while
+	// no window is focused.
+	int uses_window;
+} CommandDefinition;
+
+///
+// Builds the perfect hash over the command table. Must be called before the
+// first lookup.
+///
+void initialize_command_registry(void);
+
+///
+// Returns the definition for |name|, or NULL after counting a miss.
+///
+const CommandDefinition *find_command(const char *name, size_t length);
+
+///
+// Returns the definition for a binary frame opcode. Opcodes are 1-based
+// indexes into the command table.
+///
+const CommandDefinition *command_for_opcode(unsigned int opcode);
+
+size_t command_count(void);
+
+unsigned long command_registry_misses(void);
@@ -1,80 +1,320 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "context.h"
-#include "command.h"
+#include "cef_client.h"
+
+static
+void finish(Context *self, unsigned int command_id,
+    cef_string_userfree_utf8_t message)
+{
+	// Results can be megabytes long, so only their start is logged.
+	size_t length = message ? message->length : 0;
+	fprintf(stderr, "Command finished with response Success(%.*s%s)\n",
+	    (int)(length < RESPONSE_LOG_LIMIT ? length : RESPONSE_LOG_LIMIT),
+	    message ? message->str : "", length > RESPONSE_LOG_LIMIT ? "..." : "");
+	post_response(self->session, command_id, 1, message);
+}
+
+static
+void finishFailure(Context *self, unsigned int command_id,
+    cef_string_userfree_utf8_t message)
+{
+	fprintf(stderr, "Command finished with response Failure(%s)\n",
+	    message->str);
+	post_response(self->session, command_id, 0, message);
+}
 
 static
 void
-CEF_CALLBACK
-execute(cef_task_t *self)
-{
-	Task *t = ((Task *)self);
-	if (t->context->browser->is_loading(t->context->browser)) {
-		fprintf(stderr, "Blocking response on page load\n");
-		Response *response = calloc(1, sizeof(Response));
-		response->message = t->message;
-		t->context->pending_response = response;
+handle_load_event(Context *self)
+{
+	flush_responses(self->session);
+}
+
+void initialize_context(Context *context)
+{
+    context->finish = finish;
+    context->finishFailure = finishFailure;
+    context->on_load_end = handle_load_event;
+    context->width = 1680;
+    context->height = 1050;
+}
+
+Context *
+create_window(Session *session)
+{
+	Context *context = calloc(1, sizeof(Context));
+	initialize_context(context);
+	context->session = session;
+	atomic_init(&context->ref_count, 1);
+
+	client_t *c = calloc(1, sizeof(client_t));
+	c->context = context;
+	initialize_client_handler(c);
+	cef_client_t *client = (cef_client_t *)c;
+	client->base.add_ref((cef_base_t *)client);
+	context->client = client;
+
+	return context;
+}
+
+///
+// Fills in what every browser is created with, including a request context of
+// its own. The reference to the client is handed to the new browser.
+///
+static
+cef_request_context_t *
+prepare_browser(Context *context, cef_window_info_t *windowInfo,
+    cef_browser_settings_t *browserSettings)
+{
+#ifdef WINDOWLESS
+	windowInfo->windowless_rendering_enabled = 1;
+#endif
+
+	// Browser settings.
+	// It is mandatory to set the "size" member.
+	browserSettings->size = sizeof(cef_browser_settings_t);
+
+	cef_request_context_settings_t request_context_settings = {};
+	request_context_settings.size = sizeof(cef_request_context_settings_t);
+
+	context->client->base.add_ref((cef_base_t *)context->client);
+	return cef_request_context_create_context(&request_context_settings, NULL);
+}
+
+void
+create_browser(Context *context)
+{
+	cef_window_info_t windowInfo = {};
+	cef_browser_settings_t browserSettings = {};
+	cef_request_context_t *request_context =
+	    prepare_browser(context, &windowInfo, &browserSettings);
+
+	cef_string_t url = {};
+	cef_string_set(u"about:blank", 11, &url, 0);
+
+	// window_created() takes the browser over while it is being created.
+	cef_browser_t *browser = cef_browser_host_create_browser_sync(&windowInfo,
+	    context->client, &url, &browserSettings, request_context);
+
+	cef_browser_host_t *host = browser->get_host(browser);
+	host->send_focus_event(host, 1);
+	host->base.release((cef_base_t *)host);
+	browser->base.release((cef_base_t *)browser);
+}
+
+void
+start_browser(Context *context)
+{
+	cef_window_info_t windowInfo = {};
+	cef_browser_settings_t browserSettings = {};
+	cef_request_context_t *request_context =
+	    prepare_browser(context, &windowInfo, &browserSettings);
+
+	cef_string_t url = {};
+	cef_string_set(u"about:blank", 11, &url, 0);
+
+	cef_browser_host_create_browser(&windowInfo, context->client, &url,
+	    &browserSettings, request_context);
+}
+
+void
+window_created(Context *context, cef_browser_t *browser)
+{
+	// Reset puts a new browser in the place of the one it closed.
+	if (context->browser != NULL)
+		context->browser->base.release((cef_base_t *)context->browser);
+	browser->base.add_ref((cef_base_t *)browser);
+	context->browser = browser;
+	context->handle = browser->get_identifier(browser);
+	context->resetting = 0;
+	atomic_store(&context->renderer_crashed, 0);
+	// Pooled windows join a session when Reset hands them over.
+	if (context->session != NULL)
+		add_window(context->session, context);
+
+	if (context->open_command_id != 0) {
+		context->finish(context, context->open_command_id, NULL);
+		context->open_command_id = 0;
+	}
+}
+
+void
+window_closed(Context *context, cef_browser_t *browser)
+{
+	int replaced = context->resetting ||
+	    !browser->is_same(browser, context->browser);
+	browser->base.release((cef_base_t *)browser);
+	if (replaced)
 		return;
+
+	if (context->session != NULL)
+		remove_window(context->session, context);
+
+	client_t *client = (client_t *)context->client;
+	if (client->ring != NULL) {
+		shared_ring_close(client->ring);
+		client->ring = NULL;
 	}
+	release_window(context);
+}
+
+///
+// Returns the length of the scheme and authority that start |url|, such as
+// "http://127.0.0.1:4567", or 0 for URLs without an authority like
+// about:blank and data: URLs, whose pages have no storage of their own.
+///
+static
+size_t
+origin_length(const char *url)
+{
+	const char *authority = strstr(url, "://");
+	if (authority == NULL)
+		return 0;
+	authority += 3;
+	return authority + strcspn(authority, "/?#") - url;
+}
+
+void
+window_loading(Context *context, const cef_string_t *url)
+{
+	cef_string_utf8_t utf8 = {};
+	cef_string_to_utf8(url->str, url->length, &utf8);
+	size_t length = origin_length(utf8.str);
+
+	if (length == 0)
+		;
+	else if (context->storage_origin == NULL)
+		context->storage_origin = strndup(utf8.str, length);
+	else if (strlen(context->storage_origin) != length ||
+	    memcmp(context->storage_origin, utf8.str, length) != 0)
+		context->other_origins = 1;
+	cef_string_utf8_clear(&utf8);
+}
 
-	printf("ok\n");
+int
+storage_in_reach(Context *context)
+{
+	if (context->other_origins)
+		return 0;
+	if (context->storage_origin == NULL)
+		return 1;
 
-	if (t->message != NULL) {
-		printf("%zu\n", t->message->length);
-		printf("%s", t->message->str);
-		fprintf(stderr, "Wrote response true \"%s\"\n", t->message->str);
-		cef_string_userfree_utf8_free(t->message);
-	} else {
-		printf("0\n");
-		fprintf(stderr, "Wrote response true \"\"\n");
+	cef_frame_t *frame = context->browser->get_main_frame(context->browser);
+	cef_string_userfree_t url = frame->get_url(frame);
+	frame->base.release((cef_base_t *)frame);
+
+	cef_string_utf8_t utf8 = {};
+	if (url != NULL) {
+		cef_string_to_utf8(url->str, url->length, &utf8);
+		cef_string_userfree_free(url);
 	}
+	size_t length = utf8.str != NULL ? origin_length(utf8.str) : 0;
+	int same = strlen(context->storage_origin) == length &&
+	    memcmp(context->storage_origin, utf8.str, length) == 0;
+	cef_string_utf8_clear(&utf8);
+	return same;
+}
 
-	fflush(stdout);
+void
+forget_origins(Context *context)
+{
+	free(context->storage_origin);
+	context->storage_origin = NULL;
+	context->other_origins = 0;
 }
 
+typedef struct {
+	cef_task_t task;
+	Context *context;
+	unsigned int command_id;
+	int count;
+} ChunksReleasedTask;
+
 static
-void finish(Context *self, cef_string_userfree_utf8_t message)
+void
+CEF_CALLBACK
+send_chunks_released(cef_task_t *self)
+{
+	ChunksReleasedTask *task = (ChunksReleasedTask *)self;
+	Context *context = task->context;
+
+	if (context->browser != NULL) {
+		cef_string_t name = {};
+		cef_string_set(u"BodyChunksReleased", 18, &name, 0);
+		cef_process_message_t *message = cef_process_message_create(&name);
+		cef_list_value_t *args = message->get_argument_list(message);
+		args->set_int(args, 0, task->command_id);
+		args->set_int(args, 1, task->count);
+		context->browser->send_process_message(context->browser,
+		    PID_RENDERER, message);
+	}
+	release_window(context);
+}
+
+void
+release_body_chunks(Context *context, unsigned int command_id, int count)
 {
-	fprintf(stderr, "Command finished with response Success(%s)\n",
-	    message ? message->str : "");
-	Task *t = calloc(1, sizeof(Task));
-	t->context = self;
-	t->message = message;
-	((cef_task_t *)t)->base.size = sizeof(Task);
-	((cef_task_t *)t)->execute = execute;
-	cef_post_task(TID_UI, (cef_task_t *)t);
+	ChunksReleasedTask *task = calloc(1, sizeof(ChunksReleasedTask));
+	task->context = context;
+	task->command_id = command_id;
+	task->count = count;
+	((cef_task_t *)task)->base.size = sizeof(ChunksReleasedTask);
+	((cef_task_t *)task)->execute = send_chunks_released;
+	hold_window(context);
+	cef_post_task(TID_UI, (cef_task_t *)task);
 }
 
-static
-void finishFailure(Context *self, cef_string_userfree_utf8_t message)
+void
+hold_window(Context *context)
 {
-	printf("failure\n");
+	atomic_fetch_add(&context->ref_count, 1);
+}
 
-	printf("%zu\n", message->length);
-	printf("%s", message->str);
-	fprintf(stderr, "Wrote response false \"%s\"\n", message->str);
-	cef_string_userfree_utf8_free(message);
-	fflush(stdout);
+static
+void
+free_window(Context *context)
+{
+	if (context->browser != NULL)
+		context->browser->base.release((cef_base_t *)context->browser);
+	context->client->base.release((cef_base_t *)context->client);
+	free(context->storage_origin);
+	free(context);
 }
 
+typedef struct {
+	cef_task_t task;
+	Context *context;
+} FreeWindowTask;
+
 static
 void
-handle_load_event(Context *self)
+CEF_CALLBACK
+execute_free_window(cef_task_t *self)
 {
-	if (self->pending_response != NULL) {
-		fprintf(stderr, "Finishing pending response\n");
-		Response *response = self->pending_response;
-		self->pending_response = NULL;
-		self->finish(self, response->message);
-	}
+	free_window(((FreeWindowTask *)self)->context);
 }
 
-void initialize_context(Context *context)
+void
+release_window(Context *context)
 {
-    context->finish = finish;
-    context->finishFailure = finishFailure;
-    context->on_load_end = handle_load_event;
-    context->width = 1680;
-    context->height = 1050;
+	if (atomic_fetch_sub(&context->ref_count, 1) != 1)
+		return;
+
+	// The browser and client may only be let go of on the UI thread, where
+	// their handlers run.
+	if (cef_currently_on(TID_UI)) {
+		free_window(context);
+		return;
+	}
+
+	FreeWindowTask *task = calloc(1, sizeof(FreeWindowTask));
+	task->context = context;
+	((cef_task_t *)task)->base.size = sizeof(FreeWindowTask);
+	((cef_task_t *)task)->execute = execute_free_window;
+	cef_post_task(TID_UI, (cef_task_t *)task);
 }
@@ -1,28 +1,112 @@
 #pragma once
 
+#include <stdatomic.h>
+
 #include "include/capi/cef_browser_capi.h"
 #include "include/capi/cef_client_capi.h"
-#include "include/capi/cef_task_capi.h"
 
-typedef struct _Response {
-	cef_string_userfree_utf8_t message;
-} Response;
+#include "command.h"
+#include "session.h"
 
+///
+// One window of a session: its browser and everything the browser's
+// handlers need.
+///
 typedef struct _Context {
 	cef_browser_t *browser;
 	void (*on_load_end)(struct _Context *self);
-	void (*finish)(struct _Context *self, cef_string_userfree_utf8_t);
-	void (*finishFailure)(struct _Context *self, cef_string_userfree_utf8_t);
-	Response *pending_response;
+	void (*finish)(struct _Context *self, unsigned int command_id,
+	    cef_string_userfree_utf8_t);
+	void (*finishFailure)(struct _Context *self, unsigned int command_id,
+	    cef_string_userfree_utf8_t);
 	cef_client_t *client;
 	int width;
 	int height;
+	Session *session;
+	// The identifier of the window's browser, assigned once it exists.
+	int handle;
+	// The WindowOpen command that opened the window, answered once its
+	// browser has been created.
+	unsigned int open_command_id;
+	// Set while Reset replaces the window's browser.
+	int resetting;
+	// Set once the browser's render process has terminated, after which
+	// Reset replaces the browser rather than cleaning it up in place.
+	atomic_int renderer_crashed;
+	// The origin of the first page loaded since the window was last reset,
+	// and whether pages of other origins were loaded as well. UI thread
+	// only.
+	char *storage_origin;
+	int other_origins;
+	// One reference is held from creation until the browser has closed,
+	// and one by each command or task using the window from another
+	// thread, so that the window outlives them.
+	atomic_int ref_count;
 } Context;
 
-typedef struct {
-	cef_task_t task;
-	Context *context;
-	cef_string_userfree_utf8_t message;
-} Task;
-
 void initialize_context(Context *context);
+
+///
+// Allocates a window for |session|, along with the client that routes its
+// browser's callbacks to it. The window joins the session once its browser
+// has been created. Windows created for the browser pool have no session
+// until they are handed over.
+///
+Context *create_window(Session *session);
+
+///
+// Creates the window's browser, with a request context of its own so that
+// cookies and cache are not shared between windows. Runs on the UI thread.
+///
+void create_browser(Context *context);
+
+///
+// Starts creating the window's browser without waiting for it to exist.
+// Safe to call from any thread.
+///
+void start_browser(Context *context);
+
+///
+// Called on the UI thread once the window's browser has been created.
+///
+void window_created(Context *context, cef_browser_t *browser);
+
+///
+// Called on the UI thread once the window's browser has closed. Drops the
+// window's own reference unless the browser was replaced by Reset.
+///
+void window_closed(Context *context, cef_browser_t *browser);
+
+///
+// Called on the UI thread when a frame of the window starts loading |url|,
+// to keep track of the origins whose storage the window may have used.
+///
+void window_loading(Context *context, const cef_string_t *url);
+
+///
+// Returns 1 when the storage the window has used since it was last reset
+// belongs to the origin of its current page alone, so that the page can
+// clear it. Runs on the UI thread.
+///
+int storage_in_reach(Context *context);
+
+///
+// Forgets the origins the window has loaded pages of. Runs on the UI thread.
+///
+void forget_origins(Context *context);
+
+///
+// Tells the window's renderer that |count| chunks of the body it streams
+// for |command_id| have been written or dropped, so that it sends more.
+// Safe to call from any thread.
+///
+void release_body_chunks(Context *context, unsigned int command_id,
+    int count);
+
+///
+// Takes or drops a reference to a window. The last release frees the
+// window along with its references to the browser and client, on the UI
+// thread when it happens elsewhere. Safe to call from any thread.
+///
+void hold_window(Context *context);
+void release_window(Context *context);
@@ -0,0 +1,18 @@
+#include "framing.h"
+
+size_t
+encode_varint(uint64_t value, unsigned char *out)
+{
+	unsigned char reversed[FRAME_MAX_VARINT_LENGTH];
+	size_t length = 0;
+
+	do {
+		reversed[length++] = value & 0x7f;
+		value >>= 7;
+	} while (value != 0);
+
+	for (size_t i = 0; i < length; i++)
+		out[i] = reversed[length - 1 - i] | (i + 1 < length ? 0x80 : 0);
+
+	return length;
+}
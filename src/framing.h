@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+///
+// Binary framing for the driver protocol, negotiated with the Framing
+// command after the Ready handshake.
+//
+// Request:  opcode (1 byte), sequence (varint), argument count (varint),
+//           then for each argument its length (varint) followed by its
+//           bytes. Opcode FRAME_OPCODE_NAMED is followed by the command
+//           name's length (varint) and the name itself, ahead of the
+//           argument count; any other opcode is the 1-based index of a
+//           command in the list returned by Framing.
+// Response: status (1 byte), the request's sequence (varint), body length
+//           (varint), body. Responses arrive in request order, so several
+//           requests may be written before reading any response.
+//
+// Varints are big-endian base-128 with the high bit set on every byte but
+// the last, matching Ruby's pack("w").
+//
+// A response with status FRAME_STATUS_TYPED succeeded with a value other
+// than a string. Its body is that value: a FRAME_TYPE_* byte followed by
+//   integer:         the zigzag-encoded value (varint)
+//   double:          8 bytes, IEEE 754 big-endian
+//   string:          length (varint), UTF-8 bytes
+//   list:            count (varint), that many values
+//   map:             count (varint), that many string keys (length and
+//                    bytes, without a type) each followed by a value
+//   integer list:    count (varint), that many zigzag-encoded varints
+// and nothing for null, false and true.
+///
+
+#define FRAME_OPCODE_NAMED 0
+
+#define FRAME_STATUS_OK 0
+#define FRAME_STATUS_FAILURE 1
+#define FRAME_STATUS_TYPED 2
+
+#define FRAME_TYPE_NULL 0
+#define FRAME_TYPE_FALSE 1
+#define FRAME_TYPE_TRUE 2
+#define FRAME_TYPE_INTEGER 3
+#define FRAME_TYPE_DOUBLE 4
+#define FRAME_TYPE_STRING 5
+#define FRAME_TYPE_LIST 6
+#define FRAME_TYPE_MAP 7
+#define FRAME_TYPE_INTEGER_LIST 8
+
+#define FRAME_MAX_VARINT_LENGTH 10
+
+size_t encode_varint(uint64_t value, unsigned char *out);
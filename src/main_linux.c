@@ -2,6 +2,9 @@
 // License: BSD 3-clause.
 // Website: https://github.com/CzarekTomczak/cefcapi
 
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -12,134 +15,248 @@
 #include "cef_app.h"
 #include "cef_client.h"
 #include "cef_base.h"
-#include "string_visitor.h"
 #include "command.h"
+#include "command_reader.h"
+#include "command_registry.h"
+#include "arena.h"
+#include "server.h"
+#include "browser_pool.h"
+#include "shared_ring.h"
 
 typedef struct {
-	int argumentsExpected;
-	char *commandName;
-	char **arguments;
-} ReceivedCommand;
-
-void
-startCommand(ReceivedCommand *cmd, Context *context)
+	cef_task_t task;
+	Command *command;
+} CommandTask;
+
+///
+// Answers |command| with a NoSuchWindowError and returns 1 if it needs the
+// focused window and there is none.
+///
+static
+int
+fail_without_window(Command *command)
 {
-	fprintf(stderr, "Received %s(%s)\n", cmd->commandName,
-	    cmd->argumentsExpected != 0 ? cmd->arguments[0] : "");
-
-	Command command = {};
-	if (strcmp(cmd->commandName, "Visit") == 0) {
-		initialize_visit_command(&command, cmd->arguments);
-	} else if (strcmp(cmd->commandName, "Body") == 0) {
-		initialize_body_command(&command, cmd->arguments);
-	} else if (strcmp(cmd->commandName, "FindCss") == 0 ) {
-		initialize_find_css_command(&command, cmd->arguments);
-	} else if (strcmp(cmd->commandName, "Node") == 0 ) {
-		initialize_node_command(&command, cmd->arguments, cmd->argumentsExpected);
-	} else if (strcmp(cmd->commandName, "FindXpath") == 0 ) {
-		initialize_find_xpath_command(&command, cmd->arguments);
-	} else if (strcmp(cmd->commandName, "WindowResize") == 0 ) {
-		initialize_resize_window_command(&command, cmd->arguments);
-	} else if (strcmp(cmd->commandName, "Execute") == 0 ) {
-		initialize_execute_command(&command, cmd->arguments);
-	} else if (strcmp(cmd->commandName, "Reset") == 0 ) {
-		initialize_reset_command(&command, cmd->arguments);
-	} else {
-		printf("ok\n");
-		printf("0\n");
-		fflush(stdout);
-		return;
-	}
-	command.run(&command, context);
+	if (!command->definition->uses_window || command->context != NULL)
+		return 0;
+
+	const char *error = "{\"class\":\"NoSuchWindowError\","
+	    "\"message\":\"No window is focused\"}";
+	cef_string_userfree_utf8_t message = cef_string_userfree_utf8_alloc();
+	cef_string_utf8_set(error, strlen(error), message, 1);
+	post_response(command->session, command->id, 0, message);
+	return 1;
 }
 
+///
+// Runs a command posted to the UI thread against the window focused once
+// the commands before it have run.
+///
+static
 void
-processArgument(ReceivedCommand *cmd, const char *data, int *expectingDataSize, int *argument_index)
+CEF_CALLBACK
+run_posted_command(cef_task_t *self)
 {
-	if (cmd->argumentsExpected == -1) {
-		int i = atoi(data);
-		cmd->argumentsExpected = i;
-		cmd->arguments = calloc(i, sizeof(char *));
-	} else if (*expectingDataSize == -1) {
-		int i = atoi(data);
-		*expectingDataSize = i;
-	} else {
-		int len = strlen(data) + 1;
-		cmd->arguments[*argument_index] = calloc(len, sizeof(char));
-		strncpy(cmd->arguments[*argument_index], data, len);
-		*argument_index += 1;
-	}
+	Command *command = ((CommandTask *)self)->command;
+	Session *session = command->session;
+
+	command->context = current_window(session);
+	command->held_window = command->context;
+	if (!fail_without_window(command))
+		command->run(command, command->context);
+
+	atomic_fetch_sub(&session->ui_commands, 1);
 }
 
 void
-processNext(ReceivedCommand *cmd, const char *data, int *expectingDataSize, int *argument_index)
+startCommand(ReceivedCommand *cmd, Arena *arena, Session *session)
 {
-	if (cmd->commandName == NULL) {
-		int len = strlen(data) + 1;
-		cmd->commandName = calloc(len, sizeof(char));
-		strncpy(cmd->commandName, data, len);
-	} else {
-		processArgument(cmd, data, expectingDataSize, argument_index);
+	Argument *name = &cmd->name;
+	Argument *first = cmd->argument_count != 0 ? &cmd->arguments[0] : NULL;
+	fprintf(stderr, "Received %.*s(%.*s)\n", (int)name->length, name->data,
+	    first ? (int)(first->length < 256 ? first->length : 256) : 0,
+	    first ? first->data : "");
+
+	Command *command = arena_alloc(arena, sizeof(Command));
+	command->arena = arena;
+	command->definition = cmd->definition != NULL ? cmd->definition :
+	    find_command(name->data, name->length);
+	command->sequence = cmd->sequence;
+	command->binary_framing = session->binary_framing;
+	command->session = session;
+
+	// UI commands, and renderer commands queued behind them, find their
+	// window once they run on the UI thread.
+	CommandAffinity affinity = command->definition != NULL ?
+	    command->definition->affinity : COMMAND_AFFINITY_READER;
+	int posted = affinity == COMMAND_AFFINITY_UI ||
+	    (affinity == COMMAND_AFFINITY_RENDERER &&
+	    atomic_load(&session->ui_commands) > 0);
+	if (!posted) {
+		command->context = current_window(session);
+		command->held_window = command->context;
+	}
+	enqueue_command(session, command);
+
+	if (command->definition == NULL) {
+		fprintf(stderr, "Unknown command %.*s (%lu unknown so far)\n",
+		    (int)name->length, name->data, command_registry_misses());
+		post_response(session, command->id, 1, NULL);
+		return;
+	}
+
+	if (!posted && fail_without_window(command))
+		return;
+
+	if (cmd->argument_count < command->definition->arity) {
+		char buf[128];
+		int length = snprintf(buf, sizeof(buf),
+		    "{\"class\":\"InvalidResponseError\",\"message\":"
+		    "\"%s expects %d arguments but received %d\"}",
+		    command->definition->name, command->definition->arity,
+		    cmd->argument_count);
+		cef_string_userfree_utf8_t message = cef_string_userfree_utf8_alloc();
+		cef_string_utf8_set(buf, length, message, 1);
+		post_response(session, command->id, 0, message);
+		return;
 	}
+
+	command->definition->initialize(command, cmd->arguments,
+	    cmd->argument_count);
+
+	if (posted) {
+		CommandTask *task = calloc(1, sizeof(CommandTask));
+		task->command = command;
+		((cef_task_t *)task)->base.size = sizeof(CommandTask);
+		((cef_task_t *)task)->execute = run_posted_command;
+		atomic_fetch_add(&session->ui_commands, 1);
+		cef_post_task(TID_UI, (cef_task_t *)task);
+		return;
+	}
+
+	command->run(command, command->context);
 }
 
+static
 void
-checkNext(ReceivedCommand *cmd, int *expectingDataSize, int *argument_index)
+log_memory_usage(unsigned long commands)
 {
-	if (*expectingDataSize == -1) {
-		// readLine
-		char buffer[128];
-		fgets(buffer, sizeof(buffer), stdin);
-		if (feof(stdin))
-		    return;
-		buffer[strlen(buffer) - 1] = 0;
-
-		processNext(cmd, buffer, expectingDataSize, argument_index);
-	} else {
-		// readDataBlock
-		char otherBuffer[*expectingDataSize + 1];
-		int bytesRead;
-		bytesRead = fread(otherBuffer, 1, *expectingDataSize, stdin);
-		if (bytesRead != *expectingDataSize)
-			return;
-		otherBuffer[*expectingDataSize] = 0;
-
-		processNext(cmd, otherBuffer, expectingDataSize, argument_index);
-
-		*expectingDataSize = -1;
+	size_t live, reserved;
+	arena_statistics(&live, &reserved);
+
+	long resident = 0;
+	FILE *statm = fopen("/proc/self/statm", "r");
+	if (statm != NULL) {
+		if (fscanf(statm, "%*d %ld", &resident) != 1)
+			resident = 0;
+		fclose(statm);
 	}
 
-	if (*argument_index != cmd->argumentsExpected)
-		checkNext(cmd, expectingDataSize, argument_index);
+	fprintf(stderr, "Memory after %lu commands: %zu arena bytes live, "
+	    "%zu reserved, %ld kB resident\n", commands, live, reserved,
+	    resident * (sysconf(_SC_PAGESIZE) / 1024));
 }
 
 void *f(void *arg) {
-	Context *context = arg;
-	while (!feof(stdin)) {
-		ReceivedCommand *cmd;
-		cmd = calloc(1, sizeof(ReceivedCommand));
-		cmd->commandName = NULL;
-		cmd->argumentsExpected = -1;
-		int expectingDataSize = -1;
-		int argument_index = 0;
-
-		checkNext(cmd, &expectingDataSize, &argument_index);
-
-		if (argument_index == cmd->argumentsExpected)
-			startCommand(cmd, context);
+	Session *session = arg;
+	CommandReader reader;
+	initialize_command_reader(&reader, session->input);
+
+	unsigned long commands = 0;
+	int status;
+	for (;;) {
+		Arena *arena = arena_acquire();
+		ReceivedCommand *cmd = arena_alloc(arena, sizeof(ReceivedCommand));
+		if ((status = read_command(&reader, arena, cmd)) <= 0) {
+			arena_release(arena);
+			break;
+		}
+
+		startCommand(cmd, arena, session);
+		reader.binary = session->binary_framing;
+
+		if (++commands % 1000 == 0)
+			log_memory_usage(commands);
 	}
 
-	cef_browser_host_t *host = context->browser->get_host(context->browser);
-	host->close_browser(host, 1);
+	if (status < 0)
+		fprintf(stderr, "Malformed command, closing connection\n");
 
-	cef_task_t *t = calloc(1, sizeof(cef_task_t));
-	t->base.size = sizeof(cef_task_t);
-	t->execute = cef_quit_message_loop;
-	cef_post_task(TID_UI, t);
+	fprintf(stderr, "Received %lu commands, %lu unknown\n", commands,
+	    command_registry_misses());
+
+	free_command_reader(&reader);
+
+	// Socket sessions are freed by on_close once their last window has
+	// closed, while the end of stdin ends the process.
+	close_session(session);
+	if (session->on_close == NULL) {
+		close_browser_pool();
+
+		cef_task_t *t = calloc(1, sizeof(cef_task_t));
+		t->base.size = sizeof(cef_task_t);
+		t->execute = cef_quit_message_loop;
+		cef_post_task(TID_UI, t);
+	}
 
 	return NULL;
 }
 
+typedef struct {
+	cef_task_t task;
+	Session *session;
+} ConnectionTask;
+
+static
+void
+close_connection(Session *session)
+{
+	stop_writer(&session->writer);
+	close(session->output);
+	pthread_mutex_destroy(&session->commands_lock);
+	pthread_mutex_destroy(&session->windows_lock);
+	free(session->windows);
+	free(session);
+}
+
+///
+// Gives a new socket connection its first window, then starts reading its
+// commands. Runs on the UI thread, which drives the browsers of all
+// connections.
+///
+static
+void
+CEF_CALLBACK
+open_connection(cef_task_t *self)
+{
+	Session *session = ((ConnectionTask *)self)->session;
+
+	create_browser(create_window(session));
+
+	dprintf(session->output, "Ready binary\n");
+
+	pthread_t pth;
+	pthread_create(&pth, NULL, f, session);
+	pthread_detach(pth);
+}
+
+static
+void
+accept_connection(int fd)
+{
+	Session *session = calloc(1, sizeof(Session));
+	initialize_session(session);
+	session->input = fd;
+	session->output = fd;
+	session->on_close = close_connection;
+	start_writer(&session->writer, fd);
+
+	ConnectionTask *t = calloc(1, sizeof(ConnectionTask));
+	t->session = session;
+	((cef_task_t *)t)->base.size = sizeof(ConnectionTask);
+	((cef_task_t *)t)->execute = open_connection;
+	cef_post_task(TID_UI, (cef_task_t *)t);
+}
+
 int main(int argc, char** argv) {
     // Main args.
     cef_main_args_t mainArgs = {};
@@ -169,60 +286,61 @@ int main(int argc, char** argv) {
     settings.size = sizeof(cef_settings_t);
     settings.no_sandbox = 1;
 
+    const char *socket_path = NULL;
+    int browser_pool_size = 0;
+    for (int i = 1; i < argc; i++) {
+	if (strncmp(argv[i], "--socket=", 9) == 0)
+	    socket_path = argv[i] + 9;
+	else if (strncmp(argv[i], "--browser-pool=", 15) == 0)
+	    browser_pool_size = atoi(argv[i] + 15);
+	// Sends large results in process messages, as where /proc does
+	// not let this process open the renderers' rings.
+	else if (strcmp(argv[i], "--no-shared-ring") == 0)
+	    shared_ring_refuse();
+    }
+
+    initialize_command_registry();
+
     // Initialize CEF.
     app->base.add_ref((cef_base_t *)a);
     cef_initialize(&mainArgs, &settings, app, NULL);
     app->base.release((cef_base_t *)a);
 
-    cef_window_info_t windowInfo = {};
-#ifdef WINDOWLESS
-    windowInfo.windowless_rendering_enabled = 1;
-#endif
-    
-    // Browser settings.
-    // It is mandatory to set the "size" member.
-    cef_browser_settings_t browserSettings = {};
-    browserSettings.size = sizeof(cef_browser_settings_t);
-    
-    // Client handler and its callbacks.
-    // cef_client_t structure must be filled. It must implement
-    // reference counting. You cannot pass a structure 
-    // initialized with zeroes.
-    client_t c = {};
-    Context context = {};
-    initialize_context(&context);
-    c.context = &context;
-    initialize_client_handler(&c);
-
-    // Create browser.
-    cef_client_t *client = (cef_client_t *)&c;
-    client->base.add_ref((cef_base_t *)client);
-    context.client = client;
-
-    cef_request_context_settings_t request_context_settings = {};
-    request_context_settings.size = sizeof(cef_request_context_settings_t);
-
-    cef_request_context_t *request_context =
-	cef_request_context_create_context(&request_context_settings, NULL);
+    // Blank browsers kept ready for Reset, shared by all sessions. Only
+    // Reset("hard") takes from the pool, so there is none unless
+    // --browser-pool asks for one.
+    initialize_browser_pool(browser_pool_size);
+
+    // With --socket=PATH, every client connecting to the Unix domain
+    // socket at PATH gets a session of its own. Otherwise a single session
+    // is driven over stdin and stdout.
+    if (socket_path != NULL) {
+	signal(SIGPIPE, SIG_IGN);
+	if (start_socket_server(socket_path, accept_connection) < 0) {
+	    fprintf(stderr, "Failed to listen on %s: %s\n", socket_path,
+		strerror(errno));
+	    cef_shutdown();
+	    return 1;
+	}
 
-    cef_string_t url = {};
-    cef_string_set(u"about:blank", 11, &url, 0);
+	printf("Ready socket\n");
+	fflush(stdout);
 
-    client->base.add_ref((cef_base_t *)client);
-    cef_browser_t *browser = cef_browser_host_create_browser_sync(&windowInfo,
-	client, &url, &browserSettings, request_context);
-    browser->base.add_ref((cef_base_t *)browser);
-    context.browser = browser;
+	cef_run_message_loop();
+	cef_shutdown();
+	return 0;
+    }
 
-    cef_browser_host_t *host = browser->get_host(browser);
-    host->send_focus_event(host, 1);
-    host->base.release((cef_base_t *)host);
+    Session session = {};
+    initialize_session(&session);
+    start_writer(&session.writer, session.output);
+    create_browser(create_window(&session));
 
-    printf("Ready\n");
+    printf("Ready binary\n");
     fflush(stdout);
 
     pthread_t pth;
-    pthread_create(&pth, NULL, f, &context);
+    pthread_create(&pth, NULL, f, &session);
 
     // Message loop.
     cef_run_message_loop();
@@ -230,5 +348,7 @@ int main(int argc, char** argv) {
     // Shutdown CEF.
     cef_shutdown();
 
+    stop_writer(&session.writer);
+
     return 0;
 }
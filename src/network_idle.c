@@ -0,0 +1,85 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "network_idle.h"
+#include "cef_client.h"
+
+#define NETWORK_IDLE_POLL_MS 25
+
+typedef struct {
+	cef_task_t task;
+	Session *session;
+	// The window is looked up again on every check, as it may close.
+	int handle;
+	unsigned int command_id;
+	int idle_ms;
+	long long deadline;
+	int report;
+} NetworkIdleTask;
+
+long long
+monotonic_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static
+void
+CEF_CALLBACK
+check_network_idle(cef_task_t *self)
+{
+	NetworkIdleTask *task = (NetworkIdleTask *)self;
+	Context *window = find_window(task->session, task->handle);
+	long long now = monotonic_ns();
+
+	int idle = 0;
+	if (window != NULL) {
+		client_t *client = (client_t *)window->client;
+		long long quiet = now - atomic_load(&client->network_changed_at);
+		idle = !window->browser->is_loading(window->browser) &&
+		    atomic_load(&client->requests_in_flight) == 0 &&
+		    quiet >= task->idle_ms * 1000000LL;
+		release_window(window);
+	}
+
+	if (!idle && window != NULL && now < task->deadline) {
+		cef_post_delayed_task(TID_UI, self, NETWORK_IDLE_POLL_MS);
+		return;
+	}
+
+	if (!idle)
+		fprintf(stderr, "Network did not go idle for command %u\n",
+		    task->command_id);
+
+	cef_string_userfree_utf8_t message = NULL;
+	if (task->report) {
+		message = cef_string_userfree_utf8_alloc();
+		cef_string_utf8_set(idle ? "true" : "false", idle ? 4 : 5,
+		    message, 1);
+	}
+	post_response(task->session, task->command_id, 1, message);
+	release_session(task->session);
+}
+
+void
+wait_for_network_idle(Context *context, unsigned int command_id,
+    int idle_ms, int timeout_ms, int report)
+{
+	NetworkIdleTask *task = calloc(1, sizeof(NetworkIdleTask));
+	task->session = context->session;
+	task->handle = context->handle;
+	task->command_id = command_id;
+	task->idle_ms = idle_ms;
+	task->deadline = monotonic_ns() + timeout_ms * 1000000LL;
+	task->report = report;
+	((cef_task_t *)task)->base.size = sizeof(NetworkIdleTask);
+	((cef_task_t *)task)->execute = check_network_idle;
+
+	hold_session(context->session);
+	cef_post_task(TID_UI, (cef_task_t *)task);
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include "context.h"
+
+long long monotonic_ns(void);
+
+///
+// Answers command |command_id| once |context| has not been loading and its
+// browser has had no request in flight for |idle_ms|, or once |timeout_ms|
+// has passed. With |report| set the answer is "true" or "false" for whether
+// the network went idle; otherwise it is empty. Safe to call from any thread
+// while the window's session is open.
+///
+void wait_for_network_idle(Context *context, unsigned int command_id,
+    int idle_ms, int timeout_ms, int report);
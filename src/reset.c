@@ -1,52 +1,170 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "include/capi/cef_cookie_capi.h"
+#include "include/capi/cef_request_context_capi.h"
 
+#include "cef_base.h"
 #include "command.h"
 #include "context.h"
+#include "browser_pool.h"
+
+///
+// Holds back the response of a soft Reset until the window's cookies have
+// been deleted, which completes on the IO thread.
+///
+typedef struct _CookiesDeleted {
+	cef_delete_cookies_callback_t callback;
+	atomic_int ref_count;
+	Session *session;
+	Command *command;
+} CookiesDeleted;
+
+IMPLEMENT_REFCOUNTING(CookiesDeleted)
+GENERATE_CEF_BASE_INITIALIZER(CookiesDeleted)
+
+static
+void
+CEF_CALLBACK
+cookies_deleted(cef_delete_cookies_callback_t *self, int num_deleted)
+{
+	CookiesDeleted *callback = (CookiesDeleted *)self;
+	release_response(callback->session, callback->command);
+}
 
 typedef struct {
 	cef_task_t task;
 	Context *context;
+	unsigned int command_id;
+	struct timespec started;
 } ResetTask;
 
+static
+void
+log_reset_latency(struct timespec *started, const char *how)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double elapsed = (now.tv_sec - started->tv_sec) * 1e3 +
+	    (now.tv_nsec - started->tv_nsec) / 1e6;
+	fprintf(stderr, "Reset took %.3f ms (%s)\n", elapsed, how);
+}
+
 static void
 execute_reset(cef_task_t *self)
 {
     	ResetTask *task = (ResetTask *)self;
 
-	cef_window_info_t windowInfo = {};
-#ifdef WINDOWLESS
-	windowInfo.windowless_rendering_enabled = 1;
-#endif
+	create_browser(task->context);
+
+	task->context->finish(task->context, task->command_id, NULL);
+	log_reset_latency(&task->started, "new browser");
+}
+
+///
+// Cleans up the focused window's browser in place: cookies, storage and the
+// node registry are cleared and the page is replaced with about:blank,
+// without paying for a new browser and render process. The renderer answers
+// once its storage is cleared, and the response waits for the cookies to be
+// deleted and about:blank to finish loading.
+///
+static
+void
+soft_reset(Command *self, Context *context)
+{
+	cef_browser_host_t *host = context->browser->get_host(context->browser);
+
+	// Every window has a request context of its own, so its default cookie
+	// manager only holds the window's cookies.
+	cef_request_context_t *request_context = host->get_request_context(host);
+	cef_cookie_manager_t *cookies =
+	    request_context->get_default_cookie_manager(request_context, NULL);
+	CookiesDeleted *callback = calloc(1, sizeof(CookiesDeleted));
+	initialize_CookiesDeleted_base(callback);
+	callback->callback.on_complete = cookies_deleted;
+	callback->session = context->session;
+	callback->command = self;
+	atomic_init(&callback->ref_count, 1);
+	hold_response(self);
+	// The callback is only called when the deletion could be started.
+	callback->callback.base.add_ref((cef_base_t *)callback);
+	if (!cookies->delete_cookies(cookies, NULL, NULL,
+	    (cef_delete_cookies_callback_t *)callback)) {
+		fprintf(stderr, "Reset could not delete cookies\n");
+		release_response(context->session, self);
+	}
+	callback->callback.base.release((cef_base_t *)callback);
+	cookies->base.release((cef_base_t *)cookies);
+	request_context->base.release((cef_base_t *)request_context);
 
-	cef_browser_settings_t browserSettings = {};
-	browserSettings.size = sizeof(cef_browser_settings_t);
+	context->width = 1680;
+	context->height = 1050;
+	host->was_resized(host);
+	host->base.release((cef_base_t *)host);
+
+	// Storage belongs to the page's origin, so it is cleared before the
+	// page is navigated away from.
+	cef_string_t name = {};
+	cef_string_set(u"CapybaraInvocation", 18, &name, 0);
+	cef_process_message_t *message = cef_process_message_create(&name);
+	cef_list_value_t *args = message->get_argument_list(message);
+	args->set_int(args, 0, self->id);
+	cef_string_t value = {};
+	cef_string_set(u"softReset", 9, &value, 0);
+	args->set_string(args, 1, &value);
+	args->set_bool(args, 2, 1);
+	context->browser->send_process_message(context->browser, PID_RENDERER,
+	    message);
 
 	cef_string_t url = {};
 	cef_string_set(u"about:blank", 11, &url, 0);
+	cef_frame_t *frame = context->browser->get_main_frame(context->browser);
+	frame->load_url(frame, &url);
+	frame->base.release((cef_base_t *)frame);
+	forget_origins(context);
+}
 
-	cef_request_context_settings_t settings = {};
-	settings.size = sizeof(cef_request_context_settings_t);
+///
+// Replaces the focused window with a blank one. The blank window comes from
+// the browser pool when one is ready, and is otherwise created in place.
+// Reset runs on the UI thread, so the pooled window is handed over there,
+// between its load events.
+///
+static
+void
+hard_reset(Command *self, Context *context)
+{
+	Session *session = context->session;
+	struct timespec started;
+	clock_gettime(CLOCK_MONOTONIC, &started);
 
-	cef_request_context_t *context =
-	    cef_request_context_create_context(&settings, NULL);
+	// A pooled window takes the focused window's place straight away,
+	// and the old window is closed like any other.
+	Context *fresh = take_pooled_window();
+	if (fresh != NULL) {
+		initialize_context(fresh);
+		fresh->session = session;
+		replace_window(session, context, fresh);
 
-	task->context->client->base.add_ref((cef_base_t *)task->context->client);
-	cef_browser_t *browser = cef_browser_host_create_browser_sync(
-	    &windowInfo, task->context->client, &url, &browserSettings,
-	    context);
-	browser->base.add_ref((cef_base_t *) browser);
-	task->context->browser = browser;
+		cef_browser_host_t *host = fresh->browser->get_host(fresh->browser);
+		host->send_focus_event(host, 1);
+		host->base.release((cef_base_t *)host);
 
-	cef_browser_host_t *host = browser->get_host(browser);
-	host->send_focus_event(host, 1);
-	host->base.release((cef_base_t *)host);
+		host = context->browser->get_host(context->browser);
+		host->close_browser(host, 1);
+		host->base.release((cef_base_t *)host);
 
-	task->context->finish(task->context, NULL);
-}
+		fresh->finish(fresh, self->id, NULL);
+		log_reset_latency(&started, "pooled browser");
+		return;
+	}
 
-static void
-run_reset_command(Command *self, Context *context)
-{
+	context->resetting = 1;
+	forget_origins(context);
 	cef_browser_host_t *host = context->browser->get_host(context->browser);
 	host->close_browser(host, 1);
 	host->base.release((cef_base_t *)host);
@@ -56,15 +174,50 @@ run_reset_command(Command *self, Context *context)
 
 	ResetTask *task = calloc(1, sizeof(ResetTask));
 	task->context = context;
+	task->command_id = self->id;
+	task->started = started;
 	cef_task_t *t= (cef_task_t *)task;
 	t->base.size = sizeof(ResetTask);
 	t->execute = execute_reset;
 	cef_post_task(TID_UI, t);
 }
 
+///
+// Closes every window of the session but the focused one, which is cleaned
+// up in place. Reset("hard"), a focused window whose renderer has
+// terminated, or one whose storage the page cannot clear because pages of
+// several origins were loaded, replaces the browser instead.
+///
+static void
+run_reset_command(Command *self, Context *context)
+{
+	Session *session = context->session;
+	pthread_mutex_lock(&session->windows_lock);
+	for (int i = 0; i < session->window_count; i++) {
+		Context *window = session->windows[i];
+		if (window == context)
+			continue;
+		cef_browser_host_t *host = window->browser->get_host(window->browser);
+		host->close_browser(host, 1);
+		host->base.release((cef_base_t *)host);
+	}
+	pthread_mutex_unlock(&session->windows_lock);
+
+	int hard = self->argument_count > 0 &&
+	    self->arguments[0].length == 4 &&
+	    memcmp(self->arguments[0].data, "hard", 4) == 0;
+
+	if (hard || atomic_load(&context->renderer_crashed) ||
+	    !storage_in_reach(context))
+		hard_reset(self, context);
+	else
+		soft_reset(self, context);
+}
+
 void
-initialize_reset_command(Command *command, char *arguments[])
+initialize_reset_command(Command *command, Argument arguments[], int argument_count)
 {
+	command->argument_count = argument_count;
 	command->arguments = arguments;
 	command->run = run_reset_command;
 }
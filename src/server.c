@@ -0,0 +1,81 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "server.h"
+
+typedef struct {
+	int fd;
+	void (*accepted)(int fd);
+} Listener;
+
+static
+void *
+accept_connections(void *arg)
+{
+	Listener *listener = arg;
+
+	for (;;) {
+		int fd = accept(listener->fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			fprintf(stderr, "Failed to accept connection: %s\n",
+			    strerror(errno));
+			break;
+		}
+
+		fprintf(stderr, "Accepted connection %d\n", fd);
+		listener->accepted(fd);
+	}
+
+	close(listener->fd);
+	free(listener);
+	return NULL;
+}
+
+int
+start_socket_server(const char *path, void (*accepted)(int fd))
+{
+	struct sockaddr_un address = {};
+	address.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(address.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+	    listen(fd, SOMAXCONN) < 0) {
+		int error = errno;
+		close(fd);
+		errno = error;
+		return -1;
+	}
+
+	Listener *listener = malloc(sizeof(Listener));
+	listener->fd = fd;
+	listener->accepted = accepted;
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, accept_connections, listener) != 0) {
+		close(fd);
+		free(listener);
+		return -1;
+	}
+	pthread_detach(thread);
+
+	return 0;
+}
@@ -0,0 +1,9 @@
+#pragma once
+
+///
+// Listens on the Unix domain socket at |path|, replacing any stale socket
+// file, and calls |accepted| on a dedicated thread with the descriptor of
+// every connection. Returns 0 once the server is listening or -1 with errno
+// set.
+///
+int start_socket_server(const char *path, void (*accepted)(int fd));
@@ -0,0 +1,609 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "session.h"
+#include "context.h"
+#include "cef_base.h"
+#include "command_registry.h"
+
+IMPLEMENT_REFCOUNTING(Task)
+GENERATE_CEF_BASE_INITIALIZER(Task)
+
+void
+initialize_session(Session *session)
+{
+	session->input = STDIN_FILENO;
+	session->output = STDOUT_FILENO;
+	pthread_mutex_init(&session->commands_lock, NULL);
+	pthread_mutex_init(&session->windows_lock, NULL);
+}
+
+static
+int
+waits_for_load(Command *command)
+{
+	return command->definition != NULL && command->definition->waits_for_load &&
+	    !command->timed_out && command->context != NULL &&
+	    command->context->browser->is_loading(command->context->browser);
+}
+
+static
+Command *
+find_command_in_flight(Session *session, unsigned int id)
+{
+	Command *command = session->commands;
+	while (command != NULL && command->id != id)
+		command = command->next;
+	return command;
+}
+
+///
+// Calls on_close once the client has gone away, the last window has closed
+// and nothing holds the session.
+///
+static
+void
+end_session_if_done(Session *session)
+{
+	pthread_mutex_lock(&session->windows_lock);
+	int ended = session->closed && !session->ended &&
+	    session->window_count == 0 && atomic_load(&session->holds) == 0;
+	if (ended)
+		session->ended = 1;
+	pthread_mutex_unlock(&session->windows_lock);
+
+	if (ended && session->on_close != NULL)
+		session->on_close(session);
+}
+
+void
+hold_session(Session *session)
+{
+	atomic_fetch_add(&session->holds, 1);
+}
+
+void
+release_session(Session *session)
+{
+	atomic_fetch_sub(&session->holds, 1);
+	end_session_if_done(session);
+}
+
+///
+// Stops streaming the body of a command whose response is replaced before
+// the writer has seen it. Chunks arriving later are dropped, as the
+// command is no longer among the session's streams.
+///
+static
+void
+drop_stream(Session *session, Command *command)
+{
+	Command **link = &session->streams;
+	while (*link != NULL && *link != command)
+		link = &(*link)->next_stream;
+	if (*link != NULL)
+		*link = command->next_stream;
+
+	ResponseChunk *chunk = atomic_exchange(&command->chunks, NULL);
+	int released = 0;
+	while (chunk != NULL) {
+		ResponseChunk *next = chunk->next;
+		cef_string_userfree_utf8_free(chunk->data);
+		free(chunk);
+		released++;
+		chunk = next;
+	}
+	// The renderer sends the rest of the body to be dropped as well, so
+	// that it does not wait for these chunks to be written.
+	if (released > 0 && command->held_window != NULL)
+		release_body_chunks(command->held_window, command->id, released);
+
+	command->streamed = 0;
+	command->streamed_length = 0;
+}
+
+typedef struct {
+	cef_task_t task;
+	Session *session;
+	unsigned int command_id;
+} DeadlineTask;
+
+///
+// Fails a response still held back by its page load when its deadline
+// passes, and stops the load so that the commands behind it do not wait
+// for it as well.
+///
+static
+void
+CEF_CALLBACK
+expire_deadline(cef_task_t *self)
+{
+	DeadlineTask *task = (DeadlineTask *)self;
+	Session *session = task->session;
+
+	pthread_mutex_lock(&session->commands_lock);
+	Command *command = find_command_in_flight(session, task->command_id);
+	int expired = command != NULL && command->blocked;
+	cef_browser_t *browser = NULL;
+	if (expired) {
+		int timeout = atomic_load(&session->timeout);
+		char buf[128];
+		int length = snprintf(buf, sizeof(buf),
+		    "{\"class\":\"TimeoutError\",\"message\":"
+		    "\"Request timed out after %d second(s)\"}", timeout);
+		// The failure replaces a body that may have started streaming
+		// in, which would otherwise follow the failure's header.
+		if (command->streamed)
+			drop_stream(session, command);
+		if (command->response != NULL)
+			cef_string_userfree_utf8_free(command->response);
+		command->response = cef_string_userfree_utf8_alloc();
+		cef_string_utf8_set(buf, length, command->response, 1);
+		command->success = 0;
+		command->timed_out = 1;
+		if (command->context != NULL)
+			browser = command->context->browser;
+	}
+	pthread_mutex_unlock(&session->commands_lock);
+
+	if (expired) {
+		fprintf(stderr, "Response for command %u timed out\n",
+		    task->command_id);
+		if (browser != NULL)
+			browser->stop_load(browser);
+		flush_responses(session);
+	}
+
+	release_session(session);
+}
+
+///
+// Schedules the deadline of a command whose response has started waiting
+// for its page to load. Deadline tasks cannot be cancelled, so one that
+// fires for a command no longer waiting does nothing.
+///
+static
+void
+arm_deadline(Session *session, Command *command)
+{
+	int timeout = atomic_load(&session->timeout);
+	if (timeout <= 0)
+		return;
+
+	DeadlineTask *task = calloc(1, sizeof(DeadlineTask));
+	task->session = session;
+	task->command_id = command->id;
+	((cef_task_t *)task)->base.size = sizeof(DeadlineTask);
+	((cef_task_t *)task)->execute = expire_deadline;
+	hold_session(session);
+	cef_post_delayed_task(TID_UI, (cef_task_t *)task, timeout * 1000LL);
+}
+
+///
+// A response that waits for load holds back itself and everything behind it
+// until the page of its window has loaded.
+///
+void
+flush_responses(Session *session)
+{
+	for (;;) {
+		pthread_mutex_lock(&session->commands_lock);
+		Command *command = session->commands;
+		if (command == NULL || !command->finished ||
+		    atomic_load(&command->pending_work) > 0) {
+			pthread_mutex_unlock(&session->commands_lock);
+			return;
+		}
+
+		if (waits_for_load(command)) {
+			pthread_mutex_unlock(&session->commands_lock);
+			if (!command->blocked) {
+				fprintf(stderr, "Blocking response on page load\n");
+				arm_deadline(session, command);
+			}
+			command->blocked = 1;
+			return;
+		}
+
+		session->commands = command->next;
+		if (session->commands == NULL)
+			session->last_command = NULL;
+		pthread_mutex_unlock(&session->commands_lock);
+
+		hand_over_response(&session->writer, command);
+	}
+}
+
+typedef struct {
+	cef_task_t task;
+	Session *session;
+} FlushTask;
+
+static
+void
+CEF_CALLBACK
+execute_flush(cef_task_t *self)
+{
+	FlushTask *task = (FlushTask *)self;
+	flush_responses(task->session);
+	release_session(task->session);
+}
+
+void
+hold_response(Command *command)
+{
+	atomic_fetch_add(&command->pending_work, 1);
+}
+
+void
+release_response(Session *session, Command *command)
+{
+	if (atomic_fetch_sub(&command->pending_work, 1) != 1)
+		return;
+
+	FlushTask *task = calloc(1, sizeof(FlushTask));
+	task->session = session;
+	((cef_task_t *)task)->base.size = sizeof(FlushTask);
+	((cef_task_t *)task)->execute = execute_flush;
+	hold_session(session);
+	cef_post_task(TID_UI, (cef_task_t *)task);
+}
+
+static
+void
+CEF_CALLBACK
+execute(cef_task_t *self)
+{
+	Task *t = ((Task *)self);
+	Session *session = t->session;
+
+	pthread_mutex_lock(&session->commands_lock);
+	Command *command = find_command_in_flight(session, t->command_id);
+	int accepted = command != NULL && !command->finished;
+	if (accepted) {
+		command->response = t->message;
+		command->success = t->success;
+		command->typed = t->typed;
+		command->finished = 1;
+	}
+	pthread_mutex_unlock(&session->commands_lock);
+
+	if (!accepted) {
+		if (!t->fallback)
+			fprintf(stderr, "Dropping response for command %u\n", t->command_id);
+		if (t->message != NULL)
+			cef_string_userfree_utf8_free(t->message);
+	} else {
+		if (t->fallback)
+			fprintf(stderr, "Command %u was not answered, "
+			    "sending %s\n", t->command_id,
+			    t->success ? "an empty response" : "an error");
+		flush_responses(session);
+	}
+
+	if (t->fallback)
+		release_session(session);
+}
+
+void
+post_response(Session *session, unsigned int command_id, int success,
+    cef_string_userfree_utf8_t message)
+{
+	Task *t = calloc(1, sizeof(Task));
+	initialize_cef_base(t);
+	t->session = session;
+	t->command_id = command_id;
+	t->success = success;
+	t->message = message;
+	((cef_task_t *)t)->execute = execute;
+	cef_post_task(TID_UI, (cef_task_t *)t);
+}
+
+void
+post_typed_response(Session *session, unsigned int command_id,
+    cef_string_userfree_utf8_t message)
+{
+	Task *t = calloc(1, sizeof(Task));
+	initialize_cef_base(t);
+	t->session = session;
+	t->command_id = command_id;
+	t->success = 1;
+	t->typed = 1;
+	t->message = message;
+	((cef_task_t *)t)->execute = execute;
+	cef_post_task(TID_UI, (cef_task_t *)t);
+}
+
+void
+begin_streamed_response(Session *session, unsigned int command_id,
+    size_t length)
+{
+	pthread_mutex_lock(&session->commands_lock);
+	Command *command = find_command_in_flight(session, command_id);
+	int accepted = command != NULL && !command->finished;
+	if (accepted) {
+		command->streamed = 1;
+		command->streamed_length = length;
+		command->success = 1;
+		command->finished = 1;
+		command->next_stream = session->streams;
+		session->streams = command;
+	}
+	pthread_mutex_unlock(&session->commands_lock);
+
+	if (!accepted) {
+		fprintf(stderr, "Dropping streamed response for command %u\n",
+		    command_id);
+		return;
+	}
+
+	flush_responses(session);
+}
+
+///
+// Marks the body of a streamed response as complete. The writer thread
+// frees the command once it has seen this, so it is no longer tracked.
+///
+static
+void
+complete_stream(Session *session, Command *command)
+{
+	Command **link = &session->streams;
+	while (*link != command)
+		link = &(*link)->next_stream;
+	*link = command->next_stream;
+
+	atomic_store(&command->stream_complete, 1);
+	wake_writer(&session->writer);
+}
+
+int
+append_streamed_response(Session *session, unsigned int command_id,
+    cef_string_userfree_utf8_t chunk, int last)
+{
+	Command *command = session->streams;
+	while (command != NULL && command->id != command_id)
+		command = command->next_stream;
+
+	if (command == NULL) {
+		cef_string_userfree_utf8_free(chunk);
+		return 0;
+	}
+
+	ResponseChunk *piece = malloc(sizeof(ResponseChunk));
+	piece->data = chunk;
+	piece->next = atomic_load(&command->chunks);
+	while (!atomic_compare_exchange_weak(&command->chunks, &piece->next,
+	    piece))
+		;
+
+	if (last)
+		complete_stream(session, command);
+	else
+		wake_writer(&session->writer);
+	return 1;
+}
+
+static
+void
+post_fallback(Session *session, unsigned int command_id, long delay_ms,
+    int success, cef_string_userfree_utf8_t message)
+{
+	Task *t = calloc(1, sizeof(Task));
+	initialize_cef_base(t);
+	t->session = session;
+	t->command_id = command_id;
+	t->success = success;
+	t->message = message;
+	t->fallback = 1;
+	((cef_task_t *)t)->execute = execute;
+	hold_session(session);
+	cef_post_delayed_task(TID_UI, (cef_task_t *)t, delay_ms);
+}
+
+void
+post_fallback_response(Session *session, unsigned int command_id,
+    long delay_ms)
+{
+	post_fallback(session, command_id, delay_ms, 1, NULL);
+}
+
+void
+post_fallback_error(Session *session, unsigned int command_id,
+    long delay_ms, cef_string_userfree_utf8_t message)
+{
+	post_fallback(session, command_id, delay_ms, 0, message);
+}
+
+void
+enqueue_command(Session *session, Command *command)
+{
+	pthread_mutex_lock(&session->commands_lock);
+	command->id = ++session->next_command_id;
+	if (session->last_command != NULL)
+		session->last_command->next = command;
+	else
+		session->commands = command;
+	session->last_command = command;
+	pthread_mutex_unlock(&session->commands_lock);
+}
+
+void
+add_window(Session *session, Context *window)
+{
+	pthread_mutex_lock(&session->windows_lock);
+	for (int i = 0; i < session->window_count; i++) {
+		if (session->windows[i] == window) {
+			pthread_mutex_unlock(&session->windows_lock);
+			return;
+		}
+	}
+
+	if (session->window_count == session->window_capacity) {
+		session->window_capacity = session->window_capacity ?
+		    session->window_capacity * 2 : 4;
+		session->windows = realloc(session->windows,
+		    session->window_capacity * sizeof(Context *));
+	}
+	session->windows[session->window_count++] = window;
+	if (session->current_window == NULL)
+		session->current_window = window;
+	pthread_mutex_unlock(&session->windows_lock);
+}
+
+void
+remove_window(Session *session, Context *window)
+{
+	// Bodies still streaming in from the window's renderer never will, so
+	// they end here and the writer pads them to their announced length.
+	Command *command = session->streams;
+	while (command != NULL) {
+		Command *next = command->next_stream;
+		if (command->context == window)
+			complete_stream(session, command);
+		command = next;
+	}
+
+	pthread_mutex_lock(&session->commands_lock);
+	for (Command *command = session->commands; command != NULL;
+	    command = command->next) {
+		if (command->context == window)
+			command->context = NULL;
+	}
+	pthread_mutex_unlock(&session->commands_lock);
+
+	pthread_mutex_lock(&session->windows_lock);
+	for (int i = 0; i < session->window_count; i++) {
+		if (session->windows[i] == window) {
+			memmove(&session->windows[i], &session->windows[i + 1],
+			    (session->window_count - i - 1) * sizeof(Context *));
+			session->window_count--;
+			break;
+		}
+	}
+	if (session->current_window == window)
+		session->current_window = NULL;
+	pthread_mutex_unlock(&session->windows_lock);
+
+	// Responses held back by the window's page load can go out now.
+	flush_responses(session);
+
+	end_session_if_done(session);
+}
+
+void
+replace_window(Session *session, Context *window, Context *replacement)
+{
+	pthread_mutex_lock(&session->windows_lock);
+	for (int i = 0; i < session->window_count; i++) {
+		if (session->windows[i] == window)
+			session->windows[i] = replacement;
+	}
+	if (session->current_window == window)
+		session->current_window = replacement;
+	pthread_mutex_unlock(&session->windows_lock);
+}
+
+Context *
+current_window(Session *session)
+{
+	pthread_mutex_lock(&session->windows_lock);
+	Context *window = session->current_window;
+	if (window != NULL)
+		hold_window(window);
+	pthread_mutex_unlock(&session->windows_lock);
+	return window;
+}
+
+Context *
+find_window(Session *session, int handle)
+{
+	Context *window = NULL;
+	pthread_mutex_lock(&session->windows_lock);
+	for (int i = 0; i < session->window_count; i++) {
+		if (session->windows[i]->handle == handle) {
+			window = session->windows[i];
+			hold_window(window);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&session->windows_lock);
+	return window;
+}
+
+int
+focus_window(Session *session, Context *window)
+{
+	int found = 0;
+	pthread_mutex_lock(&session->windows_lock);
+	for (int i = 0; i < session->window_count && !found; i++)
+		found = session->windows[i] == window;
+	if (found)
+		session->current_window = window;
+	pthread_mutex_unlock(&session->windows_lock);
+	return found;
+}
+
+char *
+window_handles(Session *session, Arena *arena, size_t *length)
+{
+	pthread_mutex_lock(&session->windows_lock);
+	// Handles are ints: at most 11 characters, quotes and a comma each.
+	char *json = arena_alloc(arena, 2 + session->window_count * 14 + 1);
+	char *cursor = json;
+	*cursor++ = '[';
+	for (int i = 0; i < session->window_count; i++) {
+		cursor += sprintf(cursor, "%s\"%d\"", i > 0 ? "," : "",
+		    session->windows[i]->handle);
+	}
+	*cursor++ = ']';
+	pthread_mutex_unlock(&session->windows_lock);
+
+	*length = cursor - json;
+	return json;
+}
+
+typedef struct {
+	cef_task_t task;
+	Session *session;
+} CloseSessionTask;
+
+///
+// Runs on the UI thread, like on_before_close(), so that no window can be
+// freed while it is being closed here.
+///
+static
+void
+CEF_CALLBACK
+close_windows(cef_task_t *self)
+{
+	Session *session = ((CloseSessionTask *)self)->session;
+
+	pthread_mutex_lock(&session->windows_lock);
+	session->closed = 1;
+	int count = session->window_count;
+	Context *windows[count > 0 ? count : 1];
+	memcpy(windows, session->windows, count * sizeof(Context *));
+	pthread_mutex_unlock(&session->windows_lock);
+
+	if (count == 0)
+		end_session_if_done(session);
+
+	for (int i = 0; i < count; i++) {
+		cef_browser_host_t *host = windows[i]->browser->get_host(windows[i]->browser);
+		host->close_browser(host, 1);
+		host->base.release((cef_base_t *)host);
+	}
+}
+
+void
+close_session(Session *session)
+{
+	CloseSessionTask *t = calloc(1, sizeof(CloseSessionTask));
+	t->session = session;
+	((cef_task_t *)t)->base.size = sizeof(CloseSessionTask);
+	((cef_task_t *)t)->execute = close_windows;
+	cef_post_task(TID_UI, (cef_task_t *)t);
+}
@@ -0,0 +1,185 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "include/capi/cef_task_capi.h"
+
+#include "command.h"
+#include "writer.h"
+
+struct _Context;
+
+///
+// One client connection and the windows it has opened. The commands of all
+// windows share one queue, so responses are written in the order the
+// commands arrived no matter which window ran them.
+///
+typedef struct _Session {
+	// Where commands are read from and responses written to: stdin and
+	// stdout, or a client of the socket server.
+	int input;
+	int output;
+	// Writes responses to output once they are in order.
+	Writer writer;
+	int binary_framing;
+	// Commands in flight, oldest first.
+	pthread_mutex_t commands_lock;
+	Command *commands;
+	Command *last_command;
+	unsigned int next_command_id;
+	// Finished commands whose body is still streaming in. UI thread only.
+	Command *streams;
+	// Open windows in the order they were opened, and the window commands
+	// are sent to.
+	pthread_mutex_t windows_lock;
+	struct _Context **windows;
+	int window_count;
+	int window_capacity;
+	struct _Context *current_window;
+	// UI commands posted to the UI thread that have yet to run. Renderer
+	// commands read meanwhile are posted behind them.
+	atomic_int ui_commands;
+	// Seconds a response may wait for its page to load, set by SetTimeout.
+	// No deadline is enforced unless it is positive.
+	atomic_int timeout;
+	// Delayed tasks referring to the session that have yet to run, each
+	// taken with hold_session().
+	atomic_int holds;
+	// Set once the client has gone away. The session ends when its last
+	// window has closed and nothing holds it, calling on_close if set.
+	int closed;
+	int ended;
+	void (*on_close)(struct _Session *self);
+} Session;
+
+typedef struct _Task {
+	cef_task_t task;
+	atomic_int ref_count;
+	Session *session;
+	unsigned int command_id;
+	int success;
+	cef_string_userfree_utf8_t message;
+	// Set for responses posted by post_fallback_response().
+	int fallback;
+	// Set for responses posted by post_typed_response().
+	int typed;
+} Task;
+
+void initialize_session(Session *session);
+
+///
+// Assigns |command| an id and appends it to the commands in flight. Called
+// on the reader thread before the command runs.
+///
+void enqueue_command(Session *session, Command *command);
+
+///
+// Posts the response of a command to the UI thread, where it is queued
+// behind the responses of earlier commands.
+///
+void post_response(Session *session, unsigned int command_id, int success,
+    cef_string_userfree_utf8_t message);
+
+///
+// Posts a successful response whose body is a typed value, encoded by
+// encode_typed_value(), for a session using binary framing.
+///
+void post_typed_response(Session *session, unsigned int command_id,
+    cef_string_userfree_utf8_t message);
+
+///
+// Answers a command with a body of |length| bytes to be streamed in with
+// append_streamed_response(), so that the body does not have to be held in
+// memory as a whole. Runs on the UI thread.
+///
+void begin_streamed_response(Session *session, unsigned int command_id,
+    size_t length);
+
+///
+// Adds |chunk| to the streamed body of a command, taking ownership of it.
+// |last| completes the body. Returns 0 when the chunk was dropped because
+// the body is no longer streaming. Runs on the UI thread.
+///
+int append_streamed_response(Session *session, unsigned int command_id,
+    cef_string_userfree_utf8_t chunk, int last);
+
+///
+// Answers a command with an empty success response unless it has been
+// answered within |delay_ms|. For commands whose answer would be lost if
+// their page went away first. Safe to call from any thread.
+///
+void post_fallback_response(Session *session, unsigned int command_id,
+    long delay_ms);
+
+///
+// Like post_fallback_response(), but fails the command with the JSON error
+// |message| instead, or frees |message| when the command was answered.
+///
+void post_fallback_error(Session *session, unsigned int command_id,
+    long delay_ms, cef_string_userfree_utf8_t message);
+
+///
+// Holds back the response of |command| until the work it started elsewhere
+// has completed and called release_response(), which is safe to call from
+// any thread. The command is not freed while its response is held.
+///
+void hold_response(Command *command);
+void release_response(Session *session, Command *command);
+
+///
+// Hands the responses of finished commands at the head of the queue to the
+// session's writer. A response waiting for its page to load is failed with
+// a TimeoutError once the session's timeout has passed. Runs on the UI
+// thread.
+///
+void flush_responses(Session *session);
+
+void add_window(Session *session, struct _Context *window);
+
+///
+// Forgets a closed window. Commands still in flight for it no longer wait
+// for its page to load. Ends the session if the client has gone away and
+// this was its last window.
+///
+void remove_window(Session *session, struct _Context *window);
+
+///
+// Puts |replacement| in the place of |window| in the window table, focusing
+// it if |window| was focused.
+///
+void replace_window(Session *session, struct _Context *window,
+    struct _Context *replacement);
+
+///
+// Return the focused window, or the window with |handle|, with a reference
+// taken with hold_window() for the caller to release. Safe to call from
+// any thread.
+///
+struct _Context *current_window(Session *session);
+struct _Context *find_window(Session *session, int handle);
+
+///
+// Focuses |window| unless it has closed meanwhile, which returns 0.
+///
+int focus_window(Session *session, struct _Context *window);
+
+///
+// Returns the handles of the session's windows as a JSON array of strings,
+// allocated from |arena|.
+///
+char *window_handles(Session *session, Arena *arena, size_t *length);
+
+///
+// Keeps the session from ending until release_session() is called, for
+// delayed tasks that refer to it. Safe to call from any thread while the
+// session is open; release_session() runs on the UI thread.
+///
+void hold_session(Session *session);
+void release_session(Session *session);
+
+///
+// Marks the session as ended by the client and closes all of its windows.
+// Safe to call from any thread.
+///
+void close_session(Session *session);
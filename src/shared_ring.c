@@ -0,0 +1,362 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "shared_ring.h"
+
+// Room for results, not counting the header. Pages are only backed by
+// memory once written to.
+#define SHARED_RING_CAPACITY (64 * 1024 * 1024)
+#define SHARED_RING_HEADER 4096
+#define SHARED_RING_NAME "capybara-results"
+
+// How many parents up from a renderer this process may be. Renderers are
+// started by the zygote, itself started by this process.
+#define MAX_RENDERER_DEPTH 4
+
+typedef struct {
+	uint64_t capacity;
+	_Atomic uint64_t tail;
+} RingHeader;
+
+// The ring of this render process, created on first use.
+static int ring_fd = -1;
+static char *ring_base;
+static uint64_t ring_head;
+
+struct _SharedRing {
+	int pid;
+	int fd;
+	char *base;
+	int ref_count;
+	struct _SharedRing *next;
+};
+
+// The rings the browser process has mapped, one per render process.
+static SharedRing *rings;
+// Set in the browser process to refuse every ring, and in a render process
+// once the browser process could not open its ring.
+static int refused;
+
+static
+void
+free_utf8(char *str)
+{
+	free(str);
+}
+
+static
+int
+create_ring(void)
+{
+	int fd = memfd_create(SHARED_RING_NAME, MFD_CLOEXEC);
+	if (fd < 0) {
+		perror("memfd_create");
+		return 0;
+	}
+
+	size_t size = SHARED_RING_HEADER + SHARED_RING_CAPACITY;
+	if (ftruncate(fd, size) != 0) {
+		perror("ftruncate");
+		close(fd);
+		return 0;
+	}
+
+	char *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		perror("mmap");
+		close(fd);
+		return 0;
+	}
+
+	RingHeader *header = (RingHeader *)base;
+	header->capacity = SHARED_RING_CAPACITY;
+	atomic_init(&header->tail, 0);
+
+	ring_fd = fd;
+	ring_base = base;
+	return 1;
+}
+
+int
+shared_ring_write(const char *data, size_t length, int *fd,
+    uint64_t *position)
+{
+	if (length > SHARED_RING_CAPACITY || refused)
+		return 0;
+	if (ring_fd < 0 && !create_ring())
+		return 0;
+
+	RingHeader *header = (RingHeader *)ring_base;
+	uint64_t tail = atomic_load_explicit(&header->tail, memory_order_acquire);
+	if (ring_head - tail + length > SHARED_RING_CAPACITY)
+		return 0;
+
+	char *ring = ring_base + SHARED_RING_HEADER;
+	size_t start = ring_head % SHARED_RING_CAPACITY;
+	size_t first = SHARED_RING_CAPACITY - start;
+	if (first > length)
+		first = length;
+	memcpy(ring + start, data, first);
+	memcpy(ring, data + first, length - first);
+
+	*fd = ring_fd;
+	*position = ring_head;
+	ring_head += length;
+	return 1;
+}
+
+///
+// Gives the memory of the pages lying wholly within the |length| bytes at
+// |position| of |ring| back to the system, so that a large result does not
+// stay resident once read. The pages at either end may hold the results
+// around it and are kept.
+///
+static
+void
+release_pages(char *ring, uint64_t position, size_t length)
+{
+	uint64_t page = sysconf(_SC_PAGESIZE);
+	uint64_t start = (position + page - 1) / page * page;
+	uint64_t end = (position + length) / page * page;
+	while (start < end) {
+		size_t offset = start % SHARED_RING_CAPACITY;
+		size_t size = SHARED_RING_CAPACITY - offset;
+		if (size > end - start)
+			size = end - start;
+		madvise(ring + offset, size, MADV_REMOVE);
+		start += size;
+	}
+}
+
+///
+// Copies the |length| bytes at |position| of the ring at |base| into
+// |output|, then frees their pages and their room.
+///
+static
+int
+take_result(char *base, uint64_t position, size_t length,
+    cef_string_utf8_t *output)
+{
+	if (length > SHARED_RING_CAPACITY)
+		return 0;
+
+	RingHeader *header = (RingHeader *)base;
+	cef_string_utf8_clear(output);
+	char *str = malloc(length + 1);
+	if (str == NULL)
+		return 0;
+	char *ring = base + SHARED_RING_HEADER;
+	size_t start = position % SHARED_RING_CAPACITY;
+	size_t first = SHARED_RING_CAPACITY - start;
+	if (first > length)
+		first = length;
+	memcpy(str, ring + start, first);
+	memcpy(str + first, ring, length - first);
+	str[length] = 0;
+
+	// The pages are released before the room is, as the renderer may
+	// write to them again as soon as it is.
+	release_pages(ring, position, length);
+
+	// Results are read in the order they were written, but one whose
+	// message was dropped is freed by the next one.
+	uint64_t end = position + length;
+	uint64_t tail = atomic_load_explicit(&header->tail, memory_order_relaxed);
+	while (tail < end && !atomic_compare_exchange_weak_explicit(
+	    &header->tail, &tail, end, memory_order_release,
+	    memory_order_relaxed))
+		;
+
+	output->str = str;
+	output->length = length;
+	output->dtor = free_utf8;
+	return 1;
+}
+
+int
+shared_ring_take(uint64_t position, size_t length, cef_string_utf8_t *output)
+{
+	refused = 1;
+	if (ring_fd < 0)
+		return 0;
+	return take_result(ring_base, position, length, output);
+}
+
+void
+shared_ring_refuse(void)
+{
+	refused = 1;
+}
+
+///
+// Returns the parent of process |pid|, or 0 when it cannot be read.
+///
+static
+int
+parent_pid(int pid)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	FILE *file = fopen(path, "re");
+	if (file == NULL)
+		return 0;
+	char stat[512];
+	size_t length = fread(stat, 1, sizeof(stat) - 1, file);
+	fclose(file);
+	stat[length] = 0;
+
+	// The command name in parentheses may itself hold spaces and
+	// parentheses, so the fields are read after the last one.
+	int parent = 0;
+	char *name_end = strrchr(stat, ')');
+	if (name_end == NULL || sscanf(name_end + 1, " %*c %d", &parent) != 1)
+		return 0;
+	return parent;
+}
+
+///
+// Returns whether |pid| is a render process started by this process.
+///
+static
+int
+is_own_renderer(int pid)
+{
+	if (pid <= 1 || pid == getpid())
+		return 0;
+
+	int ancestor = pid;
+	int depth = 0;
+	do {
+		ancestor = parent_pid(ancestor);
+		if (ancestor <= 1 || ++depth > MAX_RENDERER_DEPTH)
+			return 0;
+	} while (ancestor != getpid());
+
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/cmdline", pid);
+	FILE *file = fopen(path, "re");
+	if (file == NULL)
+		return 0;
+	char cmdline[4096];
+	size_t length = fread(cmdline, 1, sizeof(cmdline), file);
+	fclose(file);
+
+	// Arguments are separated by NULs.
+	const char *type = "--type=renderer";
+	size_t type_length = strlen(type) + 1;
+	for (size_t i = 0; i < length; i += strnlen(cmdline + i, length - i) + 1)
+		if (length - i >= type_length &&
+		    memcmp(cmdline + i, type, type_length) == 0)
+			return 1;
+	return 0;
+}
+
+///
+// Returns whether the descriptor |fd| of this process is a ring.
+///
+static
+int
+is_ring(int fd)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	char target[64];
+	ssize_t length = readlink(path, target, sizeof(target) - 1);
+	if (length < 0)
+		return 0;
+	target[length] = 0;
+
+	const char *name = "/memfd:" SHARED_RING_NAME " ";
+	struct stat info;
+	return strncmp(target, name, strlen(name)) == 0 &&
+	    fstat(fd, &info) == 0 &&
+	    info.st_size == SHARED_RING_HEADER + SHARED_RING_CAPACITY;
+}
+
+SharedRing *
+shared_ring_open(int pid, int fd)
+{
+	for (SharedRing *ring = rings; ring != NULL; ring = ring->next) {
+		if (shared_ring_is(ring, pid, fd)) {
+			ring->ref_count++;
+			return ring;
+		}
+	}
+
+	if (refused || fd < 0 || !is_own_renderer(pid)) {
+		fprintf(stderr, "Refusing the ring of process %d\n", pid);
+		return NULL;
+	}
+
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/fd/%d", pid, fd);
+	int opened = open(path, O_RDWR | O_CLOEXEC);
+	if (opened < 0) {
+		perror(path);
+		return NULL;
+	}
+	if (!is_ring(opened)) {
+		fprintf(stderr, "Refusing %s, which is not a ring\n", path);
+		close(opened);
+		return NULL;
+	}
+
+	size_t size = SHARED_RING_HEADER + SHARED_RING_CAPACITY;
+	char *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+	    opened, 0);
+	close(opened);
+	if (base == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+	if (((RingHeader *)base)->capacity != SHARED_RING_CAPACITY) {
+		munmap(base, size);
+		return NULL;
+	}
+
+	SharedRing *ring = calloc(1, sizeof(SharedRing));
+	ring->pid = pid;
+	ring->fd = fd;
+	ring->base = base;
+	ring->ref_count = 1;
+	ring->next = rings;
+	rings = ring;
+	return ring;
+}
+
+void
+shared_ring_close(SharedRing *ring)
+{
+	if (--ring->ref_count > 0)
+		return;
+
+	for (SharedRing **link = &rings; *link != NULL; link = &(*link)->next) {
+		if (*link == ring) {
+			*link = ring->next;
+			break;
+		}
+	}
+	munmap(ring->base, SHARED_RING_HEADER + SHARED_RING_CAPACITY);
+	free(ring);
+}
+
+int
+shared_ring_is(SharedRing *ring, int pid, int fd)
+{
+	return ring->pid == pid && ring->fd == fd;
+}
+
+int
+shared_ring_read(SharedRing *ring, uint64_t position, size_t length,
+    cef_string_utf8_t *output)
+{
+	return take_result(ring->base, position, length, output);
+}
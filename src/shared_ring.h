@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "include/internal/cef_string_types.h"
+
+// Invocation results of at least this many UTF-16 units are handed over
+// through the shared ring instead of inside the process message.
+#define SHARED_RING_THRESHOLD (256 * 1024)
+
+///
+// A ring of memory in a memfd, created by each render process the first
+// time it has a large result, through which the result is handed to the
+// browser process without going through Chromium's IPC. Process messages
+// cannot carry file descriptors, so the message names the render process
+// and the descriptor instead and the browser process opens it through
+// /proc. That only works because renderers run without the sandbox, as
+// the same user as the browser process. Where /proc refuses the open, the
+// browser process asks for the result again and the renderer sends it,
+// and every later one, in the message.
+//
+// The renderer writes a result at the end of the ring and sends where it
+// starts; the browser copies it out and advances the shared tail to free
+// its room. Positions only grow and wrap around the capacity.
+///
+
+///
+// The browser process's mapping of the ring of one render process.
+///
+typedef struct _SharedRing SharedRing;
+
+///
+// Copies |length| bytes of |data| into the ring of this process. Returns 1
+// and sets |fd| and |position|, or returns 0 when there is no room, in which
+// case the result should be sent in the message as usual.
+///
+int shared_ring_write(const char *data, size_t length, int *fd,
+    uint64_t *position);
+
+///
+// Returns a reference to the mapping of the ring |fd| of process |pid|,
+// mapping it on first use. Returns NULL unless |pid| is a render process
+// started by this process and |fd| is its ring, as both come from the
+// renderer. Called on the UI thread.
+///
+SharedRing *shared_ring_open(int pid, int fd);
+
+///
+// Drops a reference taken by shared_ring_open(), unmapping the ring with
+// the last one. Called on the UI thread.
+///
+void shared_ring_close(SharedRing *ring);
+
+///
+// Returns whether |ring| is the ring |fd| of process |pid|.
+///
+int shared_ring_is(SharedRing *ring, int pid, int fd);
+
+///
+// Copies the |length| bytes at |position| of |ring| into |output| and
+// frees their pages and their room. Returns 0 when they do not fit in the
+// ring. Called on the UI thread.
+///
+int shared_ring_read(SharedRing *ring, uint64_t position, size_t length,
+    cef_string_utf8_t *output);
+
+///
+// Makes the browser process refuse every ring, for --no-shared-ring.
+///
+void shared_ring_refuse(void);
+
+///
+// Called in a render process when the browser process could not open its
+// ring. Copies the |length| bytes at |position| of the ring of this process
+// into |output| and frees them, to be sent in a message instead, and stops
+// using the ring for later results.
+///
+int shared_ring_take(uint64_t position, size_t length,
+    cef_string_utf8_t *output);
@@ -1,11 +0,0 @@
-#pragma once
-
-#include <stdatomic.h>
-
-#include "context.h"
-
-typedef struct _string_visitor {
-	cef_string_visitor_t visitor;
-	atomic_int ref_count;
-	Context *context;
-} string_visitor;
@@ -0,0 +1,343 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "transcode.h"
+
+// Shrink results that waste more than this many bytes of the worst-case
+// allocation.
+#define TRANSCODE_SLACK 4096
+
+typedef size_t (*WidenKernel)(const unsigned char *src, size_t len,
+    char16 *dst);
+typedef size_t (*NarrowKernel)(const char16 *src, size_t len,
+    unsigned char *dst);
+
+///
+// Copies the ASCII characters at the start of |src| and returns how many
+// there were.
+///
+static
+size_t
+widen_ascii_scalar(const unsigned char *src, size_t len, char16 *dst)
+{
+	size_t i = 0;
+	while (i < len && src[i] < 0x80) {
+		dst[i] = src[i];
+		i++;
+	}
+	return i;
+}
+
+static
+size_t
+narrow_ascii_scalar(const char16 *src, size_t len, unsigned char *dst)
+{
+	size_t i = 0;
+	while (i < len && src[i] < 0x80) {
+		dst[i] = src[i];
+		i++;
+	}
+	return i;
+}
+
+#if defined(__x86_64__)
+///
+// The SSE2 kernels finish the AVX2 ones and are inlined into them, so that
+// they are VEX-encoded there. Calling legacy SSE code from AVX2 code stalls
+// on every call, which made text with short runs of ASCII, like Latin-1,
+// convert more than ten times slower.
+///
+static
+inline
+__attribute__((always_inline))
+size_t
+widen_ascii_sse2(const unsigned char *src, size_t len, char16 *dst)
+{
+	size_t i = 0;
+	const __m128i zero = _mm_setzero_si128();
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i bytes = _mm_loadu_si128((const __m128i *)(src + i));
+		if (_mm_movemask_epi8(bytes) != 0)
+			break;
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_unpacklo_epi8(bytes, zero));
+		_mm_storeu_si128((__m128i *)(dst + i + 8), _mm_unpackhi_epi8(bytes, zero));
+	}
+
+	return i + widen_ascii_scalar(src + i, len - i, dst + i);
+}
+
+static
+inline
+__attribute__((always_inline))
+size_t
+narrow_ascii_sse2(const char16 *src, size_t len, unsigned char *dst)
+{
+	size_t i = 0;
+	const __m128i high = _mm_set1_epi16((short)0xff80);
+	const __m128i zero = _mm_setzero_si128();
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + i + 8));
+		__m128i any = _mm_and_si128(_mm_or_si128(a, b), high);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi16(any, zero)) != 0xffff)
+			break;
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(a, b));
+	}
+
+	return i + narrow_ascii_scalar(src + i, len - i, dst + i);
+}
+
+__attribute__((target("avx2")))
+static
+size_t
+widen_ascii_avx2(const unsigned char *src, size_t len, char16 *dst)
+{
+	size_t i = 0;
+
+	for (; i + 32 <= len; i += 32) {
+		__m256i bytes = _mm256_loadu_si256((const __m256i *)(src + i));
+		if (_mm256_movemask_epi8(bytes) != 0)
+			break;
+		_mm256_storeu_si256((__m256i *)(dst + i),
+		    _mm256_cvtepu8_epi16(_mm256_castsi256_si128(bytes)));
+		_mm256_storeu_si256((__m256i *)(dst + i + 16),
+		    _mm256_cvtepu8_epi16(_mm256_extracti128_si256(bytes, 1)));
+	}
+
+	return i + widen_ascii_sse2(src + i, len - i, dst + i);
+}
+
+__attribute__((target("avx2")))
+static
+size_t
+narrow_ascii_avx2(const char16 *src, size_t len, unsigned char *dst)
+{
+	size_t i = 0;
+	const __m256i high = _mm256_set1_epi16((short)0xff80);
+
+	for (; i + 32 <= len; i += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(src + i + 16));
+		if (!_mm256_testz_si256(_mm256_or_si256(a, b), high))
+			break;
+		// The pack works within 128-bit lanes, so put the quarters back in
+		// order afterwards.
+		__m256i packed = _mm256_packus_epi16(a, b);
+		_mm256_storeu_si256((__m256i *)(dst + i),
+		    _mm256_permute4x64_epi64(packed, 0xd8));
+	}
+
+	return i + narrow_ascii_sse2(src + i, len - i, dst + i);
+}
+#endif
+
+static
+WidenKernel
+widen_kernel(void)
+{
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("avx2"))
+		return widen_ascii_avx2;
+	return widen_ascii_sse2;
+#else
+	return widen_ascii_scalar;
+#endif
+}
+
+static
+NarrowKernel
+narrow_kernel(void)
+{
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("avx2"))
+		return narrow_ascii_avx2;
+	return narrow_ascii_sse2;
+#else
+	return narrow_ascii_scalar;
+#endif
+}
+
+static
+void
+free_utf16(char16 *str)
+{
+	free(str);
+}
+
+static
+void
+free_utf8(char *str)
+{
+	free(str);
+}
+
+///
+// Decodes the sequence starting with the non-ASCII byte at |*i| and advances
+// past it. A malformed sequence decodes to U+FFFD and consumes its longest
+// valid prefix, or the lead byte alone.
+///
+static
+unsigned int
+decode_utf8(const unsigned char *src, size_t len, size_t *i, int *valid)
+{
+	unsigned char lead = src[*i];
+	unsigned char low = 0x80, high = 0xbf;
+	unsigned int code_point;
+	int needed;
+
+	if (lead >= 0xc2 && lead <= 0xdf) {
+		needed = 1;
+		code_point = lead & 0x1f;
+	} else if (lead >= 0xe0 && lead <= 0xef) {
+		needed = 2;
+		code_point = lead & 0x0f;
+		if (lead == 0xe0)
+			low = 0xa0;
+		else if (lead == 0xed)
+			high = 0x9f;
+	} else if (lead >= 0xf0 && lead <= 0xf4) {
+		needed = 3;
+		code_point = lead & 0x07;
+		if (lead == 0xf0)
+			low = 0x90;
+		else if (lead == 0xf4)
+			high = 0x8f;
+	} else {
+		*i += 1;
+		*valid = 0;
+		return 0xfffd;
+	}
+
+	size_t next = *i + 1;
+	for (int k = 0; k < needed; k++, next++) {
+		if (next >= len || src[next] < low || src[next] > high) {
+			*i = next;
+			*valid = 0;
+			return 0xfffd;
+		}
+		code_point = (code_point << 6) | (src[next] & 0x3f);
+		low = 0x80;
+		high = 0xbf;
+	}
+
+	*i = next;
+	return code_point;
+}
+
+int
+transcode_utf8_to_utf16(const char *src, size_t src_len,
+    cef_string_utf16_t *output)
+{
+	const unsigned char *bytes = (const unsigned char *)src;
+	WidenKernel widen = widen_kernel();
+	int valid = 1;
+
+	cef_string_utf16_clear(output);
+
+	// Every byte yields at most one UTF-16 unit.
+	if (src_len >= SIZE_MAX / sizeof(char16))
+		return 0;
+	char16 *dst = malloc((src_len + 1) * sizeof(char16));
+	if (dst == NULL)
+		return 0;
+	size_t i = 0, length = 0;
+
+	while (i < src_len) {
+		size_t ascii = widen(bytes + i, src_len - i, dst + length);
+		i += ascii;
+		length += ascii;
+
+		while (i < src_len && bytes[i] >= 0x80) {
+			unsigned int code_point = decode_utf8(bytes, src_len, &i, &valid);
+			if (code_point >= 0x10000) {
+				code_point -= 0x10000;
+				dst[length++] = 0xd800 | (code_point >> 10);
+				dst[length++] = 0xdc00 | (code_point & 0x3ff);
+			} else {
+				dst[length++] = code_point;
+			}
+		}
+	}
+
+	dst[length] = 0;
+	// A failed shrink leaves the larger buffer in place, which is kept.
+	if ((src_len - length) * sizeof(char16) > TRANSCODE_SLACK) {
+		char16 *shrunk = realloc(dst, (length + 1) * sizeof(char16));
+		if (shrunk != NULL)
+			dst = shrunk;
+	}
+
+	output->str = dst;
+	output->length = length;
+	output->dtor = free_utf16;
+	return valid;
+}
+
+int
+transcode_utf16_to_utf8(const char16 *src, size_t src_len,
+    cef_string_utf8_t *output)
+{
+	NarrowKernel narrow = narrow_kernel();
+	int valid = 1;
+
+	cef_string_utf8_clear(output);
+
+	// Every unit yields at most three bytes, a surrogate pair four.
+	if (src_len >= SIZE_MAX / 3)
+		return 0;
+	unsigned char *dst = malloc(src_len * 3 + 1);
+	if (dst == NULL)
+		return 0;
+	size_t i = 0, length = 0;
+
+	while (i < src_len) {
+		size_t ascii = narrow(src + i, src_len - i, dst + length);
+		i += ascii;
+		length += ascii;
+
+		while (i < src_len && src[i] >= 0x80) {
+			unsigned int code_point = src[i++];
+			if (code_point >= 0xd800 && code_point <= 0xdfff) {
+				if (code_point <= 0xdbff && i < src_len &&
+				    src[i] >= 0xdc00 && src[i] <= 0xdfff) {
+					code_point = 0x10000 + ((code_point - 0xd800) << 10) +
+					    (src[i++] - 0xdc00);
+				} else {
+					code_point = 0xfffd;
+					valid = 0;
+				}
+			}
+
+			if (code_point < 0x800) {
+				dst[length++] = 0xc0 | (code_point >> 6);
+			} else if (code_point < 0x10000) {
+				dst[length++] = 0xe0 | (code_point >> 12);
+				dst[length++] = 0x80 | ((code_point >> 6) & 0x3f);
+			} else {
+				dst[length++] = 0xf0 | (code_point >> 18);
+				dst[length++] = 0x80 | ((code_point >> 12) & 0x3f);
+				dst[length++] = 0x80 | ((code_point >> 6) & 0x3f);
+			}
+			dst[length++] = 0x80 | (code_point & 0x3f);
+		}
+	}
+
+	dst[length] = 0;
+	if (src_len * 3 - length > TRANSCODE_SLACK) {
+		unsigned char *shrunk = realloc(dst, length + 1);
+		if (shrunk != NULL)
+			dst = shrunk;
+	}
+
+	output->str = (char *)dst;
+	output->length = length;
+	output->dtor = free_utf8;
+	return valid;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "include/internal/cef_string_types.h"
+
+///
+// Drop-in replacements for cef_string_utf8_to_utf16 and
+// cef_string_utf16_to_utf8. Runs of ASCII are converted 16 or 32 characters
+// at a time with SSE2 or AVX2, picked at run time, and everything else one
+// character at a time. Invalid sequences become U+FFFD and make the
+// functions return 0. The result is NUL-terminated and owned by |output|,
+// which is cleared first like the CEF routines do. When the result cannot be
+// allocated, |output| is left empty and 0 is returned.
+///
+int transcode_utf8_to_utf16(const char *src, size_t src_len,
+    cef_string_utf16_t *output);
+int transcode_utf16_to_utf8(const char16 *src, size_t src_len,
+    cef_string_utf8_t *output);
@@ -0,0 +1,570 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "framing.h"
+#include "transcode.h"
+#include "typed_value.h"
+
+// Limits of encode_v8_json(). Deeper values are almost always circular in
+// a way is_same() cannot see, such as through getters making new objects.
+#define V8_JSON_MAX_DEPTH 128
+#define V8_JSON_MAX_LENGTH (64 * 1024 * 1024)
+
+typedef struct {
+	char *data;
+	size_t length;
+	size_t capacity;
+} Buffer;
+
+static
+void
+append(Buffer *buffer, const void *data, size_t length)
+{
+	if (buffer->length + length > buffer->capacity) {
+		size_t capacity = buffer->capacity ? buffer->capacity : 64;
+		while (capacity < buffer->length + length)
+			capacity *= 2;
+		buffer->data = realloc(buffer->data, capacity);
+		buffer->capacity = capacity;
+	}
+
+	memcpy(buffer->data + buffer->length, data, length);
+	buffer->length += length;
+}
+
+static
+void
+append_byte(Buffer *buffer, unsigned char byte)
+{
+	append(buffer, &byte, 1);
+}
+
+static
+void
+append_varint(Buffer *buffer, uint64_t value)
+{
+	unsigned char bytes[FRAME_MAX_VARINT_LENGTH];
+	append(buffer, bytes, encode_varint(value, bytes));
+}
+
+static
+void
+append_zigzag(Buffer *buffer, int value)
+{
+	int64_t wide = value;
+	append_varint(buffer, ((uint64_t)wide << 1) ^ (uint64_t)(wide >> 63));
+}
+
+static
+void
+append_utf8(Buffer *buffer, const cef_string_t *value, int with_length)
+{
+	cef_string_utf8_t utf8 = {};
+	if (value != NULL)
+		transcode_utf16_to_utf8(value->str, value->length, &utf8);
+	if (with_length)
+		append_varint(buffer, utf8.length);
+	if (utf8.length > 0)
+		append(buffer, utf8.str, utf8.length);
+	cef_string_utf8_clear(&utf8);
+}
+
+static
+void
+append_string_value(Buffer *buffer, cef_value_t *value, int with_length)
+{
+	cef_string_userfree_t string = value->get_string(value);
+	append_utf8(buffer, string, with_length);
+	if (string != NULL)
+		cef_string_userfree_free(string);
+}
+
+///
+// Formats |value| with the fewest digits that read back as the same
+// double, like JavaScript does.
+///
+static
+void
+append_double(Buffer *buffer, double value)
+{
+	char digits[32];
+	int length = snprintf(digits, sizeof(digits), "%.15g", value);
+	if (strtod(digits, NULL) != value)
+		length = snprintf(digits, sizeof(digits), "%.17g", value);
+	append(buffer, digits, length);
+}
+
+static
+void
+append_integer(Buffer *buffer, int value)
+{
+	char digits[16];
+	append(buffer, digits, snprintf(digits, sizeof(digits), "%d", value));
+}
+
+static
+void
+append_typed(Buffer *buffer, cef_value_t *value)
+{
+	switch (value->get_type(value)) {
+	case VTYPE_BOOL:
+		append_byte(buffer, value->get_bool(value) ?
+		    FRAME_TYPE_TRUE : FRAME_TYPE_FALSE);
+		break;
+	case VTYPE_INT:
+		append_byte(buffer, FRAME_TYPE_INTEGER);
+		append_zigzag(buffer, value->get_int(value));
+		break;
+	case VTYPE_DOUBLE: {
+		double number = value->get_double(value);
+		uint64_t bits;
+		memcpy(&bits, &number, sizeof(bits));
+		append_byte(buffer, FRAME_TYPE_DOUBLE);
+		for (int shift = 56; shift >= 0; shift -= 8)
+			append_byte(buffer, bits >> shift);
+		break;
+	}
+	case VTYPE_STRING:
+		append_byte(buffer, FRAME_TYPE_STRING);
+		append_string_value(buffer, value, 1);
+		break;
+	case VTYPE_LIST: {
+		cef_list_value_t *list = value->get_list(value);
+		int size = list->get_size(list);
+
+		// Lists of node indexes are the common case and are sent
+		// without a type byte per item.
+		int integers = 1;
+		for (int i = 0; i < size && integers; i++)
+			integers = list->get_type(list, i) == VTYPE_INT;
+
+		append_byte(buffer, integers && size > 0 ?
+		    FRAME_TYPE_INTEGER_LIST : FRAME_TYPE_LIST);
+		append_varint(buffer, size);
+		for (int i = 0; i < size; i++) {
+			if (integers) {
+				append_zigzag(buffer, list->get_int(list, i));
+			} else {
+				cef_value_t *item = list->get_value(list, i);
+				append_typed(buffer, item);
+				item->base.release((cef_base_t *)item);
+			}
+		}
+
+		list->base.release((cef_base_t *)list);
+		break;
+	}
+	case VTYPE_DICTIONARY: {
+		cef_dictionary_value_t *dictionary = value->get_dictionary(value);
+		cef_string_list_t keys = cef_string_list_alloc();
+		dictionary->get_keys(dictionary, keys);
+		int size = cef_string_list_size(keys);
+
+		append_byte(buffer, FRAME_TYPE_MAP);
+		append_varint(buffer, size);
+		for (int i = 0; i < size; i++) {
+			cef_string_t key = {};
+			cef_string_list_value(keys, i, &key);
+			append_utf8(buffer, &key, 1);
+			cef_value_t *item = dictionary->get_value(dictionary, &key);
+			append_typed(buffer, item);
+			item->base.release((cef_base_t *)item);
+			cef_string_clear(&key);
+		}
+
+		cef_string_list_free(keys);
+		dictionary->base.release((cef_base_t *)dictionary);
+		break;
+	}
+	default:
+		append_byte(buffer, FRAME_TYPE_NULL);
+		break;
+	}
+}
+
+static
+void
+append_json_utf8(Buffer *buffer, const char *value, size_t length)
+{
+	append_byte(buffer, '"');
+	for (size_t i = 0; i < length; i++) {
+		unsigned char c = value[i];
+		if (c == '"' || c == '\\') {
+			append_byte(buffer, '\\');
+			append_byte(buffer, c);
+		} else if (c < 0x20) {
+			char escape[8];
+			append(buffer, escape,
+			    snprintf(escape, sizeof(escape), "\\u%04x", c));
+		} else {
+			append_byte(buffer, c);
+		}
+	}
+	append_byte(buffer, '"');
+}
+
+static
+void
+append_json_string(Buffer *buffer, const cef_string_t *value)
+{
+	Buffer text = {};
+	append_utf8(&text, value, 0);
+	append_json_utf8(buffer, text.data, text.length);
+	free(text.data);
+}
+
+static
+void
+append_json(Buffer *buffer, cef_value_t *value)
+{
+	switch (value->get_type(value)) {
+	case VTYPE_BOOL:
+		if (value->get_bool(value))
+			append(buffer, "true", 4);
+		else
+			append(buffer, "false", 5);
+		break;
+	case VTYPE_INT:
+		append_integer(buffer, value->get_int(value));
+		break;
+	case VTYPE_DOUBLE:
+		if (isfinite(value->get_double(value)))
+			append_double(buffer, value->get_double(value));
+		else
+			append(buffer, "null", 4);
+		break;
+	case VTYPE_STRING: {
+		cef_string_userfree_t string = value->get_string(value);
+		append_json_string(buffer, string);
+		if (string != NULL)
+			cef_string_userfree_free(string);
+		break;
+	}
+	case VTYPE_LIST: {
+		cef_list_value_t *list = value->get_list(value);
+		int size = list->get_size(list);
+		append_byte(buffer, '[');
+		for (int i = 0; i < size; i++) {
+			if (i > 0)
+				append_byte(buffer, ',');
+			cef_value_t *item = list->get_value(list, i);
+			append_json(buffer, item);
+			item->base.release((cef_base_t *)item);
+		}
+		append_byte(buffer, ']');
+		list->base.release((cef_base_t *)list);
+		break;
+	}
+	case VTYPE_DICTIONARY: {
+		cef_dictionary_value_t *dictionary = value->get_dictionary(value);
+		cef_string_list_t keys = cef_string_list_alloc();
+		dictionary->get_keys(dictionary, keys);
+		int size = cef_string_list_size(keys);
+		append_byte(buffer, '{');
+		for (int i = 0; i < size; i++) {
+			if (i > 0)
+				append_byte(buffer, ',');
+			cef_string_t key = {};
+			cef_string_list_value(keys, i, &key);
+			append_json_string(buffer, &key);
+			append_byte(buffer, ':');
+			cef_value_t *item = dictionary->get_value(dictionary, &key);
+			append_json(buffer, item);
+			item->base.release((cef_base_t *)item);
+			cef_string_clear(&key);
+		}
+		append_byte(buffer, '}');
+		cef_string_list_free(keys);
+		dictionary->base.release((cef_base_t *)dictionary);
+		break;
+	}
+	default:
+		append(buffer, "null", 4);
+		break;
+	}
+}
+
+static
+void
+append_text(Buffer *buffer, cef_value_t *value)
+{
+	switch (value->get_type(value)) {
+	case VTYPE_BOOL:
+	case VTYPE_DICTIONARY:
+		append_json(buffer, value);
+		break;
+	case VTYPE_INT:
+		append_integer(buffer, value->get_int(value));
+		break;
+	case VTYPE_DOUBLE:
+		append_double(buffer, value->get_double(value));
+		break;
+	case VTYPE_STRING:
+		append_string_value(buffer, value, 0);
+		break;
+	case VTYPE_LIST: {
+		cef_list_value_t *list = value->get_list(value);
+		int size = list->get_size(list);
+		for (int i = 0; i < size; i++) {
+			if (i > 0)
+				append_byte(buffer, ',');
+			cef_value_t *item = list->get_value(list, i);
+			append_text(buffer, item);
+			item->base.release((cef_base_t *)item);
+		}
+		list->base.release((cef_base_t *)list);
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+static
+void
+free_buffer(char *data)
+{
+	free(data);
+}
+
+static
+cef_string_userfree_utf8_t
+take_buffer(Buffer *buffer)
+{
+	// Always NUL-terminated, like other strings.
+	append_byte(buffer, 0);
+
+	cef_string_userfree_utf8_t result = cef_string_userfree_utf8_alloc();
+	result->str = buffer->data;
+	result->length = buffer->length - 1;
+	result->dtor = free_buffer;
+	return result;
+}
+
+cef_string_userfree_utf8_t
+encode_typed_value(cef_list_value_t *list, int index)
+{
+	Buffer buffer = {};
+	cef_value_t *value = list->get_value(list, index);
+	append_typed(&buffer, value);
+	value->base.release((cef_base_t *)value);
+	return take_buffer(&buffer);
+}
+
+cef_string_userfree_utf8_t
+format_value(cef_list_value_t *list, int index)
+{
+	Buffer buffer = {};
+	cef_value_t *value = list->get_value(list, index);
+	append_text(&buffer, value);
+	value->base.release((cef_base_t *)value);
+	return take_buffer(&buffer);
+}
+
+cef_string_userfree_utf8_t
+encode_error(const char *error_class, const char *message, size_t length)
+{
+	Buffer buffer = {};
+	append(&buffer, "{\"class\":", 9);
+	append_json_utf8(&buffer, error_class, strlen(error_class));
+	append(&buffer, ",\"message\":", 11);
+	append_json_utf8(&buffer, message, length);
+	append_byte(&buffer, '}');
+	return take_buffer(&buffer);
+}
+
+typedef struct {
+	Buffer buffer;
+	NodeIdFunction node_id;
+	void *data;
+	// The arrays and objects being serialized, outermost first.
+	cef_v8value_t *ancestors[V8_JSON_MAX_DEPTH];
+	int depth;
+	const char *error;
+} V8Serializer;
+
+static
+void
+append_v8_string(Buffer *buffer, cef_v8value_t *value)
+{
+	cef_string_userfree_t string = value->get_string_value(value);
+	append_json_string(buffer, string);
+	if (string != NULL)
+		cef_string_userfree_free(string);
+}
+
+static
+void
+append_v8_date(Buffer *buffer, cef_v8value_t *value)
+{
+	cef_time_t time = value->get_date_value(value);
+	char date[32];
+	append(buffer, date, snprintf(date, sizeof(date),
+	    "\"%04d-%02d-%02dT%02d:%02d:%02d.%03dZ\"", time.year, time.month,
+	    time.day_of_month, time.hour, time.minute, time.second,
+	    time.millisecond));
+}
+
+///
+// Returns 1 when |value| is already being serialized further out.
+///
+static
+int
+is_ancestor(V8Serializer *serializer, cef_v8value_t *value)
+{
+	for (int i = 0; i < serializer->depth; i++) {
+		value->base.add_ref((cef_base_t *)value);
+		if (serializer->ancestors[i]->is_same(serializer->ancestors[i], value))
+			return 1;
+	}
+	return 0;
+}
+
+static
+int
+append_node(V8Serializer *serializer, cef_v8value_t *value)
+{
+	cef_string_t key = {};
+	cef_string_set(u"nodeType", 8, &key, 0);
+	if (!value->has_value_bykey(value, &key))
+		return 0;
+
+	int id = serializer->node_id(value, serializer->data);
+	if (id < 0)
+		return 0;
+
+	append(&serializer->buffer, "{\"capybara-node\":", 17);
+	append_integer(&serializer->buffer, id);
+	append_byte(&serializer->buffer, '}');
+	return 1;
+}
+
+static void append_v8(V8Serializer *serializer, cef_v8value_t *value);
+
+static
+void
+append_v8_array(V8Serializer *serializer, cef_v8value_t *value)
+{
+	int length = value->get_array_length(value);
+	append_byte(&serializer->buffer, '[');
+	for (int i = 0; i < length && serializer->error == NULL; i++) {
+		if (i > 0)
+			append_byte(&serializer->buffer, ',');
+		cef_v8value_t *item = value->get_value_byindex(value, i);
+		if (item != NULL) {
+			append_v8(serializer, item);
+			item->base.release((cef_base_t *)item);
+		} else {
+			append(&serializer->buffer, "null", 4);
+		}
+	}
+	append_byte(&serializer->buffer, ']');
+}
+
+static
+void
+append_v8_object(V8Serializer *serializer, cef_v8value_t *value)
+{
+	cef_string_list_t keys = cef_string_list_alloc();
+	value->get_keys(value, keys);
+	int size = cef_string_list_size(keys);
+	int first = 1;
+
+	append_byte(&serializer->buffer, '{');
+	for (int i = 0; i < size && serializer->error == NULL; i++) {
+		cef_string_t key = {};
+		cef_string_list_value(keys, i, &key);
+		cef_v8value_t *item = value->get_value_bykey(value, &key);
+		if (item == NULL) {
+			// A getter threw.
+			if (value->has_exception(value))
+				value->clear_exception(value);
+		} else if (!item->is_undefined(item) && !item->is_function(item)) {
+			if (!first)
+				append_byte(&serializer->buffer, ',');
+			first = 0;
+			append_json_string(&serializer->buffer, &key);
+			append_byte(&serializer->buffer, ':');
+			append_v8(serializer, item);
+		}
+		if (item != NULL)
+			item->base.release((cef_base_t *)item);
+		cef_string_clear(&key);
+	}
+	append_byte(&serializer->buffer, '}');
+
+	cef_string_list_free(keys);
+}
+
+static
+void
+append_v8(V8Serializer *serializer, cef_v8value_t *value)
+{
+	Buffer *buffer = &serializer->buffer;
+
+	if (value->is_string(value)) {
+		append_v8_string(buffer, value);
+	} else if (value->is_bool(value)) {
+		if (value->get_bool_value(value))
+			append(buffer, "true", 4);
+		else
+			append(buffer, "false", 5);
+	} else if (value->is_int(value)) {
+		append_integer(buffer, value->get_int_value(value));
+	} else if (value->is_uint(value) || value->is_double(value)) {
+		double number = value->get_double_value(value);
+		if (isfinite(number))
+			append_double(buffer, number);
+		else
+			append(buffer, "null", 4);
+	} else if (value->is_date(value)) {
+		append_v8_date(buffer, value);
+	} else if (value->is_array(value) || (value->is_object(value) &&
+	    !value->is_function(value))) {
+		if (is_ancestor(serializer, value)) {
+			serializer->error = "Converting circular structure to JSON";
+			return;
+		}
+		if (serializer->depth == V8_JSON_MAX_DEPTH) {
+			serializer->error = "Result is nested too deeply";
+			return;
+		}
+		if (!value->is_array(value) && append_node(serializer, value))
+			return;
+
+		serializer->ancestors[serializer->depth++] = value;
+		if (value->is_array(value))
+			append_v8_array(serializer, value);
+		else
+			append_v8_object(serializer, value);
+		serializer->depth--;
+	} else {
+		append(buffer, "null", 4);
+	}
+
+	if (serializer->error == NULL && buffer->length > V8_JSON_MAX_LENGTH)
+		serializer->error = "Result is too large";
+}
+
+cef_string_userfree_utf8_t
+encode_v8_json(cef_v8value_t *value, NodeIdFunction node_id, void *data,
+    const char **error)
+{
+	V8Serializer *serializer = calloc(1, sizeof(V8Serializer));
+	serializer->node_id = node_id;
+	serializer->data = data;
+
+	append_v8(serializer, value);
+
+	cef_string_userfree_utf8_t result = NULL;
+	*error = serializer->error;
+	if (*error == NULL)
+		result = take_buffer(&serializer->buffer);
+	else
+		free(serializer->buffer.data);
+	free(serializer);
+	return result;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "include/capi/cef_v8_capi.h"
+#include "include/capi/cef_values_capi.h"
+
+///
+// Encodes the value at |index| of |list| as the body of a typed response,
+// laid out as described in framing.h.
+///
+cef_string_userfree_utf8_t encode_typed_value(cef_list_value_t *list,
+    int index);
+
+///
+// Formats the value at |index| of |list| for a response without types:
+// numbers in decimal, null as nothing, lists as their items joined by
+// commas like JavaScript's Array.prototype.join() and maps as JSON.
+///
+cef_string_userfree_utf8_t format_value(cef_list_value_t *list, int index);
+
+///
+// Formats an error response, {"class": ..., "message": ...}, escaping the
+// |length| bytes of UTF-8 in |message| as a JSON string.
+///
+cef_string_userfree_utf8_t encode_error(const char *error_class,
+    const char *message, size_t length);
+
+///
+// Returns the id a DOM node is registered under, or -1 when |value| is not
+// a node.
+///
+typedef int (*NodeIdFunction)(cef_v8value_t *value, void *data);
+
+///
+// Serializes |value| as JSON by walking it natively instead of through
+// JSON.stringify(). Dates become ISO 8601 strings in UTC and the DOM nodes
+// |node_id| knows become {"capybara-node": id}. Like JSON.stringify(),
+// functions and undefined are left out of objects and become null in
+// arrays. Returns NULL and sets |error| for circular structures, values
+// nested too deeply and results too large to send.
+///
+cef_string_userfree_utf8_t encode_v8_json(cef_v8value_t *value,
+    NodeIdFunction node_id, void *data, const char **error);
@@ -0,0 +1,282 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include "writer.h"
+#include "context.h"
+#include "framing.h"
+
+#define RESPONSE_HEADER_SIZE 32
+
+///
+// Writes all of |iov|, picking up after partial writes.
+///
+static
+int
+write_all(int fd, struct iovec *iov, int count)
+{
+	while (count > 0) {
+		ssize_t written = writev(fd, iov, count);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		while (count > 0 && (size_t)written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0) {
+			iov->iov_base = (char *)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+
+	return 0;
+}
+
+static
+size_t
+response_header(Command *command, size_t length, unsigned char *header)
+{
+	if (command->binary_framing) {
+		size_t header_length = 1;
+		header[0] = !command->success ? FRAME_STATUS_FAILURE :
+		    command->typed ? FRAME_STATUS_TYPED : FRAME_STATUS_OK;
+		header_length += encode_varint(command->sequence, header + header_length);
+		header_length += encode_varint(length, header + header_length);
+		return header_length;
+	}
+
+	return snprintf((char *)header, RESPONSE_HEADER_SIZE, "%s\n%zu\n",
+	    command->success ? "ok" : "failure", length);
+}
+
+static
+void
+write_iov(Writer *writer, struct iovec *iov, int count)
+{
+	// Once the client has stopped reading, the remaining responses are
+	// only freed.
+	if (writer->failed)
+		return;
+
+	if (write_all(writer->fd, iov, count) < 0) {
+		fprintf(stderr, "Failed to write response: %s\n", strerror(errno));
+		writer->failed = 1;
+	}
+}
+
+static
+void
+write_response(Writer *writer, Command *command)
+{
+	char *body = command->response ? command->response->str : "";
+	size_t length = command->response ? command->response->length : 0;
+
+	unsigned char header[RESPONSE_HEADER_SIZE];
+	struct iovec iov[2] = {
+		{ .iov_base = header, .iov_len = response_header(command, length, header) },
+		{ .iov_base = body, .iov_len = length },
+	};
+	write_iov(writer, iov, length > 0 ? 2 : 1);
+
+	if (command->typed && command->success) {
+		fprintf(stderr, "Wrote typed response of %zu bytes\n", length);
+		return;
+	}
+
+	fprintf(stderr, "Wrote response %s \"%.*s\"%s\n",
+	    command->success ? "true" : "false",
+	    (int)(length < RESPONSE_LOG_LIMIT ? length : RESPONSE_LOG_LIMIT), body,
+	    length > RESPONSE_LOG_LIMIT ? "..." : "");
+}
+
+///
+// Writes what has arrived of a streamed body, the header first. Returns 1
+// once the whole body has been written. Chunks beyond the announced length
+// are cut and a body completed short of it is padded with spaces, so that
+// the framing always holds.
+///
+static
+int
+write_streamed_response(Writer *writer, Command *command, int force)
+{
+	if (!writer->streaming) {
+		unsigned char header[RESPONSE_HEADER_SIZE];
+		struct iovec iov = {
+			.iov_base = header,
+			.iov_len = response_header(command, command->streamed_length, header),
+		};
+		write_iov(writer, &iov, 1);
+		writer->streaming = 1;
+		writer->streamed = 0;
+	}
+
+	// Completion is checked before taking the chunks, as the last chunk
+	// is added before the stream is marked complete.
+	int complete = force || atomic_load(&command->stream_complete);
+	ResponseChunk *chunk = atomic_exchange(&command->chunks, NULL);
+	ResponseChunk *ordered = NULL;
+	while (chunk != NULL) {
+		ResponseChunk *next = chunk->next;
+		chunk->next = ordered;
+		ordered = chunk;
+		chunk = next;
+	}
+
+	int released = 0;
+	while (ordered != NULL) {
+		ResponseChunk *next = ordered->next;
+		size_t remaining = command->streamed_length - writer->streamed;
+		size_t length = ordered->data->length < remaining ?
+		    ordered->data->length : remaining;
+		struct iovec iov = { .iov_base = ordered->data->str, .iov_len = length };
+		if (length > 0)
+			write_iov(writer, &iov, 1);
+		writer->streamed += length;
+		cef_string_userfree_utf8_free(ordered->data);
+		free(ordered);
+		released++;
+		ordered = next;
+	}
+	// The renderer sends the rest of the body as chunks are written.
+	if (released > 0 && !complete && command->held_window != NULL)
+		release_body_chunks(command->held_window, command->id, released);
+
+	if (!complete)
+		return 0;
+
+	char padding[256];
+	memset(padding, ' ', sizeof(padding));
+	while (writer->streamed < command->streamed_length) {
+		size_t remaining = command->streamed_length - writer->streamed;
+		struct iovec iov = {
+			.iov_base = padding,
+			.iov_len = remaining < sizeof(padding) ? remaining : sizeof(padding),
+		};
+		write_iov(writer, &iov, 1);
+		writer->streamed += iov.iov_len;
+	}
+
+	fprintf(stderr, "Wrote streamed response of %zu bytes\n",
+	    command->streamed_length);
+	writer->streaming = 0;
+	return 1;
+}
+
+static
+void *
+run_writer(void *arg)
+{
+	Writer *writer = arg;
+	// Responses taken from the pending stack but not yet written, oldest
+	// first. Only the first may be a body still streaming in.
+	Command *head = NULL, *tail = NULL;
+
+	for (;;) {
+		while (sem_wait(&writer->wake) < 0 && errno == EINTR)
+			;
+
+		// The pending stack is newest first, so it is reversed into the
+		// order the responses were handed over.
+		Command *command = atomic_exchange(&writer->pending, NULL);
+		Command *ordered = NULL, *last = command;
+		while (command != NULL) {
+			Command *next = command->next_response;
+			command->next_response = ordered;
+			ordered = command;
+			command = next;
+		}
+		if (ordered != NULL) {
+			if (tail != NULL)
+				tail->next_response = ordered;
+			else
+				head = ordered;
+			tail = last;
+		}
+
+		int stopping = atomic_load(&writer->stopping);
+		while (head != NULL) {
+			if (head->streamed) {
+				if (!write_streamed_response(writer, head, stopping))
+					break;
+			} else {
+				write_response(writer, head);
+			}
+
+			Command *next = head->next_response;
+			if (head->response != NULL)
+				cef_string_userfree_utf8_free(head->response);
+			if (head->held_window != NULL)
+				release_window(head->held_window);
+			arena_release(head->arena);
+			head = next;
+		}
+		if (head == NULL)
+			tail = NULL;
+
+		if (stopping && head == NULL &&
+		    atomic_load(&writer->pending) == NULL)
+			return NULL;
+	}
+}
+
+void
+start_writer(Writer *writer, int fd)
+{
+	writer->fd = fd;
+	atomic_init(&writer->pending, NULL);
+	atomic_init(&writer->stopping, 0);
+	atomic_init(&writer->handed_over, 0);
+	atomic_init(&writer->handing_over_ns, 0);
+	writer->failed = 0;
+	writer->streaming = 0;
+	sem_init(&writer->wake, 0, 0);
+	pthread_create(&writer->thread, NULL, run_writer, writer);
+}
+
+void
+hand_over_response(Writer *writer, Command *command)
+{
+	struct timespec started, now;
+	clock_gettime(CLOCK_MONOTONIC, &started);
+
+	Command *head = atomic_load(&writer->pending);
+	do {
+		command->next_response = head;
+	} while (!atomic_compare_exchange_weak(&writer->pending, &head, command));
+	sem_post(&writer->wake);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	atomic_fetch_add(&writer->handed_over, 1);
+	atomic_fetch_add(&writer->handing_over_ns,
+	    (now.tv_sec - started.tv_sec) * 1000000000L +
+	    (now.tv_nsec - started.tv_nsec));
+}
+
+void
+wake_writer(Writer *writer)
+{
+	sem_post(&writer->wake);
+}
+
+void
+stop_writer(Writer *writer)
+{
+	atomic_store(&writer->stopping, 1);
+	sem_post(&writer->wake);
+	pthread_join(writer->thread, NULL);
+	sem_destroy(&writer->wake);
+
+	fprintf(stderr, "Handed over %lu responses in %.3f ms of UI thread time\n",
+	    atomic_load(&writer->handed_over),
+	    atomic_load(&writer->handing_over_ns) / 1e6);
+}
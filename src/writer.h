@@ -0,0 +1,55 @@
+#pragma once
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+#include "command.h"
+
+// Responses are logged up to this many bytes.
+#define RESPONSE_LOG_LIMIT 256
+
+///
+// Writes the responses of one session from a thread of its own, so that a
+// client slow to read them holds up that thread rather than the UI thread.
+///
+typedef struct {
+	int fd;
+	// Commands handed over but not yet taken by the writer thread, newest
+	// first and linked through next_response. Pushed without a lock by
+	// any thread and taken all at once by the writer thread.
+	_Atomic(Command *) pending;
+	sem_t wake;
+	atomic_int stopping;
+	int failed;
+	// Set while the body of the oldest response is being streamed, with
+	// the number of body bytes written so far.
+	int streaming;
+	size_t streamed;
+	pthread_t thread;
+	// Time the threads handing responses over, in practice the UI thread,
+	// spent doing so.
+	atomic_ulong handed_over;
+	atomic_long handing_over_ns;
+} Writer;
+
+void start_writer(Writer *writer, int fd);
+
+///
+// Queues the response of a finished command. The writer thread takes over
+// the command, writing its response with a single writev(2), or a streamed
+// body chunk by chunk as it arrives, and then freeing the response and the
+// command's arena. Safe to call from any thread; responses are written in
+// the order they were handed over.
+///
+void hand_over_response(Writer *writer, Command *command);
+
+///
+// Tells the writer that more of a streamed body has arrived.
+///
+void wake_writer(Writer *writer);
+
+///
+// Writes every response handed over so far and stops the writer thread.
+///
+void stop_writer(Writer *writer);
@@ -0,0 +1,248 @@
+// Checks transcode.c against strings encoded one code point at a time,
+// around the lengths where the SSE2 and AVX2 loops hand over to the scalar
+// ones. Run with `make test`.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "src/transcode.h"
+
+// Longer than two AVX2 blocks, so every kernel sees a full block and a tail.
+#define MAX_LENGTH 80
+
+static int failures;
+
+#define CHECK(condition, ...) \
+	do { \
+		if (!(condition)) { \
+			failures++; \
+			fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+			fprintf(stderr, __VA_ARGS__); \
+			fprintf(stderr, "\n"); \
+		} \
+	} while (0)
+
+typedef struct {
+	char utf8[MAX_LENGTH * 4 + 1];
+	size_t utf8_length;
+	char16 utf16[MAX_LENGTH * 2 + 1];
+	size_t utf16_length;
+} Encoded;
+
+static
+void
+append(Encoded *encoded, unsigned int code_point)
+{
+	unsigned char *dst = (unsigned char *)encoded->utf8;
+	size_t *length = &encoded->utf8_length;
+
+	if (code_point < 0x80) {
+		dst[(*length)++] = code_point;
+	} else if (code_point < 0x800) {
+		dst[(*length)++] = 0xc0 | (code_point >> 6);
+		dst[(*length)++] = 0x80 | (code_point & 0x3f);
+	} else if (code_point < 0x10000) {
+		dst[(*length)++] = 0xe0 | (code_point >> 12);
+		dst[(*length)++] = 0x80 | ((code_point >> 6) & 0x3f);
+		dst[(*length)++] = 0x80 | (code_point & 0x3f);
+	} else {
+		dst[(*length)++] = 0xf0 | (code_point >> 18);
+		dst[(*length)++] = 0x80 | ((code_point >> 12) & 0x3f);
+		dst[(*length)++] = 0x80 | ((code_point >> 6) & 0x3f);
+		dst[(*length)++] = 0x80 | (code_point & 0x3f);
+	}
+
+	if (code_point < 0x10000) {
+		encoded->utf16[encoded->utf16_length++] = code_point;
+	} else {
+		code_point -= 0x10000;
+		encoded->utf16[encoded->utf16_length++] = 0xd800 | (code_point >> 10);
+		encoded->utf16[encoded->utf16_length++] = 0xdc00 | (code_point & 0x3ff);
+	}
+}
+
+///
+// Converts |encoded| both ways and compares the results with the other
+// encoding.
+///
+static
+void
+check_both_ways(const Encoded *encoded, const char *what, size_t length,
+    size_t position)
+{
+	cef_string_utf16_t utf16 = {};
+	int valid = transcode_utf8_to_utf16(encoded->utf8, encoded->utf8_length,
+	    &utf16);
+	CHECK(valid && utf16.length == encoded->utf16_length &&
+	    memcmp(utf16.str, encoded->utf16,
+	    utf16.length * sizeof(char16)) == 0 && utf16.str[utf16.length] == 0,
+	    "utf8_to_utf16: %s at %zu of %zu", what, position, length);
+	cef_string_utf16_clear(&utf16);
+
+	cef_string_utf8_t utf8 = {};
+	valid = transcode_utf16_to_utf8(encoded->utf16, encoded->utf16_length,
+	    &utf8);
+	CHECK(valid && utf8.length == encoded->utf8_length &&
+	    memcmp(utf8.str, encoded->utf8, utf8.length) == 0 &&
+	    utf8.str[utf8.length] == 0,
+	    "utf16_to_utf8: %s at %zu of %zu", what, position, length);
+	cef_string_utf8_clear(&utf8);
+}
+
+///
+// Puts each kind of character at every position of ASCII strings of every
+// length up to MAX_LENGTH, so that the SIMD loops stop on it in every lane
+// and the scalar loops pick up after them.
+///
+static
+void
+test_boundaries(void)
+{
+	static const struct {
+		unsigned int code_point;
+		const char *what;
+	} kinds[] = {
+		{ 'a', "ASCII" },
+		{ 0x7f, "DEL" },
+		{ 0xe9, "Latin-1" },
+		{ 0x65e5, "CJK" },
+		{ 0x1f600, "astral" },
+	};
+
+	for (size_t k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++) {
+		for (size_t length = 0; length <= MAX_LENGTH; length++) {
+			for (size_t position = 0; position < length || position == 0;
+			    position++) {
+				Encoded encoded = {};
+				for (size_t i = 0; i < length; i++)
+					append(&encoded, i == position ?
+					    kinds[k].code_point : 'a' + i % 26);
+				check_both_ways(&encoded, kinds[k].what, length, position);
+			}
+		}
+	}
+}
+
+///
+// Starts surrogate pairs one unit before, at and one unit after every
+// multiple of 8 UTF-16 units, so that the pair straddles the end of the
+// blocks the SIMD loops narrow.
+///
+static
+void
+test_split_pairs(void)
+{
+	for (size_t boundary = 8; boundary <= 64; boundary += 8) {
+		for (size_t start = boundary - 1; start <= boundary + 1; start++) {
+			Encoded encoded = {};
+			for (size_t i = 0; i < start; i++)
+				append(&encoded, 'x');
+			append(&encoded, 0x1f600);
+			for (size_t i = 0; i < 8; i++)
+				append(&encoded, 'y');
+			check_both_ways(&encoded, "split pair", start + 9, start);
+		}
+	}
+}
+
+static
+void
+check_lone_surrogates(const char16 *src, size_t src_len, const char *expected,
+    const char *what)
+{
+	cef_string_utf8_t utf8 = {};
+	int valid = transcode_utf16_to_utf8(src, src_len, &utf8);
+	CHECK(!valid && utf8.length == strlen(expected) &&
+	    memcmp(utf8.str, expected, utf8.length) == 0,
+	    "utf16_to_utf8: %s", what);
+	cef_string_utf8_clear(&utf8);
+}
+
+///
+// Lone surrogates become U+FFFD and make the conversion report invalid
+// input, at the start, in the middle and at the end of the string and right
+// after an SSE2 and an AVX2 block.
+///
+static
+void
+test_lone_surrogates(void)
+{
+	static const char16 high_at_end[] = { 'a', 0xd83d };
+	check_lone_surrogates(high_at_end, 2, "a\xef\xbf\xbd", "high at end");
+
+	static const char16 high_then_ascii[] = { 0xd83d, 'a' };
+	check_lone_surrogates(high_then_ascii, 2, "\xef\xbf\xbd" "a",
+	    "high then ASCII");
+
+	static const char16 low_alone[] = { 'a', 0xde00, 'b' };
+	check_lone_surrogates(low_alone, 3, "a\xef\xbf\xbd" "b", "low alone");
+
+	static const char16 reversed[] = { 0xde00, 0xd83d };
+	check_lone_surrogates(reversed, 2, "\xef\xbf\xbd\xef\xbf\xbd",
+	    "reversed pair");
+
+	static const char16 two_highs[] = { 0xd83d, 0xd83d, 0xde00 };
+	check_lone_surrogates(two_highs, 3, "\xef\xbf\xbd\xf0\x9f\x98\x80",
+	    "high before a pair");
+
+	for (size_t boundary = 16; boundary <= 32; boundary += 16) {
+		char16 src[40];
+		char expected[48];
+		for (size_t i = 0; i < boundary; i++)
+			src[i] = expected[i] = 'z';
+		src[boundary] = 0xdc00;
+		memcpy(expected + boundary, "\xef\xbf\xbd", 4);
+		check_lone_surrogates(src, boundary + 1, expected,
+		    "low after a block");
+	}
+}
+
+static
+void
+check_invalid_utf8(const char *src, const char16 *expected,
+    size_t expected_length, const char *what)
+{
+	cef_string_utf16_t utf16 = {};
+	int valid = transcode_utf8_to_utf16(src, strlen(src), &utf16);
+	CHECK(!valid && utf16.length == expected_length &&
+	    memcmp(utf16.str, expected, expected_length * sizeof(char16)) == 0,
+	    "utf8_to_utf16: %s", what);
+	cef_string_utf16_clear(&utf16);
+}
+
+///
+// Malformed UTF-8 becomes U+FFFD per maximal invalid prefix.
+///
+static
+void
+test_invalid_utf8(void)
+{
+	static const char16 replaced[] = { 0xfffd, 'a' };
+	check_invalid_utf8("\x80" "a", replaced, 2, "stray continuation");
+	check_invalid_utf8("\xe6\x97" "a", replaced, 2, "truncated CJK");
+	check_invalid_utf8("\xed\xa0\x80",
+	    (const char16[]){ 0xfffd, 0xfffd, 0xfffd }, 3, "encoded surrogate");
+
+	static const char16 overlong[] = { 0xfffd, 0xfffd, 'a' };
+	check_invalid_utf8("\xc0\xaf" "a", overlong, 3, "overlong slash");
+
+	static const char16 truncated_at_end[] = { 'a', 0xfffd };
+	check_invalid_utf8("a\xf0\x9f\x98", truncated_at_end, 2,
+	    "truncated astral at end");
+}
+
+int
+main(void)
+{
+	test_boundaries();
+	test_split_pairs();
+	test_lone_surrogates();
+	test_invalid_utf8();
+
+	if (failures > 0) {
+		fprintf(stderr, "%d transcode check(s) failed\n", failures);
+		return 1;
+	}
+	fprintf(stderr, "transcode checks passed\n");
+	return 0;
+}